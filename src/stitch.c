@@ -1,18 +1,48 @@
 #include "config.h"
+#include "stitch.h"
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <strings.h>
 #include <math.h>
+#include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <stdarg.h>
 #include <curl/curl.h>
 
+#ifdef __linux__
+#	include <linux/fs.h>
+#endif
+
 #if JPEG_FOUND
 #	include <jpeglib.h>
 #endif
 
 #if PNG_FOUND
 #	include <png.h>
+#	include <zlib.h>
+#endif
+
+#if LZ4_FOUND
+#	include <lz4.h>
 #endif
 
 #if GEOTIFF_FOUND
@@ -20,16 +50,146 @@
 #	include <xtiffio.h>
 #endif
 
+// Messages have a level: errors are always printed, what stitch is doing
+// only unless -Q, and every URL it fetches only with -v. All of them go
+// through stitch_log(), so that none lands in the middle of the progress
+// line. The command buffers stderr, and only the URLs wait in the buffer
+// until something else is printed.
+enum log_level {
+	LOG_ERROR,
+	LOG_INFO,
+	LOG_DEBUG
+};
+
+static int log_level = LOG_INFO;
+
+static void stitch_log(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// A render started by stitch_render() unwinds to it when something fails, with
+// the status; anywhere else, as in the command, the process exits. What the
+// render holds at the time is released, newest first, before it unwinds.
+struct stitch_held {
+	void (*release)(void *);
+	void *p;
+};
+
+struct stitch_frame {
+	jmp_buf env;
+	stitch_ctx *ctx;
+	stitch_write_fn write;  // where output meant for stdout goes, if not there
+	int (*cancel)(void *);  // whether the caller has given up on the render
+	void *user;             // of write and cancel
+	FILE *tee;              // gets a copy of what goes to write, if set
+	struct tile_cache *cache;
+	struct stitch_held *held;
+	int nheld, heldalloc;
+};
+
+static __thread struct stitch_frame *frame;
+
+struct stitch_ctx {
+	struct pixel_cache *pixels;
+	CURLSH *share;
+	pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+	int parallel;
+};
+
+static void stitch_fail(stitch_status status) __attribute__((noreturn));
+
+// Releases what the frame holds. The stack of the failing render is still
+// there, so what is held may be on it.
+static void frame_release(struct stitch_frame *fr) {
+	while (fr->nheld > 0) {
+		struct stitch_held h = fr->held[--fr->nheld];
+		h.release(h.p);
+	}
+}
+
+static void stitch_fail(stitch_status status) {
+	if (frame != NULL) {
+		frame_release(frame);
+		longjmp(frame->env, status);
+	}
+	exit(EXIT_FAILURE);
+}
+
+// Fails the render if its caller has given up on it. It is checked between
+// tiles and during transfers, so the render stops within one of them.
+static void frame_check(void) {
+	if (frame != NULL && frame->cancel != NULL && frame->cancel(frame->user)) {
+		stitch_log(LOG_ERROR, "Render cancelled\n");
+		stitch_fail(STITCH_ERR_CANCELLED);
+	}
+}
+
+// Has a failure of the render release p. Outside a render there is nothing
+// to do, since a failure ends the process.
+static void frame_hold(void *p, void (*release)(void *)) {
+	if (frame == NULL || p == NULL) {
+		return;
+	}
+	if (frame->nheld == frame->heldalloc) {
+		int n = frame->heldalloc * 2 + 16;
+		struct stitch_held *held = realloc(frame->held, n * sizeof(struct stitch_held));
+
+		if (held == NULL) {
+			release(p);
+			stitch_log(LOG_ERROR, "Can't allocate memory for the render\n");
+			stitch_fail(STITCH_ERR_MEMORY);
+		}
+		frame->held = held;
+		frame->heldalloc = n;
+	}
+	frame->held[frame->nheld].release = release;
+	frame->held[frame->nheld].p = p;
+	frame->nheld++;
+}
+
+// Forgets p, which its owner is about to release itself
+static void frame_drop(void *p) {
+	int k;
+
+	if (frame == NULL || p == NULL) {
+		return;
+	}
+	for (k = frame->nheld - 1; k >= 0; k--) {
+		if (frame->held[k].p == p) {
+			memmove(&frame->held[k], &frame->held[k + 1], (frame->nheld - k - 1) * sizeof(struct stitch_held));
+			frame->nheld--;
+			return;
+		}
+	}
+}
+
+static void frame_free(void *p) {
+	frame_drop(p);
+	free(p);
+}
+
+static void release_file(void *p) {
+	fclose(p);
+}
+
 typedef enum {
 	PROJECTION_SPHERICAL_MERCATOR = 0,
-	EPSG_3785 = 0
+	EPSG_3785 = 0,
+	PROJECTION_GEOGRAPHIC = 1,
+	EPSG_4326 = 1
 } stitch_projection_t;
 
+typedef enum {
+	ELEVATION_DEFAULT = 0,
+	ELEVATION_TERRARIUM,
+	ELEVATION_MAPBOX,
+	ELEVATION_NORMAL
+} elevation_encoding_t;
+
 typedef struct {
 	const char* name;
 	const char* description;
 	const char* url;
 	stitch_projection_t projection;
+	elevation_encoding_t encoding;
 } tileset_t;
 
 const tileset_t presets[] = {
@@ -37,14 +197,16 @@ const tileset_t presets[] = {
 		"aws:terrarium",
 		"Amazon AWS open elevation map (Terrarium format)",
 		"https://s3.amazonaws.com/elevation-tiles-prod/terrarium/{z}/{x}/{y}.png",
-		PROJECTION_SPHERICAL_MERCATOR
+		PROJECTION_SPHERICAL_MERCATOR,
+		ELEVATION_TERRARIUM
 	},
 
 	{
 		"aws:normal",
 		"Amazon AWS open elevation map (normal vector format)",
 		"https://s3.amazonaws.com/elevation-tiles-prod/normal/{z}/{x}/{y}.png",
-		PROJECTION_SPHERICAL_MERCATOR
+		PROJECTION_SPHERICAL_MERCATOR,
+		ELEVATION_NORMAL
 	},
 
 	{
@@ -153,11 +315,23 @@ const char* format_projection(stitch_projection_t projection) {
 		case PROJECTION_SPHERICAL_MERCATOR:
 			return "EPSG:3857";
 
+		case PROJECTION_GEOGRAPHIC:
+			return "EPSG:4326";
+
 		default:
 			return "unknown projection";
 	}
 }
 
+stitch_projection_t parse_projection(const char *name) {
+	if (!strcasecmp(name, "EPSG:3857") || !strcmp(name, "3857") || !strcasecmp(name, "mercator")) {
+		return PROJECTION_SPHERICAL_MERCATOR;
+	} else if (!strcasecmp(name, "EPSG:4326") || !strcmp(name, "4326") || !strcasecmp(name, "geographic")) {
+		return PROJECTION_GEOGRAPHIC;
+	}
+	return -1;
+}
+
 const tileset_t* find_preset_by_name(const char* name) {
 	if (name == 0) {
 		return 0;
@@ -171,15 +345,138 @@ const tileset_t* find_preset_by_name(const char* name) {
 	return 0;
 }
 
+// Resolves a layer argument, which is either a preset name or a URL template
+const char *layer_url(const char *layer) {
+	const tileset_t *preset = find_preset_by_name(layer);
+	return preset ? preset->url : layer;
+}
+
+// WMS layers have a {bbox} (or {bbox-epsg-3857}) token for the Mercator
+// bounds of the area to render, and {width} and {height} tokens for its size
+// in pixels. Instead of a request per tile, they are fetched as windows of
+// whole tiles up to the job's getmap size a side, and each tile is cut from
+// its window as it is composited.
+int layer_getmap(const char *url) {
+	return strstr(url, "{bbox}") != NULL || strstr(url, "{bbox-epsg-3857}") != NULL;
+}
+
+// Local GeoTIFFs in EPSG:3857, given by a file name ending in .tif or .tiff,
+// are layers too; see raster_tile()
+int layer_raster(const char *url) {
+	size_t len = strlen(url);
+
+	return strstr(url, "://") == NULL &&
+	       ((len > 4 && !strcasecmp(url + len - 4, ".tif")) || (len > 5 && !strcasecmp(url + len - 5, ".tiff")));
+}
+
 void list_presets() {
 	for (const tileset_t* ptr = presets; ptr->name != 0; ptr++) {
-		fprintf(stderr, "    %-20s %s\n", ptr->name, ptr->description);
+		stitch_log(LOG_ERROR, "    %-20s %s\n", ptr->name, ptr->description);
 	}
 }
 
+// Value written to the float32 elevation grid where no tile supplied data
+#define ELEVATION_NODATA -32768.0f
+
+// Rows per strip of the TIFFs written, which shard boundaries are aligned to
+#define TIFF_ROWS_PER_STRIP 20
+
+// Block size of the tiled TIFFs that -U updates in place
+#define TIFF_BLOCK_SIZE 256
+
 void usage(char **argv) {
-	fprintf(stderr, "Usage: %s [-o outfile] [-f png|geotiff] [-e] minlat minlon maxlat maxlon zoom http://whatever/{z}/{x}/{y}.png ...\n", argv[0]);
-	fprintf(stderr, "Usage: %s [-o outfile] [-f png|geotiff] [-e] -c lat lon width height zoom http://whatever/{z}/{x}/{y}.png ...\n", argv[0]);
+	fprintf(stderr, "Usage: %s [-o outfile] [-f png|geotiff|float32] [-e] [-E terrarium|mapbox|normal] [-R hillshade|slope] [-W width] [-H height] [-r resolution] [-F filter] [-p EPSG:3857|EPSG:4326] minlat minlon maxlat maxlon zoom http://whatever/{z}/{x}/{y}.png ...\n", argv[0]);
+	fprintf(stderr, "Usage: %s [-o outfile] [-f png|geotiff|float32] [-e] [-E terrarium|mapbox|normal] [-R hillshade|slope] [-W width] [-H height] [-r resolution] [-F filter] [-p EPSG:3857|EPSG:4326] -c lat lon width height zoom http://whatever/{z}/{x}/{y}.png ...\n", argv[0]);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "-f float32 decodes elevation tiles into a single-band float32 GeoTIFF\n");
+	fprintf(stderr, "in meters, with %g as the nodata value. -e writes the elevations\n", ELEVATION_NODATA);
+	fprintf(stderr, "normalized to grayscale instead. -E selects the elevation encoding of the\n");
+	fprintf(stderr, "tiles; it defaults to the encoding of the preset, or terrarium.\n");
+	fprintf(stderr, "-R computes a hillshade or the slope in degrees from the elevations instead.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "-W width, -H height or -r meters per pixel resample the output to that size\n");
+	fprintf(stderr, "from the smallest sufficient zoom, up to the one given, with -F box|bilinear|lanczos.\n");
+	fprintf(stderr, "-p EPSG:4326 reprojects the output to latitude/longitude in the same pass;\n");
+	fprintf(stderr, "-r is then in degrees.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Layers whose URLs have an {r} token (\"@2x\" for retina tiles) are fetched as\n");
+	fprintf(stderr, "512 pixel tiles from one zoom level up, a quarter as many requests.\n");
+	fprintf(stderr, "Besides {z}, {x} and {y}, URLs may have {-y} for the TMS row, {q} for the\n");
+	fprintf(stderr, "quadkey and {s} for an a/b/c subdomain.\n");
+	fprintf(stderr, "-O levels fills in missing tiles from their nearest ancestor up to that many\n");
+	fprintf(stderr, "zoom levels up, scaled up.\n");
+	fprintf(stderr, "-S i/N renders only the i-th of N stripes of tile rows, from 0.\n");
+	fprintf(stderr, "-J journal keeps the image in progress on disk, and continues from it if\n");
+	fprintf(stderr, "the same command was interrupted.\n");
+	fprintf(stderr, "-U validators keeps the ETags of the tiles of a GeoTIFF output in that file, and\n");
+	fprintf(stderr, "on the next run rewrites only the blocks of the output under the tiles that changed.\n");
+	fprintf(stderr, "Layers whose URLs have a {bbox} token, with {width} and {height}, are WMS GetMap\n");
+	fprintf(stderr, "requests, made for windows of whole tiles up to -g pixels a side (default 2048).\n");
+	fprintf(stderr, "A layer may also be a local .tif GeoTIFF in EPSG:3857 with 8-bit gray or RGB\n");
+	fprintf(stderr, "samples, of which only the blocks under the output are read.\n");
+	fprintf(stderr, "-Z minzoom also writes every zoom from minzoom up to the one given, each reduced\n");
+	fprintf(stderr, "from the one below; the output file name has a {z} token for the zoom.\n");
+	fprintf(stderr, "-C dir keeps a copy of each output in that directory, and copies it out again\n");
+	fprintf(stderr, "instead of rendering the same job twice. With -V the tiles of a cached output\n");
+	fprintf(stderr, "are asked for again first, and it is only reused if none of them changed.\n");
+	fprintf(stderr, "-D megabytes keeps up to that much of decoded tiles in memory (default 256),\n");
+	fprintf(stderr, "keyed by their encoded bytes, to copy instead of decode them again; -K dir\n");
+	fprintf(stderr, "also keeps them in that directory across runs, up to -k megabytes of files\n");
+	fprintf(stderr, "(default 1024), the least recently used removed first.\n");
+	fprintf(stderr, "-P stats.json writes where the time went: the DNS, connect, TLS, wait and\n");
+	fprintf(stderr, "transfer time of the tiles by host, decoding, blending and encoding, bytes in\n");
+	fprintf(stderr, "and out, cache hits and peak memory.\n");
+	fprintf(stderr, "-X trace.json writes a timeline of the run for Perfetto or chrome://tracing:\n");
+	fprintf(stderr, "the queue wait and transfer of each tile, its decoding and blitting, and the\n");
+	fprintf(stderr, "encoding of the output, by thread and by connection.\n");
+	fprintf(stderr, "-v also prints the URL of every tile fetched or missing, and -Q prints only\n");
+	fprintf(stderr, "errors. Otherwise the tiles done and missing, tiles and megabytes a second,\n");
+	fprintf(stderr, "cache hits and time left are shown as they are fetched, or every few seconds\n");
+	fprintf(stderr, "as a JSON line if stderr isn't a terminal.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Usage: %s -d\n", argv[0]);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "-d runs a daemon on a Unix socket ($STITCH_SOCKET, or stitch.sock in\n");
+	fprintf(stderr, "$XDG_RUNTIME_DIR or /tmp/stitch-uid) that keeps warm connections and recent\n");
+	fprintf(stderr, "tiles; other stitch processes of the same user that find it fetch their tiles\n");
+	fprintf(stderr, "through it.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Usage: %s [options] [-j parallel] [-T seconds] -l [host:]port\n", argv[0]);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "-l serves GET /stitch?bbox=minlat,minlon,maxlat,maxlon&zoom=z&layers=a,b as PNG, on\n");
+	fprintf(stderr, "localhost unless a host is given. Requests may also set center, size, width,\n");
+	fprintf(stderr, "height, resolution, filter, projection, overzoom, tilesize, getmap, encoding,\n");
+	fprintf(stderr, "relief and elevation. -j requests are rendered at a time, sharing the decoded\n");
+	fprintf(stderr, "tiles of -D (256 MB by default), and each is given up after -T seconds (default\n");
+	fprintf(stderr, "60) or when its client hangs up.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Usage: %s -M -o outfile shard0 shard1 ...\n", argv[0]);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "-M joins the PNG or TIFF outputs of -S shards, in order, without decoding them.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Usage: %s [options] -m area.geojson zoom http://whatever/{z}/{x}/{y}.png ...\n", argv[0]);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "-m covers the polygons of a GeoJSON file, fetching only the tiles that\n");
+	fprintf(stderr, "intersect them; pixels outside are transparent, or nodata.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Usage: %s [-o outfile] [-f csv|binary] [-E encoding] [-j parallel] -q points.txt [-L step] zoom http://whatever/{z}/{x}/{y}.png ...\n", argv[0]);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "-q samples the elevation at the \"lat lon\" points listed in a file (- for stdin),\n");
+	fprintf(stderr, "fetching only the tiles under them, 4 x -j at a time. With -L the points are a\n");
+	fprintf(stderr, "polyline that is sampled every step meters. Binary output is native doubles:\n");
+	fprintf(stderr, "lat, lon, distance along the polyline, elevation.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Usage: %s [options] [-j parallel] -b jobs.jsonl\n", argv[0]);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "-b runs one job per line of a JSON lines file (- for stdin), for example\n");
+	fprintf(stderr, "  {\"bbox\": [37.7, -122.5, 37.8, -122.4], \"zoom\": 12, \"layers\": [\"osm\"], \"output\": \"sf.png\"}\n");
+	fprintf(stderr, "  {\"center\": [35.68, 139.75], \"size\": [640, 480], \"zoom\": 10, \"layers\": \"osm\", \"output\": \"tokyo.png\"}\n");
+	fprintf(stderr, "Jobs may also set format, tilesize, encoding, relief, elevation, worldfile,\n");
+	fprintf(stderr, "width, height, resolution, filter, projection, overzoom, minzoom, getmap, journal,\n");
+	fprintf(stderr, "results, revalidate and mask, which sets the area unless a bbox is also given;\n");
+	fprintf(stderr, "other options on the command line are the defaults. The tiles of all jobs are\n");
+	fprintf(stderr, "fetched once up front, except for jobs whose results are cached, and -j jobs\n");
+	fprintf(stderr, "run in parallel.\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "You may also use one of the following presets instead of a URL:\n");
 	fprintf(stderr, "\n");
@@ -225,7 +522,25 @@ struct image {
 };
 
 enum outfileformat { OUTFMT_PNG,
-		     OUTFMT_GEOTIFF };
+		     OUTFMT_GEOTIFF,
+		     OUTFMT_GEOTIFF_FLOAT32,
+		     OUTFMT_CSV,
+		     OUTFMT_BINARY };
+
+int parse_outfmt(const char *name) {
+	if (strcmp(name, "png") == 0) {
+		return OUTFMT_PNG;
+	} else if (strcmp(name, "geotiff") == 0) {
+		return OUTFMT_GEOTIFF;
+	} else if (strcmp(name, "float32") == 0) {
+		return OUTFMT_GEOTIFF_FLOAT32;
+	} else if (strcmp(name, "csv") == 0) {
+		return OUTFMT_CSV;
+	} else if (strcmp(name, "binary") == 0) {
+		return OUTFMT_BINARY;
+	}
+	return -1;
+}
 
 size_t curl_receive(char *ptr, size_t size, size_t nmemb, void *v) {
 	struct data *data = v;
@@ -241,637 +556,9494 @@ size_t curl_receive(char *ptr, size_t size, size_t nmemb, void *v) {
 	return size * nmemb;
 };
 
-#if JPEG_FOUND
-struct image *read_jpeg(char *s, int len) {
-	struct jpeg_decompress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_decompress(&cinfo);
-	jpeg_mem_src(&cinfo, (unsigned char *) s, len);
-	jpeg_read_header(&cinfo, TRUE);
-	jpeg_start_decompress(&cinfo);
-
-	int row_stride = cinfo.output_width * cinfo.output_components;
-	JSAMPARRAY buffer = (*cinfo.mem->alloc_sarray)((j_common_ptr) &cinfo, JPOOL_IMAGE, row_stride, 1);
-
-	struct image *i = malloc(sizeof(struct image));
-	i->buf = malloc(cinfo.output_width * cinfo.output_height * cinfo.output_components);
-	i->width = cinfo.output_width;
-	i->height = cinfo.output_height;
-	i->depth = cinfo.output_components;
+void read_file(const char *fname, struct data *out) {
+	FILE *fp = fopen(fname, "rb");
+	char chunk[16384];
+	size_t n;
 
-	unsigned char *here = i->buf;
-	while (cinfo.output_scanline < cinfo.output_height) {
-		jpeg_read_scanlines(&cinfo, buffer, 1);
-		memcpy(here, buffer[0], row_stride);
-		here += row_stride;
+	if (fp == NULL) {
+		stitch_log(LOG_ERROR, "%s: %s\n", fname, strerror(errno));
+		stitch_fail(STITCH_ERR_IO);
 	}
-
-	jpeg_finish_decompress(&cinfo);
-	jpeg_destroy_decompress(&cinfo);
-
-	return i;
-}
-#else /* JPEG_FOUND */
-struct image *read_jpeg(char *s, int len) {
-	fprintf(stderr, "stitch was compiled without JPEG support, sorry\n");
-	return 0;
+	while ((n = fread(chunk, 1, sizeof chunk, fp)) > 0) {
+		curl_receive(chunk, 1, n, out);
+	}
+	fclose(fp);
 }
-#endif /* JPEG_FOUND */
 
-static void fail(png_structp png_ptr, png_const_charp error_msg) {
-	fprintf(stderr, "PNG error %s\n", error_msg);
-	exit(EXIT_FAILURE);
-}
+// Where the time of a run goes, for -P: the phases of the transfers by host,
+// decoding by tile format, blending, encoding by output format, bytes in and
+// out and how often the caches were hit. Nothing is measured unless asked.
+#define STATS_BUCKETS 16  // of a histogram: under 1 ms, 2 ms, 4 ms, ... and the rest
+
+enum stats_phase {
+	PHASE_DNS,
+	PHASE_CONNECT,
+	PHASE_TLS,
+	PHASE_WAIT,      // from the request to the first byte of the answer
+	PHASE_TRANSFER,
+	PHASE_TOTAL,
+	NPHASES
+};
 
-struct read_state {
-	char *base;
-	int off;
-	int len;
+static const char *stats_phase_names[NPHASES] = { "dns", "connect", "tls", "wait", "transfer", "total" };
+
+struct stats_host {
+	char *host;
+	long requests, errors;
+	long long bytes;
+	double seconds[NPHASES];
+	long histogram[NPHASES][STATS_BUCKETS];
+	struct stats_host *next;
 };
 
-void user_read_data(png_structp png_ptr, png_bytep data, png_size_t length) {
-	struct read_state *state = png_get_io_ptr(png_ptr);
+struct stats_timer {
+	long count;
+	double seconds;
+};
 
-	if (state->off + length > state->len) {
-		length = state->len - state->off;
-	}
+struct stats {
+	pthread_mutex_t lock;
+	const char *path;
+	double start;
+	struct stats_host *hosts;
+	struct stats_timer decode[2];          // png, jpeg
+	struct stats_timer blend[2];           // rgba, elevation
+	struct stats_timer encode[OUTFMT_GEOTIFF_FLOAT32 + 1];
+	long long bytes_in, bytes_out;
+	long tile_lookups, tile_hits;          // of tiles prefetched for a batch
+	long result_lookups, result_hits;
+};
 
-	memcpy(data, state->base + state->off, length);
-	state->off += length;
-}
+static struct stats *stats;
 
-#if PNG_FOUND
-struct image *read_png(char *s, int len) {
-	png_structp png_ptr;
-	png_infop info_ptr;
+static double stats_clock(void) {
+	struct timespec ts;
 
-	struct read_state state;
-	state.base = s;
-	state.off = 0;
-	state.len = len;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, fail, fail, fail);
-	if (png_ptr == NULL) {
-		fprintf(stderr, "PNG init failed\n");
-		exit(EXIT_FAILURE);
+void stats_init(const char *path) {
+	stats = calloc(1, sizeof(struct stats));
+	if (stats == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for statistics\n");
+		stitch_fail(STITCH_ERR_MEMORY);
 	}
+	pthread_mutex_init(&stats->lock, NULL);
+	stats->path = path;
+	stats->start = stats_clock();
+}
 
-	info_ptr = png_create_info_struct(png_ptr);
-	if (info_ptr == NULL) {
-		fprintf(stderr, "PNG init failed\n");
-		exit(EXIT_FAILURE);
-	}
+// Adds the time since start to a timer
+static void stats_time(struct stats_timer *t, double start) {
+	double elapsed = stats_clock() - start;
 
-	png_set_read_fn(png_ptr, &state, user_read_data);
-	png_set_sig_bytes(png_ptr, 0);
+	pthread_mutex_lock(&stats->lock);
+	t->count++;
+	t->seconds += elapsed;
+	pthread_mutex_unlock(&stats->lock);
+}
 
-	png_read_png(png_ptr, info_ptr, PNG_TRANSFORM_STRIP_16 | PNG_TRANSFORM_PACKING | PNG_TRANSFORM_EXPAND, NULL);
+static struct stats_host *stats_host(const char *url) {
+	const char *cp = strstr(url, "://");
+	struct stats_host *sh;
+	size_t len;
 
-	png_uint_32 width, height;
-	int bit_depth;
-	int color_type, interlace_type;
+	cp = cp != NULL ? cp + 3 : url;
+	len = strcspn(cp, "/?#");
+	for (sh = stats->hosts; sh != NULL; sh = sh->next) {
+		if (strlen(sh->host) == len && !strncmp(sh->host, cp, len)) {
+			return sh;
+		}
+	}
+	if ((sh = calloc(1, sizeof(struct stats_host))) == NULL || (sh->host = strndup(cp, len)) == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for statistics\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	sh->next = stats->hosts;
+	stats->hosts = sh;
+	return sh;
+}
 
-	png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type, &interlace_type, NULL, NULL);
+static void stats_phase(struct stats_host *sh, int phase, double seconds) {
+	int b = 0;
 
-	struct image *i = malloc(sizeof(struct image));
-	i->width = width;
-	i->height = height;
-	i->depth = png_get_channels(png_ptr, info_ptr);
-	i->buf = malloc(i->width * i->height * i->depth);
+	if (seconds < 0) {
+		seconds = 0;
+	}
+	while (b < STATS_BUCKETS - 1 && seconds >= (1 << b) / 1000.0) {
+		b++;
+	}
+	sh->seconds[phase] += seconds;
+	sh->histogram[phase][b]++;
+}
 
-	unsigned int row_bytes = png_get_rowbytes(png_ptr, info_ptr);
-	png_bytepp row_pointers = png_get_rows(png_ptr, info_ptr);
+// Counts a finished transfer, with the phases curl timed. Each of curl's times
+// is from the start, so the phases are the differences between them; a reused
+// connection has no DNS, connect or TLS time.
+void stats_transfer(CURL *curl, int ok) {
+	curl_off_t dns = 0, connect = 0, tls = 0, first = 0, total = 0, bytes = 0;
+	char *url = NULL;
 
-	int n;
-	for (n = 0; n < i->height; n++) {
-		memcpy(i->buf + row_bytes * n, row_pointers[n], row_bytes);
+	if (stats == NULL) {
+		return;
+	}
+	curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+	curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+	curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+	curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+	curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &first);
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+	curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+	if (tls < connect) {
+		tls = connect;
 	}
 
-	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-	return i;
-}
-#else /* PNG_FOUND */
-struct image *read_png(char *s, int len) {
-	fprintf(stderr, "stitch was compiled without PNG support, sorry\n");
-	return 0;
+	pthread_mutex_lock(&stats->lock);
+	struct stats_host *sh = stats_host(url != NULL ? url : "");
+	sh->requests++;
+	if (!ok) {
+		sh->errors++;
+	} else {
+		stats_phase(sh, PHASE_DNS, dns / 1e6);
+		stats_phase(sh, PHASE_CONNECT, (connect - dns) / 1e6);
+		stats_phase(sh, PHASE_TLS, (tls - connect) / 1e6);
+		stats_phase(sh, PHASE_WAIT, (first - tls) / 1e6);
+		stats_phase(sh, PHASE_TRANSFER, (total - first) / 1e6);
+		stats_phase(sh, PHASE_TOTAL, total / 1e6);
+	}
+	sh->bytes += bytes;
+	stats->bytes_in += bytes;
+	pthread_mutex_unlock(&stats->lock);
 }
-#endif /* PNG_FOUND */
 
-int main(int argc, char **argv) {
-	extern int optind;
-	extern char *optarg;
-	int i;
+// Counts a tile the daemon (-d) fetched, which is timed as a whole
+void stats_daemon(double start, long long bytes, int ok) {
+	if (stats == NULL) {
+		return;
+	}
 
-	char *outfile = NULL;
-	int tilesize = 256;
-	int centered = 0;
-	int elevation = 0;
-	int outfmt = OUTFMT_PNG;
-	int x, y;
-	unsigned int writeworldfile = FALSE;
-	unsigned long long int offset, ioffset;
+	double elapsed = stats_clock() - start;
 
-	while ((i = getopt(argc, argv, "eho:t:c:f:w")) != -1) {
-		switch (i) {
-		case 'e':
-			elevation = 1;
-			break;
+	pthread_mutex_lock(&stats->lock);
+	struct stats_host *sh = stats_host("daemon");
+	sh->requests++;
+	if (!ok) {
+		sh->errors++;
+	} else {
+		stats_phase(sh, PHASE_TOTAL, elapsed);
+	}
+	sh->bytes += bytes;
+	stats->bytes_in += bytes;
+	pthread_mutex_unlock(&stats->lock);
+}
 
-		case 'o':
-			outfile = optarg;
-			break;
+static void stats_count(long *lookups, long *hits, int hit) {
+	pthread_mutex_lock(&stats->lock);
+	(*lookups)++;
+	*hits += hit;
+	pthread_mutex_unlock(&stats->lock);
+}
 
-		case 't':
-			tilesize = atoi(optarg);
-			break;
+static void stats_json_string(FILE *fp, const char *s) {
+	putc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') {
+			fprintf(fp, "\\%c", *s);
+		} else if ((unsigned char) *s < 0x20) {
+			fprintf(fp, "\\u%04x", *s);
+		} else {
+			putc(*s, fp);
+		}
+	}
+	putc('"', fp);
+}
 
-		case 'c':
-			centered = 1;
-			break;
+static void stats_json_timers(FILE *fp, const char *name, const struct stats_timer *t, const char **names, int n) {
+	int k;
 
-		case 'w':
-			writeworldfile = TRUE;
-			break;
+	fprintf(fp, "  \"%s\": {", name);
+	for (k = 0; k < n; k++) {
+		fprintf(fp, "%s\"%s\": {\"count\": %ld, \"seconds\": %.6f}", k > 0 ? ", " : "", names[k], t[k].count, t[k].seconds);
+	}
+	fprintf(fp, "},\n");
+}
 
-		case 'f':
-			if (strcmp(optarg, "png") == 0) {
-				outfmt = OUTFMT_PNG;
-			} else if (strcmp(optarg, "geotiff") == 0) {
-				outfmt = OUTFMT_GEOTIFF;
+// Writes the report of what has been counted so far, with the lock held so
+// that a server's threads can go on counting. decoded_lookups and
+// decoded_hits are those of the decoded tile cache, if there was one.
+void stats_report(long decoded_lookups, long decoded_hits) {
+	static const char *decode_names[] = { "png", "jpeg" };
+	static const char *blend_names[] = { "rgba", "elevation" };
+	static const char *encode_names[] = { "png", "geotiff", "float32" };
+	struct stats_host *sh;
+	struct rusage ru;
+	FILE *fp;
+	int p, b;
+
+	if (stats == NULL) {
+		return;
+	}
+	if ((fp = fopen(stats->path, "w")) == NULL) {
+		stitch_log(LOG_ERROR, "%s: %s\n", stats->path, strerror(errno));
+		stitch_fail(STITCH_ERR_IO);
+	}
+	getrusage(RUSAGE_SELF, &ru);
+	pthread_mutex_lock(&stats->lock);
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"seconds\": %.6f,\n", stats_clock() - stats->start);
+	fprintf(fp, "  \"peak_rss_bytes\": %lld,\n", (long long) ru.ru_maxrss * 1024);
+	fprintf(fp, "  \"bytes_in\": %lld,\n", stats->bytes_in);
+	fprintf(fp, "  \"bytes_out\": %lld,\n", stats->bytes_out);
+	fprintf(fp, "  \"histogram_ms\": [");
+	for (b = 0; b < STATS_BUCKETS - 1; b++) {
+		fprintf(fp, "%s%d", b > 0 ? ", " : "", 1 << b);
+	}
+	fprintf(fp, "],\n");
+	fprintf(fp, "  \"hosts\": [");
+	for (sh = stats->hosts; sh != NULL; sh = sh->next) {
+		fprintf(fp, "%s\n    {\"host\": ", sh != stats->hosts ? "," : "");
+		stats_json_string(fp, sh->host);
+		fprintf(fp, ", \"requests\": %ld, \"errors\": %ld, \"bytes\": %lld, \"phases\": {", sh->requests, sh->errors, sh->bytes);
+		for (p = 0; p < NPHASES; p++) {
+			fprintf(fp, "%s\n      \"%s\": {\"seconds\": %.6f, \"histogram\": [", p > 0 ? "," : "", stats_phase_names[p], sh->seconds[p]);
+			for (b = 0; b < STATS_BUCKETS; b++) {
+				fprintf(fp, "%s%ld", b > 0 ? ", " : "", sh->histogram[p][b]);
 			}
-			break;
-
-		case 'h':
-			usage(argv);
-			exit(EXIT_SUCCESS);
-			break;
+			fprintf(fp, "]}");
 		}
+		fprintf(fp, "}}");
 	}
-
-	if (argc - optind < 6) {
-		usage(argv);
-		exit(EXIT_FAILURE);
+	fprintf(fp, "\n  ],\n");
+	stats_json_timers(fp, "decode", stats->decode, decode_names, 2);
+	stats_json_timers(fp, "blend", stats->blend, blend_names, 2);
+	stats_json_timers(fp, "encode", stats->encode, encode_names, 3);
+	fprintf(fp, "  \"caches\": {\"tiles\": {\"lookups\": %ld, \"hits\": %ld}, ", stats->tile_lookups, stats->tile_hits);
+	fprintf(fp, "\"decoded\": {\"lookups\": %ld, \"hits\": %ld}, ", decoded_lookups, decoded_hits);
+	fprintf(fp, "\"results\": {\"lookups\": %ld, \"hits\": %ld}}\n", stats->result_lookups, stats->result_hits);
+	fprintf(fp, "}\n");
+	pthread_mutex_unlock(&stats->lock);
+	if (fclose(fp) != 0) {
+		stitch_log(LOG_ERROR, "%s: %s\n", stats->path, strerror(errno));
+		stitch_fail(STITCH_ERR_IO);
 	}
+}
 
-	double minlat = atof(argv[optind]);
-	double minlon = atof(argv[optind + 1]);
-	double maxlat = atof(argv[optind + 2]);
-	double maxlon = atof(argv[optind + 3]);
-	int zoom = atoi(argv[optind + 4]);
-	double dummy;
+// Writes the report and stops measuring. Only to be called when no other
+// thread is counting any more.
+void stats_finish(long decoded_lookups, long decoded_hits) {
+	struct stats_host *sh, *next;
 
-	if (zoom < 0) {
-		fprintf(stderr, "Zoom %u less than 0\n", zoom);
-		exit(EXIT_FAILURE);
+	if (stats == NULL) {
+		return;
 	}
-
-	if (minlat > maxlat) {
-		dummy = minlat;
-		minlat = maxlat;
-		maxlat = dummy;
+	stats_report(decoded_lookups, decoded_hits);
+	for (sh = stats->hosts; sh != NULL; sh = next) {
+		next = sh->next;
+		free(sh->host);
+		free(sh);
 	}
+	pthread_mutex_destroy(&stats->lock);
+	free(stats);
+	stats = NULL;
+}
 
-	if (minlon > maxlon) {
-		dummy = minlon;
-		minlon = maxlon;
-		maxlon = dummy;
-	}
+// -X records a timeline of the run as Chrome trace events, which Perfetto
+// and chrome://tracing show: the queue wait and transfer of each tile, its
+// decoding and blitting, and the encoding of the output in bands of rows.
+// Each thread records into a ring of its own without taking a lock, keeping
+// the last TRACE_RING events, and the rings are written out when the run
+// finishes and the threads are done.
+#define TRACE_RING 65536
+#define TRACE_BAND 256    // rows of output in an encode event
+
+enum trace_kind {
+	TRACE_QUEUE,      // a tile waiting for a transfer to start
+	TRACE_FETCH,
+	TRACE_DECODE,
+	TRACE_BLIT,
+	TRACE_ENCODE,
+	NTRACE_KINDS
+};
 
-	if (outfile == NULL && isatty(1)) {
-		fprintf(stderr, "Didn't specify -o and standard output is a terminal\n");
-		exit(EXIT_FAILURE);
-	}
+static const struct {
+	const char *name;
+	const char *args[3];
+} trace_kinds[NTRACE_KINDS] = {
+	{ "queue", { "z", "x", "y" } },
+	{ "fetch", { "z", "x", "y" } },
+	{ "decode", { "bytes", "width", "height" } },
+	{ "blit", { "x", "y", NULL } },
+	{ "encode", { "first_row", "rows", NULL } },
+};
 
-	unsigned int x1, y1, x2, y2;
+struct trace_event {
+	enum trace_kind kind;
+	int track;        // the local port of the connection, or 0 for the thread's own
+	double start, end;
+	long args[3];
+};
 
-	if (centered) {
-		latlon2tile(minlat, minlon, 32, &x1, &y1);
-		latlon2tile(minlat, minlon, 32, &x2, &y2);
+struct trace_ring {
+	int tid;
+	int main;
+	unsigned long head;         // events recorded, of which the last TRACE_RING are kept
+	struct trace_ring *next;
+	struct trace_event events[TRACE_RING];
+};
 
-		int width = atoi(argv[optind + 2]);
-		int height = atoi(argv[optind + 3]);
+static const char *trace_path;
+static double trace_start;
+static pthread_t trace_main;
+static struct trace_ring *trace_rings;
+static int trace_threads;
+static __thread struct trace_ring *trace_ring;
+
+void trace_init(const char *path) {
+	trace_path = path;
+	trace_start = stats_clock();
+	trace_main = pthread_self();
+}
 
-		if (width <= 0 || height <= 0) {
-			fprintf(stderr, "Width/height less than 0: %u %u\n", width, height);
-			exit(EXIT_FAILURE);
-		}
+// Whether anything is being measured, so that the clock is read only then
+static double timer_start(void) {
+	return stats != NULL || trace_path != NULL ? stats_clock() : 0;
+}
 
-		x1 = x1 - (width << (32 - (zoom + 8))) / 2;
-		y1 = y1 - (height << (32 - (zoom + 8))) / 2;
-		x2 = x2 + (width << (32 - (zoom + 8))) / 2;
-		y2 = y2 + (height << (32 - (zoom + 8))) / 2;
+// Records an event. A thread's first event links its ring into the list
+// with a compare and swap, so no event waits on a lock.
+static void trace_span(enum trace_kind kind, int track, double start, double end, long a, long b, long c) {
+	struct trace_ring *r = trace_ring;
 
-		tile2latlon(x1, y1, 32, &maxlat, &minlon);
-		tile2latlon(x2, y2, 32, &minlat, &maxlon);
-	} else {
-		latlon2tile(maxlat, minlon, 32, &x1, &y1);
-		latlon2tile(minlat, maxlon, 32, &x2, &y2);
+	if (r == NULL) {
+		if ((r = malloc(sizeof(struct trace_ring))) == NULL) {
+			stitch_log(LOG_ERROR, "Can't allocate memory for a trace\n");
+			stitch_fail(STITCH_ERR_MEMORY);
+		}
+		r->tid = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+		r->main = pthread_equal(pthread_self(), trace_main);
+		r->head = 0;
+		r->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&trace_rings, &r->next, r, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		}
+		trace_ring = r;
 	}
 
-	unsigned int tx1 = x1 >> (32 - zoom);
-	unsigned int ty1 = y1 >> (32 - zoom);
-	unsigned int tx2 = x2 >> (32 - zoom);
-	unsigned int ty2 = y2 >> (32 - zoom);
+	struct trace_event *e = &r->events[r->head % TRACE_RING];
+	e->kind = kind;
+	e->track = track;
+	e->start = start;
+	e->end = end;
+	e->args[0] = a;
+	e->args[1] = b;
+	e->args[2] = c;
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
 
-	double miny, minx, maxy, maxx;
-	projectlatlon(minlat, minlon, &minx, &miny);
-	projectlatlon(maxlat, maxlon, &maxx, &maxy);
+// Records an event on the thread's track that started at start and ends now
+static void trace_event(enum trace_kind kind, double start, long a, long b, long c) {
+	if (trace_path != NULL) {
+		trace_span(kind, 0, start, stats_clock(), a, b, c);
+	}
+}
 
-	fprintf(stderr, "==Geodetic Bounds  (EPSG:4236): %.17g,%.17g to %.17g,%.17g\n", minlat, minlon, maxlat, maxlon);
-	fprintf(stderr, "==Projected Bounds (EPSG:3785): %.17g,%.17g to %.17g,%.17g\n", miny, minx, maxy, maxx);
-	fprintf(stderr, "==Zoom Level: %u\n", zoom);
-	fprintf(stderr, "==Upper Left Tile: x:%u y:%u\n", tx1, ty2);
-	fprintf(stderr, "==Lower Right Tile: x:%u y:%u\n", tx2, ty1);
+// Records a transfer that just finished, on the track of its connection,
+// and the wait since the tile was queued until it started
+void trace_transfer(CURL *curl, double queued, int zoom, unsigned int tx, unsigned int ty) {
+	curl_off_t total = 0;
+	long port = 0;
 
-	unsigned int xa = ((x1 >> (32 - (zoom + 8))) & 0xFF) * tilesize / 256;
-	unsigned int ya = ((y1 >> (32 - (zoom + 8))) & 0xFF) * tilesize / 256;
+	if (trace_path == NULL) {
+		return;
+	}
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+	curl_easy_getinfo(curl, CURLINFO_LOCAL_PORT, &port);
 
-	int width = ((x2 >> (32 - (zoom + 8))) - (x1 >> (32 - (zoom + 8)))) * tilesize / 256;
-	int height = ((y2 >> (32 - (zoom + 8))) - (y1 >> (32 - (zoom + 8)))) * tilesize / 256;
-	fprintf(stderr, "==Raster Size: %ux%u\n", width, height);
+	double end = stats_clock(), started = end - total / 1e6;
+	if (started > queued) {
+		trace_span(TRACE_QUEUE, 0, queued, started, zoom, tx, ty);
+	}
+	trace_span(TRACE_FETCH, (int) port, started, end, zoom, tx, ty);
+}
 
-	double px = (maxx - minx) / width;
-	double py = (fabs(maxy - miny)) / height;
-	fprintf(stderr, "==Pixel Size: x:%.17g y:%.17g\n", px, py);
+// Records the encoding of rows up to y, when a band of them is done
+static void trace_rows(double *start, int y, int height) {
+	if (trace_path == NULL || ((y + 1) % TRACE_BAND != 0 && y + 1 != height)) {
+		return;
+	}
+	trace_event(TRACE_ENCODE, *start, y / TRACE_BAND * TRACE_BAND, y % TRACE_BAND + 1, 0);
+	*start = stats_clock();
+}
+
+static void trace_json_event(FILE *fp, const struct trace_ring *r, const struct trace_event *e, const char *ph, double ts, long id) {
+	int k;
+
+	fprintf(fp, ",\n{\"name\": \"%s\", \"cat\": \"stitch\", \"ph\": \"%s\", \"ts\": %.3f", trace_kinds[e->kind].name, ph, (ts - trace_start) * 1e6);
+	if (ph[0] == 'X') {
+		fprintf(fp, ", \"dur\": %.3f", (e->end - e->start) * 1e6);
+	} else {
+		fprintf(fp, ", \"id\": \"0x%lx\"", id);
+	}
+	fprintf(fp, ", \"pid\": %d, \"tid\": %d, \"args\": {", e->track != 0 ? 2 : 1, e->track != 0 ? e->track : r->tid);
+	for (k = 0; k < 3 && trace_kinds[e->kind].args[k] != NULL; k++) {
+		fprintf(fp, "%s\"%s\": %ld", k > 0 ? ", " : "", trace_kinds[e->kind].args[k], e->args[k]);
+	}
+	fprintf(fp, "}}");
+}
+
+// Writes the events recorded so far. Threads may still be adding to their
+// rings, which only ever publish events that are complete; an event is
+// copied, then kept only if its slot wasn't reused while it was, so that
+// a ring that wraps meanwhile loses its oldest events rather than tearing.
+void trace_report(void) {
+	struct trace_ring *r;
+	unsigned long n, lost;
+	FILE *fp;
+
+	if (trace_path == NULL) {
+		return;
+	}
+	if ((fp = fopen(trace_path, "w")) == NULL) {
+		stitch_log(LOG_ERROR, "%s: %s\n", trace_path, strerror(errno));
+		stitch_fail(STITCH_ERR_IO);
+	}
+
+	fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+	fprintf(fp, "\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"threads\"}},");
+	fprintf(fp, "\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 2, \"args\": {\"name\": \"connections\"}}");
+	for (r = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+		unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+		fprintf(fp, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s %d\"}}", r->tid, r->main ? "main" : "thread", r->tid);
+		lost = head > TRACE_RING ? head - TRACE_RING : 0;
+		for (n = lost; n < head; n++) {
+			struct trace_event copy = r->events[n % TRACE_RING];
+			const struct trace_event *e = &copy;
+
+			// The slot is reused once the thread records event n + TRACE_RING
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&r->head, __ATOMIC_RELAXED) >= n + TRACE_RING) {
+				lost++;
+				continue;
+			}
+
+			if (e->kind == TRACE_QUEUE || e->track != 0) {
+				// Waits overlap, and so do the transfers that HTTP/2
+				// multiplexes on one connection, so they are async events,
+				// each with an id of its own; transfers stay on the track
+				// of their connection
+				long id = (long) r->tid << 32 | (long) (n & 0xFFFFFFFF);
+				trace_json_event(fp, r, e, "b", e->start, id);
+				trace_json_event(fp, r, e, "e", e->end, id);
+			} else {
+				trace_json_event(fp, r, e, "X", e->start, 0);
+			}
+		}
+		if (lost > 0) {
+			stitch_log(LOG_ERROR, "Trace: thread %d dropped its first %lu events\n", r->tid, lost);
+		}
+	}
+	fprintf(fp, "\n]}\n");
+	if (fclose(fp) != 0) {
+		stitch_log(LOG_ERROR, "%s: %s\n", trace_path, strerror(errno));
+		stitch_fail(STITCH_ERR_IO);
+	}
+}
+
+// Writes the trace and stops recording. Only to be called after every thread
+// that records has stopped, since their rings are freed.
+void trace_finish(void) {
+	struct trace_ring *r, *next;
+
+	if (trace_path == NULL) {
+		return;
+	}
+	trace_report();
+	for (r = trace_rings; r != NULL; r = next) {
+		next = r->next;
+		free(r);
+	}
+	trace_rings = NULL;
+	trace_path = NULL;
+}
+
+// While fetching, stitch shows how far it got: on a terminal as one line
+// that it keeps rewriting, and otherwise as a JSON line now and then.
+// Either is limited to a few a second, so a slow stderr doesn't slow the
+// fetching down.
+#define PROGRESS_TTY_INTERVAL 0.25
+#define PROGRESS_JSON_INTERVAL 5.0
+
+struct progress {
+	pthread_mutex_t lock;
+	int tty;
+	const char *phase;   // NULL between phases
+	long total, done, hits, missing;
+	long long bytes;
+	double start, last;
+	int shown;           // the terminal line is there, to be cleared before a message
+};
+
+static struct progress *progress;
+static __thread int tile_cached;  // whether the last tile fetched came from a cache
+static __thread int tile_failed;  // tiles of the job that couldn't be decoded
+
+void progress_init(void) {
+	progress = calloc(1, sizeof(struct progress));
+	if (progress == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for progress\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	pthread_mutex_init(&progress->lock, NULL);
+	progress->tty = isatty(2);
+}
+
+// Prints the progress of the phase, with the lock held
+static void progress_show(double now, int last) {
+	struct progress *p = progress;
+	double elapsed = now - p->start;
+	double rate = elapsed > 0 ? p->done / elapsed : 0;
+	double mbps = elapsed > 0 ? p->bytes / elapsed / 1e6 : 0;
+	double hits = p->done > 0 ? 100.0 * p->hits / p->done : 0;
+	long eta = rate > 0 && p->total > p->done ? (long) ((p->total - p->done) / rate + 0.5) : 0;
+
+	if (p->tty) {
+		char missing[32] = "";
+
+		if (p->missing > 0) {
+			snprintf(missing, sizeof missing, ", %ld missing", p->missing);
+		}
+		fprintf(stderr, "\r%s: %ld/%ld tiles%s, %.1f tiles/s, %.2f MB/s, %.0f%% cached, ETA %ld:%02ld\033[K%s",
+			p->phase, p->done, p->total, missing, rate, mbps, hits, eta / 60, eta % 60, last ? "\n" : "");
+		p->shown = !last;
+	} else {
+		fprintf(stderr, "{\"phase\": \"%s\", \"done\": %ld, \"total\": %ld, \"missing\": %ld, \"tiles_per_second\": %.1f, \"mb_per_second\": %.3f, \"hit_rate\": %.3f, \"eta_seconds\": %ld}\n",
+			p->phase, p->done, p->total, p->missing, rate, mbps, hits / 100, eta);
+	}
+	fflush(stderr);
+	p->last = now;
+}
+
+static void progress_tick(void) {
+	double now = stats_clock();
+
+	if (progress->phase != NULL && now - progress->last >= (progress->tty ? PROGRESS_TTY_INTERVAL : PROGRESS_JSON_INTERVAL)) {
+		progress_show(now, 0);
+	}
+}
+
+// Starts counting the tiles of a phase, of which there will be total
+void progress_begin(const char *phase, long total) {
+	if (progress == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&progress->lock);
+	progress->phase = phase;
+	progress->total = total;
+	progress->done = progress->hits = progress->missing = 0;
+	progress->bytes = 0;
+	progress->start = progress->last = stats_clock();
+	pthread_mutex_unlock(&progress->lock);
+}
+
+// Counts a tile done, which hit if it came from a cache
+void progress_tile(int hit) {
+	if (progress == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&progress->lock);
+	progress->done++;
+	progress->hits += hit;
+	progress_tick();
+	pthread_mutex_unlock(&progress->lock);
+}
+
+// Counts a tile that the server says isn't there, instead of naming each
+void progress_missing(void) {
+	if (progress == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&progress->lock);
+	progress->missing++;
+	pthread_mutex_unlock(&progress->lock);
+}
+
+void progress_bytes(long long bytes) {
+	if (progress == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&progress->lock);
+	progress->bytes += bytes;
+	pthread_mutex_unlock(&progress->lock);
+}
+
+// Ends the phase, with a last line if there were others
+void progress_end(void) {
+	if (progress == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&progress->lock);
+	if (progress->phase != NULL && (progress->shown || (!progress->tty && progress->last > progress->start))) {
+		progress_show(stats_clock(), 1);
+	} else if (progress->phase != NULL && progress->missing > 0) {
+		fprintf(stderr, "%s: %ld of %ld tiles missing\n", progress->phase, progress->missing, progress->total);
+		fflush(stderr);
+	}
+	progress->phase = NULL;
+	pthread_mutex_unlock(&progress->lock);
+}
+
+// Prints a message of a level, first clearing the progress line from the
+// terminal if it is there. The next tile puts it back.
+static void stitch_log(int level, const char *fmt, ...) {
+	va_list ap;
+
+	if (level > log_level) {
+		return;
+	}
+	if (progress != NULL) {
+		pthread_mutex_lock(&progress->lock);
+		if (progress->shown) {
+			fputs("\r\033[K", stderr);
+			progress->shown = 0;
+			progress->last = 0;
+		}
+		pthread_mutex_unlock(&progress->lock);
+	}
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	if (level < LOG_DEBUG) {
+		fflush(stderr);
+	}
+}
+
+void free_image(struct image *i) {
+	free(i->buf);
+	free(i);
+}
+
+static void release_image(void *p) {
+	free_image(p);
+}
+
+#if JPEG_FOUND
+// libjpeg exits on corrupt data unless its error handler does something else
+static void jpeg_fail(j_common_ptr cinfo) {
+	(*cinfo->err->output_message)(cinfo);
+	stitch_fail(STITCH_ERR_DECODE);
+}
+
+static void jpeg_message(j_common_ptr cinfo) {
+	char message[JMSG_LENGTH_MAX];
+
+	(*cinfo->err->format_message)(cinfo, message);
+	stitch_log(LOG_ERROR, "%s\n", message);
+}
+
+static void release_jpeg(void *p) {
+	jpeg_destroy_decompress(p);
+}
+
+struct image *read_jpeg(char *s, int len) {
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jerr.error_exit = jpeg_fail;
+	jerr.output_message = jpeg_message;
+	jpeg_create_decompress(&cinfo);
+	frame_hold(&cinfo, release_jpeg);
+	jpeg_mem_src(&cinfo, (unsigned char *) s, len);
+	jpeg_read_header(&cinfo, TRUE);
+	jpeg_start_decompress(&cinfo);
+
+	int row_stride = cinfo.output_width * cinfo.output_components;
+	JSAMPARRAY buffer = (*cinfo.mem->alloc_sarray)((j_common_ptr) &cinfo, JPOOL_IMAGE, row_stride, 1);
+
+	struct image *i = calloc(1, sizeof(struct image));
+	if (i == NULL || (i->buf = malloc(cinfo.output_width * cinfo.output_height * cinfo.output_components)) == NULL) {
+		free(i);
+		stitch_log(LOG_ERROR, "Can't allocate memory for %dx%d tile\n", cinfo.output_width, cinfo.output_height);
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	frame_hold(i, release_image);
+	i->width = cinfo.output_width;
+	i->height = cinfo.output_height;
+	i->depth = cinfo.output_components;
+
+	unsigned char *here = i->buf;
+	while (cinfo.output_scanline < cinfo.output_height) {
+		jpeg_read_scanlines(&cinfo, buffer, 1);
+		memcpy(here, buffer[0], row_stride);
+		here += row_stride;
+	}
+
+	jpeg_finish_decompress(&cinfo);
+	frame_drop(i);
+	frame_drop(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+
+	return i;
+}
+#else /* JPEG_FOUND */
+struct image *read_jpeg(char *s, int len) {
+	stitch_log(LOG_ERROR, "stitch was compiled without JPEG support, sorry\n");
+	return 0;
+}
+#endif /* JPEG_FOUND */
+
+static void fail(png_structp png_ptr, png_const_charp error_msg) {
+	stitch_log(LOG_ERROR, "PNG error %s\n", error_msg);
+	stitch_fail(STITCH_ERR_DECODE);
+}
+
+struct read_state {
+	char *base;
+	int off;
+	int len;
+};
+
+void user_read_data(png_structp png_ptr, png_bytep data, png_size_t length) {
+	struct read_state *state = png_get_io_ptr(png_ptr);
+
+	if (state->off + length > state->len) {
+		length = state->len - state->off;
+	}
+
+	memcpy(data, state->base + state->off, length);
+	state->off += length;
+}
+
+#if PNG_FOUND
+// The libpng structs of a decode or encode, for a failure to release
+struct png_pair {
+	png_structp png;
+	png_infop info;
+	int write;
+};
+
+static void release_png(void *p) {
+	struct png_pair *pp = p;
+
+	if (pp->write) {
+		png_destroy_write_struct(&pp->png, pp->info != NULL ? &pp->info : NULL);
+	} else {
+		png_destroy_read_struct(&pp->png, pp->info != NULL ? &pp->info : NULL, NULL);
+	}
+}
+
+struct image *read_png(char *s, int len) {
+	png_structp png_ptr;
+	png_infop info_ptr;
+	struct png_pair pp = { NULL, NULL, 0 };
+
+	struct read_state state;
+	state.base = s;
+	state.off = 0;
+	state.len = len;
+
+	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, fail, fail, fail);
+	if (png_ptr == NULL) {
+		stitch_log(LOG_ERROR, "PNG init failed\n");
+		stitch_fail(STITCH_ERR_DECODE);
+	}
+	pp.png = png_ptr;
+	frame_hold(&pp, release_png);
+
+	info_ptr = png_create_info_struct(png_ptr);
+	if (info_ptr == NULL) {
+		stitch_log(LOG_ERROR, "PNG init failed\n");
+		stitch_fail(STITCH_ERR_DECODE);
+	}
+	pp.info = info_ptr;
+
+	png_set_read_fn(png_ptr, &state, user_read_data);
+	png_set_sig_bytes(png_ptr, 0);
+
+	png_read_png(png_ptr, info_ptr, PNG_TRANSFORM_STRIP_16 | PNG_TRANSFORM_PACKING | PNG_TRANSFORM_EXPAND, NULL);
+
+	png_uint_32 width, height;
+	int bit_depth;
+	int color_type, interlace_type;
+
+	png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type, &interlace_type, NULL, NULL);
+
+	struct image *i = malloc(sizeof(struct image));
+	if (i == NULL || (i->buf = malloc((size_t) width * height * png_get_channels(png_ptr, info_ptr))) == NULL) {
+		free(i);
+		stitch_log(LOG_ERROR, "Can't allocate memory for %ux%u tile\n", (unsigned) width, (unsigned) height);
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	i->width = width;
+	i->height = height;
+	i->depth = png_get_channels(png_ptr, info_ptr);
+
+	unsigned int row_bytes = png_get_rowbytes(png_ptr, info_ptr);
+	png_bytepp row_pointers = png_get_rows(png_ptr, info_ptr);
+
+	int n;
+	for (n = 0; n < i->height; n++) {
+		memcpy(i->buf + row_bytes * n, row_pointers[n], row_bytes);
+	}
+
+	frame_drop(&pp);
+	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+	return i;
+}
+#else /* PNG_FOUND */
+struct image *read_png(char *s, int len) {
+	stitch_log(LOG_ERROR, "stitch was compiled without PNG support, sorry\n");
+	return 0;
+}
+#endif /* PNG_FOUND */
+
+// A tile URL template, split once into literal text and tokens so that the
+// URL of each tile is only copies and a few integers. The tokens are {z},
+// {x} and {y}, which WMTS templates may call {TileMatrix}, {TileCol} and
+// {TileRow}; {-y}, the row counted from the bottom as in TMS; {q}, the Bing
+// quadkey; and {s}, an a/b/c subdomain. {r} was filled in by retina_url().
+enum url_token {
+	URL_TEXT,
+	URL_ZOOM,
+	URL_X,
+	URL_Y,
+	URL_TMS_Y,
+	URL_QUADKEY,
+	URL_SUBDOMAIN
+};
+
+struct url_part {
+	enum url_token token;
+	const char *text;  // into the template, for URL_TEXT
+	int len;
+};
+
+struct url_template {
+	char *url;
+	struct url_part *parts;
+	int nparts;
+	int maxlen;  // of an expanded URL, not counting the NUL
+};
+
+static const struct {
+	const char *name;
+	enum url_token token;
+	int maxlen;
+} url_tokens[] = {
+	{ "{z}", URL_ZOOM, 10 },
+	{ "{x}", URL_X, 10 },
+	{ "{y}", URL_Y, 10 },
+	{ "{-y}", URL_TMS_Y, 10 },
+	{ "{q}", URL_QUADKEY, 32 },
+	{ "{s}", URL_SUBDOMAIN, 1 },
+	{ "{r}", URL_TEXT, 0 },
+	{ "{TileMatrix}", URL_ZOOM, 10 },
+	{ "{TileCol}", URL_X, 10 },
+	{ "{TileRow}", URL_Y, 10 },
+};
+
+static void url_part(struct url_template *t, enum url_token token, const char *text, int len) {
+	if (token != URL_TEXT || len > 0) {
+		t->parts[t->nparts].token = token;
+		t->parts[t->nparts].text = text;
+		t->parts[t->nparts].len = len;
+		t->nparts++;
+	}
+}
+
+struct url_template *url_compile(const char *url) {
+	struct url_template *t = calloc(1, sizeof(struct url_template));
+	const char *cp, *text;
+	size_t k;
+
+	if (t == NULL || (t->url = strdup(url)) == NULL || (t->parts = malloc((strlen(url) + 1) * sizeof(struct url_part))) == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for %s\n", url);
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+
+	for (cp = text = t->url; *cp; cp++) {
+		if (*cp != '{') {
+			continue;
+		}
+		for (k = 0; k < sizeof url_tokens / sizeof url_tokens[0]; k++) {
+			if (!strncmp(cp, url_tokens[k].name, strlen(url_tokens[k].name))) {
+				break;
+			}
+		}
+
+		// Other braces are text, unless they look like a token
+		if (k == sizeof url_tokens / sizeof url_tokens[0]) {
+			if (cp[1] != '\0' && cp[2] == '}') {
+				stitch_log(LOG_ERROR, "Unknown format token %c\n", cp[1]);
+				stitch_fail(STITCH_ERR_ARGS);
+			}
+			continue;
+		}
+
+		url_part(t, URL_TEXT, text, cp - text);
+		t->maxlen += cp - text;
+		url_part(t, url_tokens[k].token, NULL, 0);
+		t->maxlen += url_tokens[k].maxlen;
+		cp += strlen(url_tokens[k].name) - 1;
+		text = cp + 1;
+	}
+	url_part(t, URL_TEXT, text, cp - text);
+	t->maxlen += cp - text;
+	return t;
+}
+
+void url_template_free(struct url_template *t) {
+	if (t != NULL) {
+		free(t->parts);
+		free(t->url);
+		free(t);
+	}
+}
+
+static char *put_uint(char *out, unsigned int n) {
+	char digits[10];
+	int k = 0;
+
+	do {
+		digits[k++] = '0' + n % 10;
+		n /= 10;
+	} while (n > 0);
+	while (k > 0) {
+		*out++ = digits[--k];
+	}
+	return out;
+}
+
+// Expands a template for a tile into out, which must have room for
+// t->maxlen + 1 characters
+void url_expand(const struct url_template *t, int zoom, unsigned int tx, unsigned int ty, char *out) {
+	int k, b;
+
+	for (k = 0; k < t->nparts; k++) {
+		const struct url_part *p = &t->parts[k];
+
+		switch (p->token) {
+		case URL_TEXT:
+			memcpy(out, p->text, p->len);
+			out += p->len;
+			break;
+		case URL_ZOOM:
+			out = put_uint(out, zoom);
+			break;
+		case URL_X:
+			out = put_uint(out, tx);
+			break;
+		case URL_Y:
+			out = put_uint(out, ty);
+			break;
+		case URL_TMS_Y:
+			out = put_uint(out, (unsigned int) ((1ULL << zoom) - 1 - ty));
+			break;
+		case URL_QUADKEY:
+			// A digit per zoom level, from the top: which quarter of the
+			// tile above this one is in
+			for (b = zoom - 1; b >= 0; b--) {
+				*out++ = '0' + ((tx >> b) & 1) + 2 * ((ty >> b) & 1);
+			}
+			break;
+		case URL_SUBDOMAIN:
+			// The same subdomain for a tile every time, so that caches
+			// along the way see one URL for it
+			*out++ = 'a' + (tx + ty) % 3;
+			break;
+		}
+	}
+	*out = '\0';
+}
+
+// Decoded tiles, keyed by a hash of their encoded bytes, so that a tile that
+// comes again, from the batch cache, an update or the server, is copied
+// instead of inflated. The pixels are LZ4-compressed where stitch was built
+// with it, and kept raw otherwise. Past the size cap, the least recently
+// used are dropped; with a directory, they are kept there across runs too,
+// up to a cap of their own, past which the files least recently used go.
+// Since those outlive the run, a tile is known by a second, independent
+// hash as well, so that one whose first hash collides is never served.
+struct pixel_tile {
+	unsigned long long hash;
+	unsigned long long check;    // the second hash
+	int len;                     // of the encoded tile
+	int width, height, depth;
+	int size;                    // of buf
+	unsigned char *buf;
+	struct pixel_tile *hnext, *newer, *older;
+};
+
+struct pixel_cache {
+	pthread_mutex_t lock;
+	struct pixel_tile *buckets[4096];
+	struct pixel_tile *newest, *oldest;
+	size_t bytes, cap;
+	const char *dir;
+	size_t disk_bytes, disk_cap;  // of the files in dir
+	int trimming;                 // a thread is trimming dir
+	int lookups, hits;
+};
+
+static struct pixel_cache *pixels;
+
+#if LZ4_FOUND
+#	define PIXEL_CODEC "lz4"
+#else
+#	define PIXEL_CODEC "raw"
+#endif
+
+struct pixel_file {
+	char name[40];
+	off_t size;
+	time_t mtime;
+};
+
+static int compare_pixel_files(const void *a, const void *b) {
+	const struct pixel_file *fa = a, *fb = b;
+	return fa->mtime < fb->mtime ? -1 : fa->mtime > fb->mtime;
+}
+
+// Counts the files of the disk tier and, if they are over its cap, removes
+// the least recently used down to three quarters of it. A file is touched
+// when it is read, so its time is when it was last used. The directory is
+// scanned without the lock, which is only taken to set what was counted;
+// other processes sharing the directory are only seen here.
+static void pixel_disk_trim(struct pixel_cache *pc) {
+	struct pixel_file *files = NULL;
+	int nfiles = 0, nalloc = 0, k;
+	size_t total = 0;
+	struct dirent *de;
+	DIR *dp = opendir(pc->dir);
+
+	if (dp == NULL) {
+		stitch_log(LOG_ERROR, "%s: %s\n", pc->dir, strerror(errno));
+		pthread_mutex_lock(&pc->lock);
+		pc->trimming = 0;
+		pthread_mutex_unlock(&pc->lock);
+		return;
+	}
+	while ((de = readdir(dp)) != NULL) {
+		size_t len = strlen(de->d_name);
+		char path[strlen(pc->dir) + len + 2];
+		struct stat st;
+
+		if (len < 3 || len >= sizeof files->name || strcmp(de->d_name + len - 3, ".px") != 0) {
+			continue;
+		}
+		snprintf(path, sizeof path, "%s/%s", pc->dir, de->d_name);
+		if (stat(path, &st) != 0) {
+			continue;
+		}
+		if (nfiles == nalloc) {
+			nalloc = nalloc * 2 + 256;
+			if ((files = realloc(files, nalloc * sizeof(struct pixel_file))) == NULL) {
+				stitch_log(LOG_ERROR, "Can't allocate memory for the decoded tile cache\n");
+				closedir(dp);
+				pthread_mutex_lock(&pc->lock);
+				pc->trimming = 0;
+				pthread_mutex_unlock(&pc->lock);
+				stitch_fail(STITCH_ERR_MEMORY);
+			}
+		}
+		strcpy(files[nfiles].name, de->d_name);
+		files[nfiles].size = st.st_size;
+		files[nfiles].mtime = st.st_mtime;
+		nfiles++;
+		total += st.st_size;
+	}
+	closedir(dp);
+
+	if (total > pc->disk_cap) {
+		qsort(files, nfiles, sizeof(struct pixel_file), compare_pixel_files);
+		for (k = 0; k < nfiles && total > pc->disk_cap / 4 * 3; k++) {
+			char path[strlen(pc->dir) + sizeof files->name + 2];
+
+			snprintf(path, sizeof path, "%s/%s", pc->dir, files[k].name);
+			if (unlink(path) == 0 || errno == ENOENT) {
+				total -= files[k].size;
+			}
+		}
+	}
+	free(files);
+
+	pthread_mutex_lock(&pc->lock);
+	pc->disk_bytes = total;
+	pc->trimming = 0;
+	pthread_mutex_unlock(&pc->lock);
+}
+
+struct pixel_cache *pixel_cache_new(size_t cap, const char *dir, size_t disk_cap) {
+	struct pixel_cache *pc = calloc(1, sizeof(struct pixel_cache));
+
+	if (pc == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for the decoded tile cache\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	pthread_mutex_init(&pc->lock, NULL);
+	pc->cap = cap;
+	pc->dir = dir;
+	pc->disk_cap = disk_cap;
+	if (dir != NULL) {
+		if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+			stitch_log(LOG_ERROR, "%s: %s\n", dir, strerror(errno));
+			stitch_fail(STITCH_ERR_IO);
+		}
+		pixel_disk_trim(pc);
+	}
+	return pc;
+}
+
+void pixel_cache_free(struct pixel_cache *pc) {
+	struct pixel_tile *pt, *next;
+
+	if (pc == NULL) {
+		return;
+	}
+	if (pc->lookups > 0) {
+		stitch_log(LOG_INFO, "==Decoded tiles: %d of %d reused\n", pc->hits, pc->lookups);
+	}
+	for (pt = pc->newest; pt != NULL; pt = next) {
+		next = pt->older;
+		free(pt->buf);
+		free(pt);
+	}
+	pthread_mutex_destroy(&pc->lock);
+	free(pc);
+}
+
+// FNV-1a of the encoded bytes, and in check a multiply-rotate hash of them
+// in the manner of MurmurHash64A, which shares nothing with it
+static unsigned long long pixel_hash(const struct data *data, unsigned long long *check) {
+	unsigned long long h = 14695981039346656037ULL;
+	unsigned long long c = 0x9E3779B97F4A7C15ULL ^ ((unsigned long long) data->len * 0xC6A4A7935BD1E995ULL);
+	int k;
+
+	for (k = 0; k < data->len; k++) {
+		unsigned long long b = (unsigned char) data->buf[k];
+
+		h = (h ^ b) * 1099511628211ULL;
+		c = (c ^ ((b + k) * 0xC6A4A7935BD1E995ULL)) * 0x87C37B91114253D5ULL;
+		c ^= c >> 47;
+	}
+	*check = c ^ (c >> 33);
+	return h;
+}
+
+static void pixel_unlink(struct pixel_cache *pc, struct pixel_tile *pt) {
+	*(pt->newer != NULL ? &pt->newer->older : &pc->newest) = pt->older;
+	*(pt->older != NULL ? &pt->older->newer : &pc->oldest) = pt->newer;
+}
+
+static void pixel_push(struct pixel_cache *pc, struct pixel_tile *pt) {
+	pt->newer = NULL;
+	pt->older = pc->newest;
+	*(pc->newest != NULL ? &pc->newest->newer : &pc->oldest) = pt;
+	pc->newest = pt;
+}
+
+// Adds a tile to the memory tier, the caller holding the lock, and drops the
+// least recently used ones beyond the cap
+static void pixel_insert(struct pixel_cache *pc, struct pixel_tile *pt) {
+	struct pixel_tile **slot = &pc->buckets[pt->hash % 4096];
+
+	pt->hnext = *slot;
+	*slot = pt;
+	pixel_push(pc, pt);
+	pc->bytes += pt->size;
+
+	while (pc->bytes > pc->cap && pc->oldest != NULL) {
+		struct pixel_tile *old = pc->oldest;
+
+		for (slot = &pc->buckets[old->hash % 4096]; *slot != old; slot = &(*slot)->hnext) {
+			;
+		}
+		*slot = old->hnext;
+		pixel_unlink(pc, old);
+		pc->bytes -= old->size;
+		free(old->buf);
+		free(old);
+	}
+}
+
+static void pixel_path(struct pixel_cache *pc, char *path, size_t len, unsigned long long hash, int size) {
+	snprintf(path, len, "%s/%016llx-%d.px", pc->dir, hash, size);
+}
+
+// Whether the header of a file of the disk tier describes pixels that could
+// have come from pixel_cache_put(), so that a damaged or foreign file is
+// never trusted for the size of what it decompresses to
+static int pixel_header_valid(const struct pixel_tile *pt) {
+	size_t raw;
+
+	if (pt->width <= 0 || pt->height <= 0 || pt->width > 65535 || pt->height > 65535 || pt->depth < 1 || pt->depth > 4) {
+		return 0;
+	}
+	raw = (size_t) pt->width * pt->height * pt->depth;
+	if (raw > INT_MAX || pt->size <= 0) {
+		return 0;
+	}
+#if LZ4_FOUND
+	return pt->size <= LZ4_compressBound(raw);
+#else
+	return (size_t) pt->size == raw;
+#endif
+}
+
+// Reads a tile the disk tier has, or returns NULL. The lock isn't held, so
+// that other threads needn't wait for the disk.
+static struct pixel_tile *pixel_read(struct pixel_cache *pc, unsigned long long hash, unsigned long long check, int len) {
+	char path[strlen(pc->dir) + 40], codec[8];
+	struct pixel_tile *pt;
+	FILE *fp;
+
+	pixel_path(pc, path, sizeof path, hash, len);
+	if ((fp = fopen(path, "rb")) == NULL) {
+		return NULL;
+	}
+	if ((pt = calloc(1, sizeof(struct pixel_tile))) == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for the decoded tile cache\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	if (fscanf(fp, "stitch-pixels %7s %llx %d %d %d %d", codec, &pt->check, &pt->width, &pt->height, &pt->depth, &pt->size) != 6 ||
+	    fgetc(fp) != '\n' || strcmp(codec, PIXEL_CODEC) != 0 || pt->check != check || !pixel_header_valid(pt) ||
+	    (pt->buf = malloc(pt->size)) == NULL || fread(pt->buf, 1, pt->size, fp) != (size_t) pt->size || fgetc(fp) != EOF) {
+		free(pt->buf);
+		free(pt);
+		pt = NULL;
+	} else {
+		pt->hash = hash;
+		pt->len = len;
+		utimensat(AT_FDCWD, path, NULL, 0);
+	}
+	fclose(fp);
+	return pt;
+}
+
+// A temporary name next to a cache file, of this process and thread, since
+// other threads may be storing the same file too
+static void cache_tmp(char *tmp, size_t len, const char *path) {
+	snprintf(tmp, len, "%s.%ld.%lx.tmp", path, (long) getpid(), (unsigned long) pthread_self());
+}
+
+// Stores a tile in the disk tier, replacing the file of an earlier store of
+// it, and trims the tier if that takes it over its cap
+static void pixel_write(struct pixel_cache *pc, const struct pixel_tile *pt) {
+	char path[strlen(pc->dir) + 40], tmp[sizeof path + 48];
+	struct stat st;
+	FILE *fp;
+	int ok;
+
+	pixel_path(pc, path, sizeof path, pt->hash, pt->len);
+	cache_tmp(tmp, sizeof tmp, path);
+	if ((fp = fopen(tmp, "wb")) == NULL) {
+		stitch_log(LOG_ERROR, "%s: %s\n", tmp, strerror(errno));
+		return;
+	}
+	ok = fprintf(fp, "stitch-pixels %s %016llx %d %d %d %d\n", PIXEL_CODEC, pt->check, pt->width, pt->height, pt->depth, pt->size) > 0;
+	long size = ftell(fp) + pt->size;
+	ok = ok && fwrite(pt->buf, 1, pt->size, fp) == (size_t) pt->size;
+	ok = fclose(fp) == 0 && ok;
+	off_t old = ok && stat(path, &st) == 0 ? st.st_size : 0;
+	if (!ok || rename(tmp, path) != 0) {
+		stitch_log(LOG_ERROR, "%s: %s\n", path, strerror(errno));
+		unlink(tmp);
+		return;
+	}
+
+	pthread_mutex_lock(&pc->lock);
+	pc->disk_bytes = pc->disk_bytes + size > (size_t) old ? pc->disk_bytes + size - old : 0;
+	int trim = pc->disk_bytes > pc->disk_cap && !pc->trimming;
+	if (trim) {
+		pc->trimming = 1;
+	}
+	pthread_mutex_unlock(&pc->lock);
+	if (trim) {
+		pixel_disk_trim(pc);
+	}
+}
+
+// Decompresses the pixels of a tile into a new image. Returns NULL if they
+// are damaged. The lock, if given, is the caller's, to let go of on failure.
+static struct image *pixel_image(const struct pixel_tile *pt, pthread_mutex_t *lock) {
+	size_t raw = (size_t) pt->width * pt->height * pt->depth;
+	struct image *i = malloc(sizeof(struct image));
+
+	if (i == NULL || (i->buf = malloc(raw)) == NULL) {
+		free(i);
+		stitch_log(LOG_ERROR, "Can't allocate memory for %zu\n", raw);
+		if (lock != NULL) {
+			pthread_mutex_unlock(lock);
+		}
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	i->width = pt->width;
+	i->height = pt->height;
+	i->depth = pt->depth;
+#if LZ4_FOUND
+	if (LZ4_decompress_safe((const char *) pt->buf, (char *) i->buf, pt->size, raw) != (int) raw) {
+		free_image(i);
+		return NULL;
+	}
+#else
+	if ((size_t) pt->size != raw) {
+		free_image(i);
+		return NULL;
+	}
+	memcpy(i->buf, pt->buf, raw);
+#endif
+	return i;
+}
+
+// The decoded image of the encoded tile, if either tier has it. The disk
+// tier is read without the lock, which is only taken again to keep what it
+// had in memory.
+struct image *pixel_cache_get(struct pixel_cache *pc, const struct data *data, unsigned long long hash, unsigned long long check) {
+	struct pixel_tile *pt;
+	struct image *i = NULL;
+
+	pthread_mutex_lock(&pc->lock);
+	pc->lookups++;
+	for (pt = pc->buckets[hash % 4096]; pt != NULL; pt = pt->hnext) {
+		if (pt->hash == hash && pt->check == check && pt->len == data->len) {
+			pixel_unlink(pc, pt);
+			pixel_push(pc, pt);
+			break;
+		}
+	}
+	if (pt != NULL) {
+		if ((i = pixel_image(pt, &pc->lock)) == NULL) {
+			stitch_log(LOG_ERROR, "Corrupt decoded tile %016llx\n", hash);
+			pthread_mutex_unlock(&pc->lock);
+			stitch_fail(STITCH_ERR_DECODE);
+		}
+		pc->hits++;
+		pthread_mutex_unlock(&pc->lock);
+		return i;
+	}
+	pthread_mutex_unlock(&pc->lock);
+
+	if (pc->dir == NULL || (pt = pixel_read(pc, hash, check, data->len)) == NULL) {
+		return NULL;
+	}
+
+	// A damaged file is decoded again from the tile instead
+	if ((i = pixel_image(pt, NULL)) == NULL) {
+		free(pt->buf);
+		free(pt);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&pc->lock);
+	pc->hits++;
+	if ((size_t) pt->size <= pc->cap) {
+		struct pixel_tile *have;
+
+		// Another thread may have read or decoded it meanwhile
+		for (have = pc->buckets[hash % 4096]; have != NULL; have = have->hnext) {
+			if (have->hash == hash && have->check == check && have->len == data->len) {
+				break;
+			}
+		}
+		if (have == NULL) {
+			pixel_insert(pc, pt);
+			pt = NULL;
+		}
+	}
+	pthread_mutex_unlock(&pc->lock);
+	if (pt != NULL) {
+		free(pt->buf);
+		free(pt);
+	}
+	return i;
+}
+
+// Keeps a newly decoded tile
+void pixel_cache_put(struct pixel_cache *pc, const struct data *data, unsigned long long hash, unsigned long long check, const struct image *i) {
+	size_t raw = (size_t) i->width * i->height * i->depth;
+	struct pixel_tile *pt = calloc(1, sizeof(struct pixel_tile));
+
+	if (pt == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for the decoded tile cache\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	pt->hash = hash;
+	pt->check = check;
+	pt->len = data->len;
+	pt->width = i->width;
+	pt->height = i->height;
+	pt->depth = i->depth;
+#if LZ4_FOUND
+	int bound = LZ4_compressBound(raw);
+
+	if ((pt->buf = malloc(bound)) == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for %d\n", bound);
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	pt->size = LZ4_compress_default((const char *) i->buf, (char *) pt->buf, raw, bound);
+	if (pt->size <= 0) {
+		stitch_log(LOG_ERROR, "Can't compress a decoded tile\n");
+		stitch_fail(STITCH_ERR_DECODE);
+	}
+	pt->buf = realloc(pt->buf, pt->size);
+#else
+	if ((pt->buf = malloc(raw)) == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for %zu\n", raw);
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	memcpy(pt->buf, i->buf, raw);
+	pt->size = raw;
+#endif
+
+	if (pc->dir != NULL) {
+		pixel_write(pc, pt);
+	}
+
+	pthread_mutex_lock(&pc->lock);
+	if ((size_t) pt->size <= pc->cap) {
+		pixel_insert(pc, pt);
+		pt = NULL;
+	}
+	pthread_mutex_unlock(&pc->lock);
+	if (pt != NULL) {
+		free(pt->buf);
+		free(pt);
+	}
+}
+
+// Decodes a PNG or JPEG image. Returns NULL if the data is neither, so that
+// the caller can skip the layer.
+struct image *decode_image(struct data *data) {
+	unsigned long long hash = 0, check = 0;
+	struct image *i;
+
+	struct pixel_cache *pc = frame != NULL ? frame->ctx->pixels : pixels;
+
+	if (pc != NULL) {
+		hash = pixel_hash(data, &check);
+		if ((i = pixel_cache_get(pc, data, hash, check)) != NULL) {
+			tile_cached = 1;
+			return i;
+		}
+	}
+
+	double start = timer_start();
+
+	if (data->len >= 4 && memcmp(data->buf, "\x89PNG", 4) == 0) {
+		i = read_png(data->buf, data->len);
+		if (stats != NULL) {
+			stats_time(&stats->decode[0], start);
+		}
+	} else if (data->len >= 2 && memcmp(data->buf, "\xFF\xD8", 2) == 0) {
+		i = read_jpeg(data->buf, data->len);
+		if (stats != NULL) {
+			stats_time(&stats->decode[1], start);
+		}
+	} else {
+		stitch_log(LOG_ERROR, "Don't recognize file format\n");
+		tile_failed++;
+		return NULL;
+	}
+
+	if (i == 0) {
+		// error message was printed by read_png or read_jpeg already
+		stitch_fail(STITCH_ERR_DECODE);
+	}
+	trace_event(TRACE_DECODE, start, data->len, i->width, i->height);
+	if (pc != NULL) {
+		pixel_cache_put(pc, data, hash, check, i);
+	}
+	return i;
+}
+
+// Encoded tiles shared by the jobs of a batch, keyed by layer URL template and
+// tile position. Every entry counts the planned uses that are still to come,
+// and its data is released after the last one.
+struct cached_tile {
+	const struct url_template *url;  // one of the cache's templates
+	int zoom;
+	unsigned int tx, ty;
+	struct data data;
+	int missing;                     // the server said it isn't there
+	int uses;
+	struct cached_tile *next;
+};
+
+struct tile_cache {
+	pthread_mutex_t lock;
+	struct cached_tile **buckets;
+	int nbuckets;
+	int count;
+	struct url_template **templates;  // of the layers planned, compiled once
+	int ntemplates;
+	int maxlen;                       // of their expanded URLs
+};
+
+struct tile_cache *tile_cache_new(int nbuckets) {
+	struct tile_cache *cache = malloc(sizeof(struct tile_cache));
+
+	if (cache == NULL || (cache->buckets = calloc(nbuckets, sizeof(struct cached_tile *))) == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for the tile cache\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->nbuckets = nbuckets;
+	cache->count = 0;
+	cache->templates = NULL;
+	cache->ntemplates = 0;
+	cache->maxlen = 0;
+	return cache;
+}
+
+void tile_cache_free(struct tile_cache *cache) {
+	int b;
+
+	frame_drop(cache);
+	for (b = 0; b < cache->nbuckets; b++) {
+		struct cached_tile *ct = cache->buckets[b];
+		while (ct != NULL) {
+			struct cached_tile *next = ct->next;
+			free(ct->data.buf);
+			free(ct);
+			ct = next;
+		}
+	}
+	for (b = 0; b < cache->ntemplates; b++) {
+		url_template_free(cache->templates[b]);
+	}
+	free(cache->templates);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->buckets);
+	free(cache);
+}
+
+static void release_tile_cache(void *p) {
+	tile_cache_free(p);
+}
+
+static struct cached_tile **tile_cache_slot(struct tile_cache *cache, const char *url, int zoom, unsigned int tx, unsigned int ty) {
+	unsigned long h = 5381;
+	const char *cp;
+
+	for (cp = url; *cp; cp++) {
+		h = h * 33 + (unsigned char) *cp;
+	}
+	h = (h * 33 + zoom) * 2654435761UL + tx * 40503UL + ty * 2246822519UL;
+
+	struct cached_tile **slot = &cache->buckets[h % cache->nbuckets];
+	while (*slot != NULL) {
+		struct cached_tile *ct = *slot;
+		if (ct->zoom == zoom && ct->tx == tx && ct->ty == ty && !strcmp(ct->url->url, url)) {
+			break;
+		}
+		slot = &ct->next;
+	}
+	return slot;
+}
+
+// The cache's own compiled copy of a template, since the URL may be one a
+// plan filled in, which goes with the plan
+static const struct url_template *tile_cache_template(struct tile_cache *cache, const char *url) {
+	int k;
+
+	for (k = 0; k < cache->ntemplates; k++) {
+		if (!strcmp(cache->templates[k]->url, url)) {
+			return cache->templates[k];
+		}
+	}
+
+	struct url_template **templates = realloc(cache->templates, (cache->ntemplates + 1) * sizeof(struct url_template *));
+	if (templates == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for the tile cache\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	cache->templates = templates;
+	cache->templates[cache->ntemplates] = url_compile(url);
+	if (cache->templates[cache->ntemplates]->maxlen > cache->maxlen) {
+		cache->maxlen = cache->templates[cache->ntemplates]->maxlen;
+	}
+	return cache->templates[cache->ntemplates++];
+}
+
+// Records one more planned use of a tile; returns 1 if it is new
+int tile_cache_plan(struct tile_cache *cache, const char *url, int zoom, unsigned int tx, unsigned int ty) {
+	struct cached_tile **slot = tile_cache_slot(cache, url, zoom, tx, ty);
+
+	if (*slot != NULL) {
+		(*slot)->uses++;
+		return 0;
+	}
+
+	struct cached_tile *ct = calloc(1, sizeof(struct cached_tile));
+	if (ct == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for the tile cache\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	ct->url = tile_cache_template(cache, url);
+	ct->zoom = zoom;
+	ct->tx = tx;
+	ct->ty = ty;
+	ct->uses = 1;
+	*slot = ct;
+	cache->count++;
+	return 1;
+}
+
+// Takes a copy of a prefetched tile, or its buffer itself on the last planned
+// use. Returns 0 if the tile isn't in the cache, and -1 if the prefetch found
+// it missing.
+int tile_cache_take(struct tile_cache *cache, const char *url, int zoom, unsigned int tx, unsigned int ty, struct data *out) {
+	int found = 0;
+
+	pthread_mutex_lock(&cache->lock);
+	struct cached_tile *ct = *tile_cache_slot(cache, url, zoom, tx, ty);
+	if (ct != NULL && ct->missing) {
+		ct->uses--;
+		found = -1;
+	} else if (ct != NULL && ct->data.buf != NULL) {
+		ct->uses--;
+		if (ct->uses <= 0) {
+			*out = ct->data;
+			ct->data.buf = NULL;
+			ct->data.len = ct->data.nalloc = 0;
+		} else {
+			out->buf = malloc(ct->data.len);
+			if (out->buf == NULL) {
+				stitch_log(LOG_ERROR, "Can't allocate memory for %d\n", ct->data.len);
+				pthread_mutex_unlock(&cache->lock);
+				stitch_fail(STITCH_ERR_MEMORY);
+			}
+			memcpy(out->buf, ct->data.buf, ct->data.len);
+			out->len = out->nalloc = ct->data.len;
+		}
+		found = 1;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	if (stats != NULL) {
+		stats_count(&stats->tile_lookups, &stats->tile_hits, found != 0);
+	}
+	return found;
+}
+
+// Aborts a transfer of a render that has been cancelled
+static int curl_cancel(void *v, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+	struct stitch_frame *fr = v;
+
+	return fr->cancel(fr->user);
+}
+
+void setup_tile_request(CURL *curl, const char *url, struct data *data) {
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(curl, CURLOPT_USERAGENT, "tile-stitch/1.0.0");
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, data);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_receive);
+	if (frame != NULL) {
+		curl_easy_setopt(curl, CURLOPT_SHARE, frame->ctx->share);
+	}
+	if (frame != NULL && frame->cancel != NULL) {
+		curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+		curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, curl_cancel);
+		curl_easy_setopt(curl, CURLOPT_XFERINFODATA, frame);
+	}
+}
+
+// Short-lived stitch processes on one host can share a daemon (-d) on a Unix
+// socket, which fetches their tiles over its warm connections and keeps the
+// bodies in memory for as long as their Cache-Control allows, revalidating
+// them by ETag after that. A request is a line with the expanded URL; the
+// answer is a line with the HTTP status and the length of the body, then
+// the body, or status 0 and the error if the transfer failed. A fixed pool
+// of threads answers the connections; those accepted beyond what they can
+// take wait in a queue, and after that in the socket's backlog.
+#define DAEMON_CACHE_BYTES (256 << 20)
+#define DAEMON_THREADS 64
+#define DAEMON_QUEUE 256
+
+static char daemon_path[108];
+static char daemon_dir[64];   // that the daemon makes for its socket, if any
+static pthread_once_t daemon_path_once = PTHREAD_ONCE_INIT;
+
+// The socket is in the user's runtime directory where there is one, and in
+// a directory of its own under /tmp otherwise, so that no other user can
+// put a socket of theirs in its place
+static void daemon_find_path(void) {
+	const char *env = getenv("STITCH_SOCKET");
+	const char *run = getenv("XDG_RUNTIME_DIR");
+
+	if (env != NULL) {
+		snprintf(daemon_path, sizeof daemon_path, "%s", env);
+	} else if (run != NULL && run[0] == '/') {
+		snprintf(daemon_path, sizeof daemon_path, "%s/stitch.sock", run);
+	} else {
+		snprintf(daemon_dir, sizeof daemon_dir, "/tmp/stitch-%ld", (long) getuid());
+		snprintf(daemon_path, sizeof daemon_path, "%s/stitch.sock", daemon_dir);
+	}
+}
+
+const char *daemon_socket_path(void) {
+	pthread_once(&daemon_path_once, daemon_find_path);
+	return daemon_path;
+}
+
+// Whether only this user can have put something at the path: the directory
+// it is in is theirs and no one else's to write to, or is sticky like /tmp,
+// and so is the socket, if there is one
+static int daemon_path_safe(const char *path, int need_socket) {
+	char dir[strlen(path) + 2];
+	char *slash;
+	struct stat st;
+
+	strcpy(dir, path);
+	if ((slash = strrchr(dir, '/')) == NULL) {
+		strcpy(dir, ".");
+	} else if (slash == dir) {
+		dir[1] = '\0';
+	} else {
+		*slash = '\0';
+	}
+	if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode) ||
+	    ((st.st_mode & 022) != 0 && (st.st_mode & S_ISVTX) == 0) ||
+	    (st.st_uid != getuid() && st.st_uid != 0)) {
+		return 0;
+	}
+	if (lstat(path, &st) != 0) {
+		return !need_socket;
+	}
+	return S_ISSOCK(st.st_mode) && st.st_uid == getuid();
+}
+
+static int daemon_connect(void) {
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (!daemon_path_safe(daemon_socket_path(), 1)) {
+		return -1;
+	}
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	snprintf(sa.sun_path, sizeof sa.sun_path, "%s", daemon_socket_path());
+	if (fd >= 0 && connect(fd, (struct sockaddr *) &sa, sizeof sa) != 0) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+// Whether a daemon answers, asked once per process
+static int daemon_up;
+static pthread_once_t daemon_once = PTHREAD_ONCE_INIT;
+
+static void daemon_probe(void) {
+	int fd = daemon_connect();
+
+	if (fd >= 0) {
+		daemon_up = 1;
+		close(fd);
+		stitch_log(LOG_INFO, "==Fetching through the daemon at %s\n", daemon_socket_path());
+	}
+}
+
+int tile_daemon(void) {
+	pthread_once(&daemon_once, daemon_probe);
+	return daemon_up;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n <= 0) {
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int read_all(int fd, char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = read(fd, buf, len);
+		if (n <= 0) {
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// Reads a line of at most len - 1 characters, without its newline
+static int read_line(int fd, char *buf, size_t len) {
+	size_t n = 0;
+
+	while (n + 1 < len) {
+		if (read(fd, buf + n, 1) != 1) {
+			return -1;
+		}
+		if (buf[n] == '\n') {
+			buf[n] = '\0';
+			return 0;
+		}
+		n++;
+	}
+	return -1;
+}
+
+// Fetches an expanded URL through the daemon into data, setting its HTTP
+// status, or 0 with the error in data. Returns -1 if the daemon is gone.
+int daemon_fetch(const char *url2, struct data *data, long *status) {
+	char line[64];
+	int fd = daemon_connect(), len;
+
+	if (fd < 0) {
+		return -1;
+	}
+	if (write_all(fd, "GET ", 4) != 0 || write_all(fd, url2, strlen(url2)) != 0 || write_all(fd, "\n", 1) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	// A render that is cancelled stops waiting for the daemon's transfer
+	if (frame != NULL && frame->cancel != NULL) {
+		struct pollfd pfd = { fd, POLLIN, 0 };
+
+		while (poll(&pfd, 1, 100) == 0) {
+			if (frame->cancel(frame->user)) {
+				close(fd);
+				stitch_log(LOG_ERROR, "Render cancelled\n");
+				stitch_fail(STITCH_ERR_CANCELLED);
+			}
+		}
+	}
+	if (read_line(fd, line, sizeof line) != 0 || sscanf(line, "%ld %d", status, &len) != 2 || len < 0) {
+		close(fd);
+		return -1;
+	}
+	if ((data->buf = malloc(len + 1)) == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for %d\n", len);
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	if (read_all(fd, data->buf, len) != 0) {
+		free(data->buf);
+		data->buf = NULL;
+		close(fd);
+		return -1;
+	}
+	data->buf[len] = '\0';
+	data->len = len;
+	data->nalloc = len + 1;
+	close(fd);
+	return 0;
+}
+
+struct daemon_tile {
+	char *url;
+	struct data body;
+	char *etag;
+	time_t expires;
+	struct daemon_tile *hnext, *newer, *older;
+};
+
+// A transfer in progress, which other requests for the same URL wait for
+struct daemon_flight {
+	char *url;
+	pthread_cond_t done;
+	int finished, waiters;
+	long status;
+	struct data body;
+	struct daemon_flight *next;
+};
+
+struct tile_daemon {
+	pthread_mutex_t lock;
+	CURLSH *share;
+	pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+	struct daemon_tile *buckets[4096];
+	struct daemon_tile *newest, *oldest;
+	size_t bytes;
+	struct daemon_flight *flights;
+	long requests, hits, revalidated, shared;
+};
+
+static struct tile_daemon dm;
+
+static void daemon_share_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *v) {
+	pthread_mutex_lock(&dm.share_locks[data]);
+}
+
+static void daemon_share_unlock(CURL *curl, curl_lock_data data, void *v) {
+	pthread_mutex_unlock(&dm.share_locks[data]);
+}
+
+static unsigned long daemon_hash(const char *url) {
+	unsigned long h = 5381;
+
+	for (; *url; url++) {
+		h = h * 33 + (unsigned char) *url;
+	}
+	return h % 4096;
+}
+
+static struct daemon_tile **daemon_slot(const char *url) {
+	struct daemon_tile **slot = &dm.buckets[daemon_hash(url)];
+
+	while (*slot != NULL && strcmp((*slot)->url, url) != 0) {
+		slot = &(*slot)->hnext;
+	}
+	return slot;
+}
+
+static void daemon_unlink(struct daemon_tile *dt) {
+	*daemon_slot(dt->url) = dt->hnext;
+	*(dt->newer != NULL ? &dt->newer->older : &dm.newest) = dt->older;
+	*(dt->older != NULL ? &dt->older->newer : &dm.oldest) = dt->newer;
+	dm.bytes -= dt->body.len;
+}
+
+static void daemon_tile_free(struct daemon_tile *dt) {
+	free(dt->url);
+	free(dt->body.buf);
+	free(dt->etag);
+	free(dt);
+}
+
+// Makes a tile the most recently used, the caller holding the lock, and
+// drops the least recently used ones beyond the cap
+static void daemon_insert(struct daemon_tile *dt) {
+	dt->hnext = dm.buckets[daemon_hash(dt->url)];
+	dm.buckets[daemon_hash(dt->url)] = dt;
+	dt->newer = NULL;
+	dt->older = dm.newest;
+	*(dm.newest != NULL ? &dm.newest->newer : &dm.oldest) = dt;
+	dm.newest = dt;
+	dm.bytes += dt->body.len;
+
+	while (dm.bytes > DAEMON_CACHE_BYTES && dm.oldest != dt) {
+		struct daemon_tile *old = dm.oldest;
+
+		daemon_unlink(old);
+		daemon_tile_free(old);
+	}
+}
+
+// The validators of a response: its ETag and how long it stays fresh,
+// or -1 if it must not be kept at all
+struct daemon_response {
+	char *etag;
+	long maxage;
+};
+
+static size_t daemon_header(char *ptr, size_t size, size_t nmemb, void *v) {
+	struct daemon_response *dr = v;
+	size_t len = size * nmemb, start, end = len;
+
+	while (end > 0 && (ptr[end - 1] == '\r' || ptr[end - 1] == '\n' || ptr[end - 1] == ' ')) {
+		end--;
+	}
+	if (len >= 5 && !strncmp(ptr, "HTTP/", 5)) {
+		free(dr->etag);
+		dr->etag = NULL;
+		dr->maxage = 0;
+	} else if (len > 5 && !strncasecmp(ptr, "ETag:", 5)) {
+		for (start = 5; start < end && (ptr[start] == ' ' || ptr[start] == '\t'); start++) {
+			;
+		}
+		if (end > start) {
+			free(dr->etag);
+			if ((dr->etag = strndup(ptr + start, end - start)) == NULL) {
+				stitch_log(LOG_ERROR, "Can't allocate memory for an ETag\n");
+				stitch_fail(STITCH_ERR_MEMORY);
+			}
+		}
+	} else if (len > 14 && !strncasecmp(ptr, "Cache-Control:", 14)) {
+		char value[end - 14 + 1], *cp;
+
+		memcpy(value, ptr + 14, end - 14);
+		value[end - 14] = '\0';
+		if (strstr(value, "no-store") != NULL) {
+			dr->maxage = -1;
+		} else if (strstr(value, "no-cache") == NULL && (cp = strstr(value, "max-age=")) != NULL) {
+			dr->maxage = atol(cp + 8);
+		}
+	}
+	return len;
+}
+
+static CURLcode daemon_transfer(const char *url, const char *etag, struct data *body, struct daemon_response *dr, long *status) {
+	struct curl_slist *request = NULL;
+	CURL *curl = curl_easy_init();
+
+	if (curl == NULL) {
+		stitch_log(LOG_ERROR, "Curl won't start\n");
+		stitch_fail(STITCH_ERR_FETCH);
+	}
+	setup_tile_request(curl, url, body);
+	curl_easy_setopt(curl, CURLOPT_SHARE, dm.share);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, daemon_header);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, dr);
+	if (etag != NULL) {
+		char condition[strlen(etag) + 20];
+
+		sprintf(condition, "If-None-Match: %s", etag);
+		request = curl_slist_append(NULL, condition);
+		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, request);
+	}
+
+	CURLcode res = curl_easy_perform(curl);
+	*status = 0;
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, status);
+	curl_easy_cleanup(curl);
+	curl_slist_free_all(request);
+	return res;
+}
+
+static void daemon_reply(int fd, long status, const char *buf, int len) {
+	char line[64];
+
+	snprintf(line, sizeof line, "%ld %d\n", status, len);
+	if (write_all(fd, line, strlen(line)) == 0) {
+		write_all(fd, buf, len);
+	}
+}
+
+// Fetches a tile the memory doesn't have fresh, with the ETag it had if
+// there is one, and keeps what comes back if it may be kept. Sets the
+// status and body to answer with, or status 0 and the error in the body.
+static void daemon_fetch_tile(const char *url, char *etag, long *status, struct data *body) {
+	struct daemon_response dr = { NULL, 0 };
+	struct daemon_tile *dt;
+
+	stitch_log(LOG_DEBUG, "%s\n", url);
+	for (;;) {
+		CURLcode res = daemon_transfer(url, etag, body, &dr, status);
+
+		if (res != CURLE_OK) {
+			const char *err = curl_easy_strerror(res);
+
+			free(body->buf);
+			if ((body->buf = strdup(err)) == NULL) {
+				stitch_log(LOG_ERROR, "Can't allocate memory for an error\n");
+				stitch_fail(STITCH_ERR_MEMORY);
+			}
+			body->len = strlen(err);
+			*status = 0;
+			break;
+		}
+
+		pthread_mutex_lock(&dm.lock);
+		dt = *daemon_slot(url);
+		if (*status == 304 && dt == NULL) {
+			// Dropped while it was revalidated
+			pthread_mutex_unlock(&dm.lock);
+			free(etag);
+			etag = NULL;
+			free(body->buf);
+			body->buf = NULL;
+			body->len = body->nalloc = 0;
+			continue;
+		}
+		if (*status == 304) {
+			// Still the same, and fresh again
+			dm.revalidated++;
+			free(body->buf);
+			if ((body->buf = malloc(dt->body.len + 1)) == NULL) {
+				stitch_log(LOG_ERROR, "Can't allocate memory for %d\n", dt->body.len);
+				stitch_fail(STITCH_ERR_MEMORY);
+			}
+			memcpy(body->buf, dt->body.buf, dt->body.len);
+			body->len = dt->body.len;
+			*status = 200;
+			dt->expires = time(NULL) + (dr.maxage > 0 ? dr.maxage : 0);
+			daemon_unlink(dt);
+			daemon_insert(dt);
+		} else if (*status == 200) {
+			if (dt != NULL) {
+				daemon_unlink(dt);
+				daemon_tile_free(dt);
+			}
+			if (dr.maxage >= 0 && (dr.maxage > 0 || dr.etag != NULL) && body->len <= DAEMON_CACHE_BYTES) {
+				if ((dt = calloc(1, sizeof(struct daemon_tile))) == NULL || (dt->url = strdup(url)) == NULL ||
+				    (dt->body.buf = malloc(body->len + 1)) == NULL) {
+					stitch_log(LOG_ERROR, "Can't allocate memory for the daemon's tiles\n");
+					stitch_fail(STITCH_ERR_MEMORY);
+				}
+				memcpy(dt->body.buf, body->buf, body->len);
+				dt->body.len = body->len;
+				dt->etag = dr.etag;
+				dr.etag = NULL;
+				dt->expires = time(NULL) + dr.maxage;
+				daemon_insert(dt);
+			}
+		}
+		pthread_mutex_unlock(&dm.lock);
+		break;
+	}
+
+	free(dr.etag);
+	free(etag);
+}
+
+// Answers the request of one connection. Requests for a tile that is
+// already being fetched wait for that transfer instead of starting another.
+static void daemon_serve(int fd) {
+	char line[8192], *url, *etag = NULL;
+	struct data body = { NULL, 0, 0 };
+	struct daemon_tile *dt;
+	struct daemon_flight *df;
+	long status = 200;
+
+	if (read_line(fd, line, sizeof line) != 0 || strncmp(line, "GET ", 4) != 0) {
+		return;
+	}
+	url = line + 4;
+
+	// A fresh tile is served as it is; a stale one is asked for with its ETag
+	pthread_mutex_lock(&dm.lock);
+	if (++dm.requests % 1000 == 0) {
+		stitch_log(LOG_INFO, "==Daemon: %ld requests, %ld from memory, %ld revalidated, %ld shared\n", dm.requests, dm.hits, dm.revalidated, dm.shared);
+	}
+	if ((dt = *daemon_slot(url)) != NULL && time(NULL) < dt->expires) {
+		dm.hits++;
+		if ((body.buf = malloc(dt->body.len + 1)) == NULL) {
+			stitch_log(LOG_ERROR, "Can't allocate memory for %d\n", dt->body.len);
+			stitch_fail(STITCH_ERR_MEMORY);
+		}
+		memcpy(body.buf, dt->body.buf, dt->body.len);
+		body.len = dt->body.len;
+		daemon_unlink(dt);
+		daemon_insert(dt);
+		pthread_mutex_unlock(&dm.lock);
+	} else {
+		for (df = dm.flights; df != NULL && strcmp(df->url, url) != 0; df = df->next) {
+			;
+		}
+		if (df != NULL) {
+			dm.shared++;
+			df->waiters++;
+			while (!df->finished) {
+				pthread_cond_wait(&df->done, &dm.lock);
+			}
+			status = df->status;
+			if ((body.buf = malloc(df->body.len + 1)) == NULL) {
+				stitch_log(LOG_ERROR, "Can't allocate memory for %d\n", df->body.len);
+				stitch_fail(STITCH_ERR_MEMORY);
+			}
+			memcpy(body.buf, df->body.buf, df->body.len);
+			body.len = df->body.len;
+			if (--df->waiters == 0) {
+				pthread_cond_destroy(&df->done);
+				free(df->body.buf);
+				free(df->url);
+				free(df);
+			}
+			pthread_mutex_unlock(&dm.lock);
+		} else {
+			if ((df = calloc(1, sizeof(struct daemon_flight))) == NULL || (df->url = strdup(url)) == NULL ||
+			    (dt != NULL && dt->etag != NULL && (etag = strdup(dt->etag)) == NULL)) {
+				stitch_log(LOG_ERROR, "Can't allocate memory for the daemon's transfers\n");
+				stitch_fail(STITCH_ERR_MEMORY);
+			}
+			pthread_cond_init(&df->done, NULL);
+			df->next = dm.flights;
+			dm.flights = df;
+			pthread_mutex_unlock(&dm.lock);
+
+			daemon_fetch_tile(url, etag, &status, &body);
+
+			// The waiters take copies; the last one out frees it
+			pthread_mutex_lock(&dm.lock);
+			struct daemon_flight **fp;
+			for (fp = &dm.flights; *fp != df; fp = &(*fp)->next) {
+				;
+			}
+			*fp = df->next;
+			df->finished = 1;
+			df->status = status;
+			if (df->waiters > 0) {
+				if ((df->body.buf = malloc(body.len + 1)) == NULL) {
+					stitch_log(LOG_ERROR, "Can't allocate memory for %d\n", body.len);
+					stitch_fail(STITCH_ERR_MEMORY);
+				}
+				memcpy(df->body.buf, body.buf, body.len);
+				df->body.len = body.len;
+				pthread_cond_broadcast(&df->done);
+			} else {
+				pthread_cond_destroy(&df->done);
+				free(df->url);
+				free(df);
+			}
+			pthread_mutex_unlock(&dm.lock);
+		}
+	}
+
+	daemon_reply(fd, status, body.buf, body.len);
+	free(body.buf);
+}
+
+static struct daemon_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t ready, room;
+	int clients[DAEMON_QUEUE];
+	int first, count;
+} dq = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void *daemon_worker(void *v) {
+	for (;;) {
+		pthread_mutex_lock(&dq.lock);
+		while (dq.count == 0) {
+			pthread_cond_wait(&dq.ready, &dq.lock);
+		}
+		int client = dq.clients[dq.first];
+		dq.first = (dq.first + 1) % DAEMON_QUEUE;
+		dq.count--;
+		pthread_cond_signal(&dq.room);
+		pthread_mutex_unlock(&dq.lock);
+
+		daemon_serve(client);
+		close(client);
+	}
+	return NULL;
+}
+
+// Listens on the daemon's socket, unless another daemon already does
+int daemon_listen(void) {
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	const char *path = daemon_socket_path();
+	mode_t mask;
+	int fd, k;
+
+	if (daemon_dir[0] != '\0' && mkdir(daemon_dir, 0700) != 0 && errno != EEXIST) {
+		stitch_log(LOG_ERROR, "%s: %s\n", daemon_dir, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (!daemon_path_safe(path, 0)) {
+		stitch_log(LOG_ERROR, "%s: not a socket of yours, or in a directory others can write to\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	// A socket nobody answers on is left over from a daemon that died
+	if ((fd = daemon_connect()) >= 0) {
+		stitch_log(LOG_ERROR, "A daemon is already listening on %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	unlink(path);
+
+	// The socket is made private as it is bound, not after
+	snprintf(sa.sun_path, sizeof sa.sun_path, "%s", path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	mask = umask(0177);
+	if (fd < 0 || bind(fd, (struct sockaddr *) &sa, sizeof sa) != 0) {
+		stitch_log(LOG_ERROR, "%s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	umask(mask);
+	if (listen(fd, 128) != 0) {
+		stitch_log(LOG_ERROR, "%s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	curl_global_init(CURL_GLOBAL_ALL);
+	pthread_mutex_init(&dm.lock, NULL);
+	for (k = 0; k < CURL_LOCK_DATA_LAST; k++) {
+		pthread_mutex_init(&dm.share_locks[k], NULL);
+	}
+	dm.share = curl_share_init();
+	curl_share_setopt(dm.share, CURLSHOPT_LOCKFUNC, daemon_share_lock);
+	curl_share_setopt(dm.share, CURLSHOPT_UNLOCKFUNC, daemon_share_unlock);
+	curl_share_setopt(dm.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(dm.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	curl_share_setopt(dm.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+	stitch_log(LOG_INFO, "==Daemon listening on %s\n", path);
+	return fd;
+}
+
+// Serves tile requests on the daemon's socket until killed. Connections are
+// only accepted while the queue has room, so that the rest wait in the
+// backlog instead of each holding a thread.
+void *daemon_loop(void *v) {
+	int fd = (intptr_t) v;
+	int k, nthreads = 0;
+
+	for (k = 0; k < DAEMON_THREADS; k++) {
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, daemon_worker, NULL) != 0) {
+			break;
+		}
+		pthread_detach(thread);
+		nthreads++;
+	}
+	if (nthreads == 0) {
+		stitch_log(LOG_ERROR, "Can't start daemon threads\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&dq.lock);
+		while (dq.count == DAEMON_QUEUE) {
+			pthread_cond_wait(&dq.room, &dq.lock);
+		}
+		pthread_mutex_unlock(&dq.lock);
+
+		int client = accept(fd, NULL, NULL);
+		if (client < 0) {
+			continue;
+		}
+		pthread_mutex_lock(&dq.lock);
+		dq.clients[(dq.first + dq.count) % DAEMON_QUEUE] = client;
+		dq.count++;
+		pthread_cond_signal(&dq.ready);
+		pthread_mutex_unlock(&dq.lock);
+	}
+	return NULL;
+}
+
+// Whether a status says the tile isn't there, rather than that the server
+// couldn't send it
+static int http_missing(long status) {
+	return status == 404 || status == 410 || status == 204;
+}
+
+// Tiles of a prefetch, shared by the threads asking the daemon for them
+struct daemon_prefetch {
+	pthread_mutex_t lock;
+	struct cached_tile **pending;
+	int npending, next, failed;
+	int maxlen;       // of the URLs
+	stitch_ctx *ctx;  // of the render, if stitch_render() started it
+	int (*cancel)(void *);
+	void *user;       // of cancel
+	int status;
+	double queued;    // when the tiles were handed to the threads
+};
+
+static void *daemon_prefetch_thread(void *v) {
+	struct daemon_prefetch *dp = v;
+	struct stitch_frame fr = { .ctx = dp->ctx, .cancel = dp->cancel, .user = dp->user };
+	char *url2 = malloc(dp->maxlen + 1);
+	int status;
+
+	if (url2 == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for a URL\n");
+		pthread_mutex_lock(&dp->lock);
+		dp->status = STITCH_ERR_MEMORY;
+		dp->next = dp->npending;
+		pthread_mutex_unlock(&dp->lock);
+		return NULL;
+	}
+
+	// A failure can't unwind into the render's own thread, so it stops the
+	// others and the render fails after they are joined
+	if (dp->ctx != NULL) {
+		if ((status = setjmp(fr.env)) != 0) {
+			pthread_mutex_lock(&dp->lock);
+			dp->status = status;
+			dp->next = dp->npending;
+			pthread_mutex_unlock(&dp->lock);
+			frame = NULL;
+			free(url2);
+			return NULL;
+		}
+		frame = &fr;
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&dp->lock);
+		struct cached_tile *ct = dp->next < dp->npending ? dp->pending[dp->next++] : NULL;
+		pthread_mutex_unlock(&dp->lock);
+		if (ct == NULL) {
+			frame = NULL;
+			free(url2);
+			return NULL;
+		}
+		frame_check();
+
+		long status = 0;
+		double start = timer_start();
+		int gone;
+
+		url_expand(ct->url, ct->zoom, ct->tx, ct->ty, url2);
+		stitch_log(LOG_DEBUG, "%s\n", url2);
+		gone = daemon_fetch(url2, &ct->data, &status) != 0;
+		stats_daemon(start, gone || status == 0 ? 0 : ct->data.len, !gone && status != 0);
+		progress_bytes(gone || status == 0 ? 0 : ct->data.len);
+		progress_tile(0);
+		if (trace_path != NULL) {
+			trace_span(TRACE_QUEUE, 0, dp->queued, start, ct->zoom, ct->tx, ct->ty);
+			trace_event(TRACE_FETCH, start, ct->zoom, ct->tx, ct->ty);
+		}
+		if (gone || status != 200) {
+			free(ct->data.buf);
+			ct->data.buf = NULL;
+			ct->data.len = ct->data.nalloc = 0;
+		}
+		if (!gone && http_missing(status)) {
+			ct->missing = 1;
+		} else if (gone || status != 200) {
+			pthread_mutex_lock(&dp->lock);
+			dp->failed++;
+			pthread_mutex_unlock(&dp->lock);
+		}
+	}
+}
+
+// Prefetches through the daemon, which keeps the connections, with parallel
+// requests at a time. Returns how many failed.
+static int daemon_prefetch(struct cached_tile **pending, int npending, int maxlen, int parallel) {
+	struct daemon_prefetch dp = { .pending = pending, .npending = npending, .maxlen = maxlen, .queued = timer_start() };
+	pthread_t threads[parallel];
+	int k, n = 0;
+
+	if (frame != NULL) {
+		dp.ctx = frame->ctx;
+		dp.cancel = frame->cancel;
+		dp.user = frame->user;
+	}
+
+	// If a thread won't start, the ones that did still have to finish
+	// before dp goes away
+	pthread_mutex_init(&dp.lock, NULL);
+	for (k = 0; k < parallel && k < npending; k++, n++) {
+		if (pthread_create(&threads[k], NULL, daemon_prefetch_thread, &dp) != 0) {
+			stitch_log(LOG_ERROR, "Can't start prefetch thread\n");
+			pthread_mutex_lock(&dp.lock);
+			dp.status = STITCH_ERR_INTERNAL;
+			dp.next = dp.npending;
+			pthread_mutex_unlock(&dp.lock);
+			break;
+		}
+	}
+	for (k = 0; k < n; k++) {
+		pthread_join(threads[k], NULL);
+	}
+	pthread_mutex_destroy(&dp.lock);
+	if (dp.status != 0) {
+		stitch_fail(dp.status);
+	}
+	return dp.failed;
+}
+
+// A multi handle and the transfers running on it, which are tracked here
+// rather than asked of libcurl, since only recent versions can list them
+struct multi {
+	CURLM *multi;
+	CURL **easy;
+	int neasy;
+};
+
+// Starts a multi handle for up to parallel transfers at a time
+static void multi_init(struct multi *m, int parallel) {
+	m->neasy = 0;
+	m->multi = curl_multi_init();
+	m->easy = malloc(parallel * sizeof(CURL *));
+	if (m->multi == NULL || m->easy == NULL) {
+		stitch_log(LOG_ERROR, "Curl won't start\n");
+		if (m->multi != NULL) {
+			curl_multi_cleanup(m->multi);
+		}
+		free(m->easy);
+		stitch_fail(STITCH_ERR_FETCH);
+	}
+	curl_multi_setopt(m->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+}
+
+static void multi_add(struct multi *m, CURL *curl) {
+	m->easy[m->neasy++] = curl;
+	curl_multi_add_handle(m->multi, curl);
+}
+
+// Removes and closes a transfer that is done
+static void multi_remove(struct multi *m, CURL *curl) {
+	int k;
+
+	for (k = 0; k < m->neasy && m->easy[k] != curl; k++) {
+		;
+	}
+	if (k < m->neasy) {
+		m->easy[k] = m->easy[--m->neasy];
+	}
+	curl_multi_remove_handle(m->multi, curl);
+	curl_easy_cleanup(curl);
+}
+
+// Removes and closes the transfers still running, as a failure leaves them,
+// then the handle
+static void multi_cleanup(struct multi *m) {
+	while (m->neasy > 0) {
+		multi_remove(m, m->easy[m->neasy - 1]);
+	}
+	curl_multi_cleanup(m->multi);
+	free(m->easy);
+}
+
+static void release_multi(void *p) {
+	multi_cleanup(p);
+}
+
+// Fetches every tile of the cache that has no data yet, at most parallel
+// transfers at a time through one multi handle, so that all the transfers
+// share its connection pool, DNS cache and TLS sessions. Tiles that the
+// server says aren't there are marked missing; those that fail are left
+// empty, and the job that needs them fetches them again and reports it.
+void tile_cache_prefetch(struct tile_cache *cache, int parallel) {
+	struct cached_tile **pending = malloc((cache->count + 1) * sizeof(struct cached_tile *));
+	int npending = 0, next = 0, running = 0, failed = 0;
+	int b;
+
+	if (pending == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for %d tiles\n", cache->count);
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	frame_hold(pending, free);
+
+	for (b = 0; b < cache->nbuckets; b++) {
+		struct cached_tile *ct;
+		for (ct = cache->buckets[b]; ct != NULL; ct = ct->next) {
+			if (ct->data.buf == NULL && !ct->missing) {
+				pending[npending++] = ct;
+			}
+		}
+	}
+
+	progress_begin("prefetch", npending);
+	if (tile_daemon()) {
+		failed = daemon_prefetch(pending, npending, cache->maxlen, parallel);
+		next = npending;
+	}
+
+	struct multi m;
+	multi_init(&m, parallel);
+	frame_hold(&m, release_multi);
+
+	char *url2 = malloc(cache->maxlen + 1);
+	if (url2 == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for a URL\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	frame_hold(url2, free);
+
+	double queued = timer_start();
+	while (next < npending || running > 0) {
+		frame_check();
+		while (next < npending && running < parallel) {
+			struct cached_tile *ct = pending[next++];
+
+			url_expand(ct->url, ct->zoom, ct->tx, ct->ty, url2);
+			stitch_log(LOG_DEBUG, "%s\n", url2);
+
+			CURL *curl = curl_easy_init();
+			if (curl == NULL) {
+				stitch_log(LOG_ERROR, "Curl won't start\n");
+				stitch_fail(STITCH_ERR_FETCH);
+			}
+			setup_tile_request(curl, url2, &ct->data);
+			curl_easy_setopt(curl, CURLOPT_PRIVATE, ct);
+			multi_add(&m, curl);
+			running++;
+		}
+
+		int still_running;
+		curl_multi_perform(m.multi, &still_running);
+		curl_multi_poll(m.multi, NULL, 0, 1000, NULL);
+
+		CURLMsg *msg;
+		int left;
+		while ((msg = curl_multi_info_read(m.multi, &left)) != NULL) {
+			if (msg->msg != CURLMSG_DONE) {
+				continue;
+			}
+
+			struct cached_tile *ct;
+			long status = 0;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &ct);
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &status);
+			stats_transfer(msg->easy_handle, msg->data.result == CURLE_OK);
+			trace_transfer(msg->easy_handle, queued, ct->zoom, ct->tx, ct->ty);
+			progress_bytes(ct->data.len);
+			progress_tile(0);
+
+			if (msg->data.result != CURLE_OK || (status != 0 && status != 200)) {
+				free(ct->data.buf);
+				ct->data.buf = NULL;
+				ct->data.len = ct->data.nalloc = 0;
+				if (msg->data.result == CURLE_OK && http_missing(status)) {
+					ct->missing = 1;
+				} else {
+					failed++;
+				}
+			}
+
+			multi_remove(&m, msg->easy_handle);
+			running--;
+		}
+	}
+
+	frame_drop(&m);
+	multi_cleanup(&m);
+	frame_free(url2);
+	frame_free(pending);
+	progress_end();
+	if (failed > 0) {
+		stitch_log(LOG_INFO, "==Prefetch: %d of %d tiles failed, retrying them per job\n", failed, npending);
+	}
+}
+
+#define FETCH_ATTEMPTS 3
+
+// Fetches an expanded URL into data once, through the daemon if there is
+// one. Returns the HTTP status.
+static long fetch_status(const char *url2, struct data *data) {
+	long status = 0;
+
+	// The daemon reports a failed transfer with status 0 and the error
+	double start = timer_start();
+	if (tile_daemon() && daemon_fetch(url2, data, &status) == 0) {
+		stats_daemon(start, status != 0 ? data->len : 0, status != 0);
+		progress_bytes(status != 0 ? data->len : 0);
+		if (status == 0) {
+			stitch_log(LOG_ERROR, "Can't retrieve %s: %s\n", url2, data->buf);
+			stitch_fail(STITCH_ERR_FETCH);
+		}
+	} else {
+		CURL *curl = curl_easy_init();
+		if (curl == NULL) {
+			stitch_log(LOG_ERROR, "Curl won't start\n");
+			stitch_fail(STITCH_ERR_FETCH);
+		}
+
+		setup_tile_request(curl, url2, data);
+
+		CURLcode res = curl_easy_perform(curl);
+		stats_transfer(curl, res == CURLE_OK);
+		progress_bytes(data->len);
+		if (res != CURLE_OK) {
+			curl_easy_cleanup(curl);
+			free(data->buf);
+			data->buf = NULL;
+			if (res == CURLE_ABORTED_BY_CALLBACK) {
+				frame_check();
+			}
+			stitch_log(LOG_ERROR, "Can't retrieve %s: %s\n", url2,
+				curl_easy_strerror(res));
+			stitch_fail(STITCH_ERR_FETCH);
+		}
+
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+		curl_easy_cleanup(curl);
+	}
+	return status;
+}
+
+// Fetches an expanded URL into data. Returns 0 if the server says it is
+// missing, with data freed.
+int fetch_url(const char *url2, struct data *data) {
+	long status = 0;
+	int attempt;
+
+	stitch_log(LOG_DEBUG, "%s\n", url2);
+
+	// A server that is busy or failing is asked again a few times, waiting
+	// longer each time, before the stitch fails; only a tile the server says
+	// isn't there is missing
+	for (attempt = 1;; attempt++) {
+		status = fetch_status(url2, data);
+		if (status != 429 && status < 500) {
+			break;
+		}
+		free(data->buf);
+		data->buf = NULL;
+		data->len = data->nalloc = 0;
+		if (attempt == FETCH_ATTEMPTS) {
+			stitch_log(LOG_ERROR, "Can't retrieve %s: HTTP %ld\n", url2, status);
+			stitch_fail(STITCH_ERR_FETCH);
+		}
+		frame_check();
+		sleep(1 << (attempt - 1));
+	}
+
+	if (http_missing(status)) {
+		stitch_log(LOG_DEBUG, "Missing %s: HTTP %ld\n", url2, status);
+		progress_missing();
+		free(data->buf);
+		data->buf = NULL;
+		return 0;
+	}
+	if (status >= 400) {
+		stitch_log(LOG_ERROR, "Can't retrieve %s: HTTP %ld\n", url2, status);
+		free(data->buf);
+		data->buf = NULL;
+		stitch_fail(STITCH_ERR_FETCH);
+	}
+	return 1;
+}
+
+// Fetches and decodes one tile, from the cache if there is one and the tile
+// was prefetched. Returns NULL if the tile is missing or the server sent
+// something that is neither PNG nor JPEG, so that the caller can skip the
+// layer.
+struct image *fetch_tile(struct tile_cache *cache, const struct url_template *url, int zoom, unsigned int tx, unsigned int ty) {
+	struct data data;
+	data.buf = NULL;
+	data.len = 0;
+	data.nalloc = 0;
+
+	int took = cache != NULL ? tile_cache_take(cache, url->url, zoom, tx, ty, &data) : 0;
+	tile_cached = took != 0;
+	if (took < 0) {
+		progress_missing();
+		return NULL;
+	}
+	if (!tile_cached) {
+		char url2[url->maxlen + 1];
+
+		double start = timer_start();
+		int found;
+
+		url_expand(url, zoom, tx, ty, url2);
+		found = fetch_url(url2, &data);
+		trace_event(TRACE_FETCH, start, zoom, tx, ty);
+		if (!found) {
+			return NULL;
+		}
+	}
+
+	frame_hold(data.buf, free);
+	struct image *i = decode_image(&data);
+	frame_free(data.buf);
+	return i;
+}
+
+// Ancestors fetched to stand in for missing tiles, decoded, so that the
+// siblings of a missing tile reuse them. Ancestors that are missing too are
+// remembered as such and not asked for again.
+struct overzoom_tile {
+	const struct url_template *url;
+	int zoom;
+	unsigned int tx, ty;
+	struct image *image;
+	struct overzoom_tile *next;
+};
+
+struct overzoom {
+	int levels;
+	struct overzoom_tile *tiles;
+	int filled, fetched;
+};
+
+void overzoom_free(struct overzoom *oz) {
+	frame_drop(oz);
+	while (oz->tiles != NULL) {
+		struct overzoom_tile *next = oz->tiles->next;
+		if (oz->tiles->image != NULL) {
+			free_image(oz->tiles->image);
+		}
+		free(oz->tiles);
+		oz->tiles = next;
+	}
+}
+
+static void release_overzoom(void *p) {
+	overzoom_free(p);
+}
+
+static struct image *overzoom_ancestor(struct overzoom *oz, struct tile_cache *cache, const struct url_template *url, int zoom, unsigned int tx, unsigned int ty) {
+	struct overzoom_tile *ot;
+
+	for (ot = oz->tiles; ot != NULL; ot = ot->next) {
+		if (ot->zoom == zoom && ot->tx == tx && ot->ty == ty && ot->url == url) {
+			return ot->image;
+		}
+	}
+
+	ot = malloc(sizeof(struct overzoom_tile));
+	if (ot == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for the overzoom cache\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	ot->url = url;
+	ot->zoom = zoom;
+	ot->tx = tx;
+	ot->ty = ty;
+	ot->image = fetch_tile(cache, url, zoom, tx, ty);
+	ot->next = oz->tiles;
+	oz->tiles = ot;
+	oz->fetched++;
+	return ot->image;
+}
+
+// Stands in for a missing tile with the matching part of its nearest
+// available ancestor, up to oz->levels zooms up, scaled to tilesize. The
+// scaling is nearest neighbor so that encoded elevations stay valid.
+// Returns NULL if there is no ancestor either.
+struct image *overzoom_tile(struct overzoom *oz, struct tile_cache *cache, const struct url_template *url, int zoom, unsigned int tx, unsigned int ty, int tilesize) {
+	int k;
+
+	for (k = 1; k <= oz->levels && k <= zoom; k++) {
+		struct image *a = overzoom_ancestor(oz, cache, url, zoom - k, tx >> k, ty >> k);
+
+		if (a == NULL) {
+			continue;
+		}
+		if ((a->width >> k) == 0 || (a->height >> k) == 0) {
+			break;
+		}
+
+		// The quadrant of the ancestor, k levels down
+		int sw = a->width >> k, sh = a->height >> k;
+		int sx = (tx & ((1U << k) - 1)) * sw;
+		int sy = (ty & ((1U << k) - 1)) * sh;
+		struct image *i = malloc(sizeof(struct image));
+		int x, y;
+
+		if (i == NULL || (i->buf = malloc((size_t) tilesize * tilesize * a->depth)) == NULL) {
+			stitch_log(LOG_ERROR, "Can't allocate memory for %dx%d tile\n", tilesize, tilesize);
+			stitch_fail(STITCH_ERR_MEMORY);
+		}
+		i->width = i->height = tilesize;
+		i->depth = a->depth;
+
+		for (y = 0; y < tilesize; y++) {
+			const unsigned char *src = a->buf + (size_t) (sy + y * sh / tilesize) * a->width * a->depth;
+			unsigned char *dst = i->buf + (size_t) y * tilesize * i->depth;
+
+			for (x = 0; x < tilesize; x++) {
+				memcpy(dst + x * i->depth, src + (sx + x * sw / tilesize) * a->depth, a->depth);
+			}
+		}
+
+		oz->filled++;
+		return i;
+	}
+	return NULL;
+}
+
+// Elevation decode kernels. Each encoding gets one kernel per source pixel
+// layout, generated from a single per-pixel expression, so that the encoding
+// and the layout are resolved once per run and the inner loops are straight
+// branch-free code the compiler can vectorize. Kernels for layouts with alpha
+// leave fully transparent pixels untouched.
+typedef void (*elevation_kernel_t)(const unsigned char *p, float *dst, int n);
+
+struct elevation_decoder {
+	const char *name;
+	elevation_kernel_t rgb;
+	elevation_kernel_t rgba;
+};
+
+#define ELEVATION_KERNELS(name, EXPR) \
+	static void decode_##name##_rgb(const unsigned char *restrict p, float *restrict dst, int n) { \
+		for (int k = 0; k < n; k++, p += 3) { \
+			dst[k] = (EXPR); \
+		} \
+	} \
+	static void decode_##name##_rgba(const unsigned char *restrict p, float *restrict dst, int n) { \
+		for (int k = 0; k < n; k++, p += 4) { \
+			dst[k] = p[3] ? (EXPR) : dst[k]; \
+		} \
+	}
+
+// Terrarium: (R * 256 + G + B / 256) - 32768 meters
+ELEVATION_KERNELS(terrarium, (p[0] * 256.0f + p[1] + p[2] / 256.0f) - 32768.0f)
+
+// Mapbox Terrain-RGB: -10000 + (R * 65536 + G * 256 + B) * 0.1 meters
+ELEVATION_KERNELS(mapbox, -10000.0f + (p[0] * 65536 + p[1] * 256 + p[2]) * 0.1f)
+
+// Normal map tiles carry the surface normal in RGB and a quantized elevation
+// in the alpha channel, so alpha is data here and never means "transparent".
+// The quantization table is the one used by the tile generator (joerd).
+static float normal_alpha_elevation[256];
+
+static void init_normal_alpha_table() {
+	int n = 0, k;
+
+	for (k = 0; k < 11; k++) {
+		normal_alpha_elevation[n++] = -11000 + k * 1000;
+	}
+	normal_alpha_elevation[n++] = -100;
+	normal_alpha_elevation[n++] = -50;
+	normal_alpha_elevation[n++] = -20;
+	normal_alpha_elevation[n++] = -10;
+	normal_alpha_elevation[n++] = -1;
+	for (k = 0; k < 150; k++) {
+		normal_alpha_elevation[n++] = 20 * k;
+	}
+	for (k = 0; k < 60; k++) {
+		normal_alpha_elevation[n++] = 3000 + 50 * k;
+	}
+	for (k = 0; k < 29; k++) {
+		normal_alpha_elevation[n++] = 6000 + 100 * k;
+	}
+	while (n < 256) {
+		normal_alpha_elevation[n] = normal_alpha_elevation[n - 1];
+		n++;
+	}
+}
+
+static void decode_normal_rgb(const unsigned char *restrict p, float *restrict dst, int n) {
+	for (int k = 0; k < n; k++) {
+		dst[k] = ELEVATION_NODATA;
+	}
+}
+
+static void decode_normal_rgba(const unsigned char *restrict p, float *restrict dst, int n) {
+	for (int k = 0; k < n; k++, p += 4) {
+		dst[k] = normal_alpha_elevation[p[3]];
+	}
+}
+
+const struct elevation_decoder elevation_decoders[] = {
+	[ELEVATION_TERRARIUM] = { "terrarium", decode_terrarium_rgb, decode_terrarium_rgba },
+	[ELEVATION_MAPBOX] = { "mapbox", decode_mapbox_rgb, decode_mapbox_rgba },
+	[ELEVATION_NORMAL] = { "normal", decode_normal_rgb, decode_normal_rgba },
+};
+
+elevation_encoding_t parse_elevation_encoding(const char *name) {
+	int k;
+
+	for (k = ELEVATION_DEFAULT + 1; k < (int) (sizeof(elevation_decoders) / sizeof(elevation_decoders[0])); k++) {
+		if (!strcmp(elevation_decoders[k].name, name)) {
+			return k;
+		}
+	}
+	return ELEVATION_DEFAULT;
+}
+
+const struct elevation_decoder *get_elevation_decoder(elevation_encoding_t encoding) {
+	static pthread_once_t normal_once = PTHREAD_ONCE_INIT;
+
+	if (encoding == ELEVATION_NORMAL) {
+		pthread_once(&normal_once, init_normal_alpha_table);
+	}
+	return &elevation_decoders[encoding == ELEVATION_DEFAULT ? ELEVATION_TERRARIUM : encoding];
+}
+
+// Decodes one row of pixels of any depth into elevations
+void decode_elevation_row(const struct elevation_decoder *decoder, const unsigned char *src, int depth, float *dst, int n) {
+	if (depth == 4) {
+		decoder->rgba(src, dst, n);
+	} else if (depth == 3) {
+		decoder->rgb(src, dst, n);
+	} else {
+		unsigned char rgb[n * 3];
+		int k;
+
+		for (k = 0; k < n; k++) {
+			rgb[k * 3] = rgb[k * 3 + 1] = rgb[k * 3 + 2] = src[k * depth];
+		}
+		decoder->rgb(rgb, dst, n);
+	}
+}
+
+// Decodes an elevation tile straight into the float32 elevation grid at the
+// given offset, clipping to the grid
+void blit_elevation(const struct elevation_decoder *decoder, float *grid, int width, int height, struct image *i, int xoff, int yoff) {
+	int x0 = xoff < 0 ? -xoff : 0;
+	int y0 = yoff < 0 ? -yoff : 0;
+	int x1 = i->width < width - xoff ? i->width : width - xoff;
+	int y1 = i->height < height - yoff ? i->height : height - yoff;
+	int y;
+	double start = timer_start();
+
+	if (x1 <= x0) {
+		return;
+	}
+
+	for (y = y0; y < y1; y++) {
+		decode_elevation_row(decoder,
+			i->buf + ((size_t) y * i->width + x0) * i->depth, i->depth,
+			grid + (size_t) (y + yoff) * width + xoff + x0, x1 - x0);
+	}
+	if (stats != NULL) {
+		stats_time(&stats->blend[1], start);
+	}
+	trace_event(TRACE_BLIT, start, xoff, yoff, 0);
+}
+
+struct elevation_stats {
+	float min;
+	float max;
+	double avg;
+	unsigned long long count;
+};
+
+// Accumulates range and running average over elevations, skipping nodata
+void elevation_stats_add(struct elevation_stats *st, const float *v, size_t n) {
+	size_t k;
+
+	for (k = 0; k < n; k++) {
+		if (v[k] == ELEVATION_NODATA) {
+			continue;
+		}
+
+		if (st->count == 0 || st->min > v[k]) {
+			st->min = v[k];
+		}
+		if (st->count == 0 || st->max < v[k]) {
+			st->max = v[k];
+		}
+
+		st->count++;
+		st->avg += (v[k] - st->avg) / st->count;
+	}
+}
+
+void print_elevation_stats(const struct elevation_stats *st) {
+	if (st->count > 0) {
+		stitch_log(LOG_INFO, "==Elevation range: [%.4f; %.4f] --> %.4f\n",
+			st->min, st->max, st->max - st->min);
+		stitch_log(LOG_INFO, "==Average elevation: %.4f\n", st->avg);
+	} else {
+		stitch_log(LOG_INFO, "==Elevation range: no data\n");
+	}
+}
+
+typedef enum {
+	RELIEF_NONE = 0,
+	RELIEF_HILLSHADE,
+	RELIEF_SLOPE
+} relief_t;
+
+// Sun position used for hillshading, in degrees
+#define HILLSHADE_AZIMUTH 315.0
+#define HILLSHADE_ALTITUDE 45.0
+
+relief_t parse_relief(const char *name) {
+	if (strcmp(name, "hillshade") == 0) {
+		return RELIEF_HILLSHADE;
+	} else if (strcmp(name, "slope") == 0) {
+		return RELIEF_SLOPE;
+	}
+	return -1;
+}
+
+typedef enum {
+	FILTER_BOX,
+	FILTER_BILINEAR,
+	FILTER_LANCZOS
+} resample_filter_t;
+
+resample_filter_t parse_resample_filter(const char *name) {
+	if (strcmp(name, "box") == 0) {
+		return FILTER_BOX;
+	} else if (strcmp(name, "bilinear") == 0) {
+		return FILTER_BILINEAR;
+	} else if (strcmp(name, "lanczos") == 0) {
+		return FILTER_LANCZOS;
+	}
+	return -1;
+}
+
+int default_thread_count() {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
+// Evaluates the 3x3 Horn stencil for one row. Neighbours outside the grid or
+// without data are replaced by the center value; cells without data stay so.
+void relief_row(relief_t relief, const float *above, const float *row, const float *below, float *out, int width, double cellx, double celly) {
+	double zenith = (90 - HILLSHADE_ALTITUDE) * M_PI / 180;
+	double azimuth = (360 - HILLSHADE_AZIMUTH + 90) * M_PI / 180;
+	int x;
+
+	for (x = 0; x < width; x++) {
+		int xl = x > 0 ? x - 1 : x;
+		int xr = x < width - 1 ? x + 1 : x;
+		float e = row[x];
+
+		if (e == ELEVATION_NODATA) {
+			out[x] = ELEVATION_NODATA;
+			continue;
+		}
+
+#define Z(r, c) ((r)[c] == ELEVATION_NODATA ? e : (r)[c])
+		double a = Z(above, xl), b = Z(above, x), c = Z(above, xr);
+		double d = Z(row, xl), f = Z(row, xr);
+		double g = Z(below, xl), h = Z(below, x), i = Z(below, xr);
+#undef Z
+
+		double dzdx = ((c + 2 * f + i) - (a + 2 * d + g)) / (8 * cellx);
+		double dzdy = ((g + 2 * h + i) - (a + 2 * b + c)) / (8 * celly);
+		double slope = atan(sqrt(dzdx * dzdx + dzdy * dzdy));
+
+		if (relief == RELIEF_SLOPE) {
+			out[x] = slope * 180 / M_PI;
+		} else {
+			double aspect = atan2(dzdy, -dzdx);
+			double shade = cos(zenith) * cos(slope) + sin(zenith) * sin(slope) * cos(azimuth - aspect);
+			out[x] = shade > 0 ? 255 * shade : 0;
+		}
+	}
+}
+
+struct relief_band {
+	relief_t relief;
+	float *grid;
+	int width;
+	int y0, y1;
+	float *above;  // copy of row y0 - 1, or NULL at the top of the grid
+	float *below;  // copy of row y1, or NULL at the bottom of the grid
+	stitch_projection_t projection;
+	double px, py, top;
+	stitch_status status;  // of the worker, which can't fail the render itself
+};
+
+// Replaces the elevations of a band of rows with the relief computed from
+// them, in place, keeping the original values of the previous and current
+// row in a sliding window. The rows just outside the band come from the
+// halo copies, since the neighbouring bands overwrite them concurrently.
+void *relief_band_worker(void *v) {
+	struct relief_band *band = v;
+	int width = band->width;
+	float *window = malloc(2 * width * sizeof(float));
+	float *out = malloc(width * sizeof(float));
+	int y;
+
+	if (window == NULL || out == NULL) {
+		free(window);
+		free(out);
+		band->status = STITCH_ERR_MEMORY;
+		return NULL;
+	}
+
+	for (y = band->y0; y < band->y1; y++) {
+		float *row = band->grid + (size_t) y * width;
+		float *cur = window + (y % 2) * width;
+		const float *above, *below;
+
+		memcpy(cur, row, width * sizeof(float));
+
+		if (y > band->y0) {
+			above = window + ((y + 1) % 2) * width;
+		} else {
+			above = band->above != NULL ? band->above : cur;
+		}
+
+		if (y + 1 < band->y1) {
+			below = row + width;
+		} else {
+			below = band->below != NULL ? band->below : cur;
+		}
+
+		// Cell sizes in meters on the ground at the latitude of the row
+		double cellx, celly;
+		if (band->projection == PROJECTION_GEOGRAPHIC) {
+			double lat = band->top - (y + 0.5) * band->py;
+			celly = band->py * M_PI / 180 * 6378137.0;
+			cellx = celly * band->px / band->py * cos(lat * M_PI / 180);
+		} else {
+			double my = band->top - (y + 0.5) * band->py;
+			double scale = cos(atan(sinh(my / 6378137.0)));
+			cellx = band->px * scale;
+			celly = band->py * scale;
+		}
+
+		relief_row(band->relief, above, cur, below, out, width, cellx, celly);
+		memcpy(row, out, width * sizeof(float));
+	}
+
+	free(window);
+	free(out);
+	return NULL;
+}
+
+// Turns the elevation grid into hillshade (0-255) or slope (degrees) in one
+// streaming pass, split into horizontal bands processed in parallel. A band
+// that fails fails the render only once all of them are joined.
+void apply_relief(relief_t relief, float *grid, int width, int height, stitch_projection_t projection, double px, double py, double top) {
+	int nbands = default_thread_count();
+	stitch_status status = STITCH_OK;
+	int k, nstarted;
+
+	if (nbands > height) {
+		nbands = height;
+	}
+
+	struct relief_band bands[nbands];
+	pthread_t threads[nbands];
+
+	for (k = 0; k < nbands; k++) {
+		bands[k].relief = relief;
+		bands[k].grid = grid;
+		bands[k].width = width;
+		bands[k].y0 = (long long) height * k / nbands;
+		bands[k].y1 = (long long) height * (k + 1) / nbands;
+		bands[k].px = px;
+		bands[k].py = py;
+		bands[k].projection = projection;
+		bands[k].top = top;
+		bands[k].above = NULL;
+		bands[k].below = NULL;
+		bands[k].status = STITCH_OK;
+
+		// One row of halo on each side, captured before any band is modified
+		if (bands[k].y0 > 0) {
+			if ((bands[k].above = malloc(width * sizeof(float))) == NULL) {
+				status = STITCH_ERR_MEMORY;
+			} else {
+				memcpy(bands[k].above, grid + (size_t) (bands[k].y0 - 1) * width, width * sizeof(float));
+			}
+		}
+		if (bands[k].y1 < height) {
+			if ((bands[k].below = malloc(width * sizeof(float))) == NULL) {
+				status = STITCH_ERR_MEMORY;
+			} else {
+				memcpy(bands[k].below, grid + (size_t) bands[k].y1 * width, width * sizeof(float));
+			}
+		}
+	}
+
+	for (nstarted = 0; nstarted < nbands && status == STITCH_OK; nstarted++) {
+		if (pthread_create(&threads[nstarted], NULL, relief_band_worker, &bands[nstarted]) != 0) {
+			stitch_log(LOG_ERROR, "Can't start relief thread\n");
+			status = STITCH_ERR_INTERNAL;
+			break;
+		}
+	}
+
+	for (k = 0; k < nbands; k++) {
+		if (k < nstarted) {
+			pthread_join(threads[k], NULL);
+		}
+		if (bands[k].status != STITCH_OK && status == STITCH_OK) {
+			status = bands[k].status;
+		}
+		free(bands[k].above);
+		free(bands[k].below);
+	}
+
+	if (status == STITCH_ERR_MEMORY) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for relief rows\n");
+	}
+	if (status != STITCH_OK) {
+		stitch_fail(status);
+	}
+}
+
+#if GEOTIFF_FOUND
+#ifndef TIFFTAG_GDAL_NODATA
+#	define TIFFTAG_GDAL_NODATA 42113
+#endif
+
+static const TIFFFieldInfo gdal_field_info[] = {
+	{ TIFFTAG_GDAL_NODATA, -1, -1, TIFF_ASCII, FIELD_CUSTOM, 1, 0, "GDALNoDataValue" },
+};
+
+static TIFFExtendProc parent_tag_extender = NULL;
+
+static void gdal_tag_extender(TIFF *tif) {
+	TIFFMergeFieldInfo(tif, gdal_field_info, sizeof(gdal_field_info) / sizeof(gdal_field_info[0]));
+	if (parent_tag_extender != NULL) {
+		parent_tag_extender(tif);
+	}
+}
+
+// Registers the GDAL nodata tag with libtiff; must be called before opening
+// a TIFF that is going to use it
+static void install_gdal_tag_extender() {
+	parent_tag_extender = TIFFSetTagExtender(gdal_tag_extender);
+}
+
+void register_gdal_tags() {
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, install_gdal_tag_extender);
+}
+
+// Georeferences the image in EPSG:3857 or EPSG:4326 using the upper left
+// bound as a tie point, and the pixel scale
+void set_georeference(TIFF *tif, GTIF *gtif, stitch_projection_t projection, double px, double py, double minx, double maxy) {
+	double pixscale[3] = {px, py, 0};
+	double tiepoints[6] = {0, 0, 0, minx, maxy, 0.0};
+	TIFFSetField(tif, TIFFTAG_GEOPIXELSCALE, 3, pixscale);
+	TIFFSetField(tif, TIFFTAG_GEOTIEPOINTS, 6, tiepoints);
+
+	if (projection == PROJECTION_GEOGRAPHIC) {
+		GTIFKeySet(gtif, GTModelTypeGeoKey, TYPE_SHORT, 1, ModelTypeGeographic);
+		GTIFKeySet(gtif, GTRasterTypeGeoKey, TYPE_SHORT, 1, RasterPixelIsArea);
+		GTIFKeySet(gtif, GTCitationGeoKey, TYPE_ASCII, 0, "WGS 84");
+		GTIFKeySet(gtif, GeographicTypeGeoKey, TYPE_SHORT, 1, GCS_WGS_84);
+		GTIFKeySet(gtif, GeogCitationGeoKey, TYPE_ASCII, 0, "WGS 84");
+		GTIFKeySet(gtif, GeogAngularUnitsGeoKey, TYPE_SHORT, 1, Angular_Degree);
+		return;
+	}
+
+	GTIFKeySet(gtif, GTModelTypeGeoKey, TYPE_SHORT, 1, ModelTypeProjected);
+	GTIFKeySet(gtif, GTRasterTypeGeoKey, TYPE_SHORT, 1, RasterPixelIsArea);
+	GTIFKeySet(gtif, GTCitationGeoKey, TYPE_ASCII, 0, "WGS 84 / Pseudo-Mercator");
+	GTIFKeySet(gtif, GeogCitationGeoKey, TYPE_ASCII, 0, "WGS 84");
+	GTIFKeySet(gtif, GeogAngularUnitsGeoKey, TYPE_SHORT, 1, Angular_Degree);
+	GTIFKeySet(gtif, GeogLinearUnitsGeoKey, TYPE_SHORT, 1, Linear_Meter);
+	GTIFKeySet(gtif, ProjectedCSTypeGeoKey, TYPE_SHORT, 1, 3857);
+}
+
+static void release_tiff(void *p) {
+	XTIFFClose(p);
+}
+
+static void release_gtif(void *p) {
+	GTIFFree(p);
+}
+
+// Copies bw x bh pixels of 4 bytes, from rows that start at the block's
+// left edge, into a TIFF_BLOCK_SIZE square block padded with pad
+static void fill_tiff_block(unsigned char *block, unsigned char *const *rows, int bw, int bh, const void *pad) {
+	size_t rowlen = (size_t) TIFF_BLOCK_SIZE * 4;
+	int x, y;
+
+	for (y = 0; y < TIFF_BLOCK_SIZE; y++) {
+		unsigned char *dst = block + y * rowlen;
+		int n = y < bh ? bw : 0;
+
+		if (n > 0) {
+			memcpy(dst, rows[y], (size_t) n * 4);
+		}
+		for (x = n; x < TIFF_BLOCK_SIZE; x++) {
+			memcpy(dst + x * 4, pad, 4);
+		}
+	}
+}
+
+void write_tiff_block(TIFF *tif, int bx, int by, unsigned char *block) {
+	if (TIFFWriteEncodedTile(tif, TIFFComputeTile(tif, bx, by, 0, 0), block, (tmsize_t) TIFF_BLOCK_SIZE * TIFF_BLOCK_SIZE * 4) < 0) {
+		TIFFError("WriteImage", "failure in WriteEncodedTile\n");
+		stitch_fail(STITCH_ERR_IO);
+	}
+}
+
+// Writes 4-byte pixels as TIFF_BLOCK_SIZE square tiles, padded with pad at
+// the right and bottom edges
+void write_tiff_blocks(TIFF *tif, unsigned char *const *rows, int width, int height, const void *pad) {
+	unsigned char *block = malloc((size_t) TIFF_BLOCK_SIZE * TIFF_BLOCK_SIZE * 4);
+	unsigned char *brows[TIFF_BLOCK_SIZE];
+	double band = timer_start();
+	int bx, by, y;
+
+	if (block == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for a TIFF block\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	frame_hold(block, free);
+
+	for (by = 0; by < height; by += TIFF_BLOCK_SIZE) {
+		int bh = height - by < TIFF_BLOCK_SIZE ? height - by : TIFF_BLOCK_SIZE;
+
+		for (bx = 0; bx < width; bx += TIFF_BLOCK_SIZE) {
+			int bw = width - bx < TIFF_BLOCK_SIZE ? width - bx : TIFF_BLOCK_SIZE;
+
+			for (y = 0; y < bh; y++) {
+				brows[y] = rows[by + y] + (size_t) bx * 4;
+			}
+			fill_tiff_block(block, brows, bw, bh, pad);
+			write_tiff_block(tif, bx, by, block);
+		}
+		trace_rows(&band, by + bh - 1, height);
+	}
+	frame_free(block);
+}
+
+// Writes a single-band float32 GeoTIFF with a GDAL nodata tag
+void write_geotiff_float32(const char *outfile, const float *grid, int width, int height, int tiled, stitch_projection_t projection, double px, double py, double minx, double maxy) {
+	char nodata[32];
+	int i;
+
+	register_gdal_tags();
+
+	TIFF *tif = XTIFFOpen(outfile, "w");
+	if (!tif) {
+		stitch_log(LOG_ERROR, "TIF failure (open)\n");
+		stitch_fail(STITCH_ERR_IO);
+	}
+	frame_hold(tif, release_tiff);
+
+	GTIF *gtif = GTIFNew(tif);
+	if (!gtif) {
+		stitch_log(LOG_ERROR, "GTIFF failure (geotiff struct)\n");
+		stitch_fail(STITCH_ERR_IO);
+	}
+	frame_hold(gtif, release_gtif);
+
+	TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, width);
+	TIFFSetField(tif, TIFFTAG_IMAGELENGTH, height);
+	TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+	TIFFSetField(tif, TIFFTAG_PREDICTOR, 3);  //(floating point)
+	TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 32);
+	TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
+	if (tiled) {
+		TIFFSetField(tif, TIFFTAG_TILEWIDTH, TIFF_BLOCK_SIZE);
+		TIFFSetField(tif, TIFFTAG_TILELENGTH, TIFF_BLOCK_SIZE);
+	} else {
+		TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, TIFF_ROWS_PER_STRIP);
+	}
+	TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
+	TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+	TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+
+	snprintf(nodata, sizeof nodata, "%g", ELEVATION_NODATA);
+	TIFFSetField(tif, TIFFTAG_GDAL_NODATA, nodata);
+
+	set_georeference(tif, gtif, projection, px, py, minx, maxy);
+
+	if (tiled) {
+		unsigned char **rows = malloc((height + 1) * sizeof(unsigned char *));
+		float pad = ELEVATION_NODATA;
+
+		if (rows == NULL) {
+			stitch_log(LOG_ERROR, "Can't allocate memory for %d rows\n", height);
+			stitch_fail(STITCH_ERR_MEMORY);
+		}
+		frame_hold(rows, free);
+		for (i = 0; i < height; i++) {
+			rows[i] = (unsigned char *) (grid + (size_t) i * width);
+		}
+		write_tiff_blocks(tif, rows, width, height, &pad);
+		frame_free(rows);
+	} else {
+		double band = timer_start();
+
+		for (i = 0; i < height; i++) {
+			if (!TIFFWriteScanline(tif, (void *) (grid + (size_t) i * width), i, 0)) {
+				TIFFError("WriteImage", "failure in WriteScanline\n");
+				stitch_fail(STITCH_ERR_IO);
+			}
+			trace_rows(&band, i, height);
+		}
+	}
+
+	GTIFWriteKeys(gtif);
+	frame_drop(gtif);
+	GTIFFree(gtif);
+	frame_drop(tif);
+	XTIFFClose(tif);
+}
+#endif /* GEOTIFF_FOUND */
+
+// Returns the elevation encoding of the first preset among the layers
+elevation_encoding_t layers_elevation_encoding(char **layers, int nlayers) {
+	int k;
+
+	for (k = 0; k < nlayers; k++) {
+		const tileset_t *preset = find_preset_by_name(layers[k]);
+		if (preset != NULL && preset->encoding != ELEVATION_DEFAULT) {
+			return preset->encoding;
+		}
+	}
+	return ELEVATION_DEFAULT;
+}
+
+// Points of an elevation query, in struct-of-arrays layout so that the
+// projection runs as flat loops over them
+struct query {
+	int n;
+	int nalloc;
+	double *lat;
+	double *lon;
+	double *distance;  // along the polyline, in meters
+	double *gx;        // global pixel coordinates at the query zoom
+	double *gy;
+	float *corner;     // 4 per point: the pixels around it, row by row
+	float *elevation;
+};
+
+void query_add(struct query *q, double lat, double lon, double distance) {
+	if (q->n >= q->nalloc) {
+		q->nalloc = q->nalloc * 2 + 1024;
+		q->lat = realloc(q->lat, q->nalloc * sizeof(double));
+		q->lon = realloc(q->lon, q->nalloc * sizeof(double));
+		q->distance = realloc(q->distance, q->nalloc * sizeof(double));
+		if (q->lat == NULL || q->lon == NULL || q->distance == NULL) {
+			stitch_log(LOG_ERROR, "Can't allocate memory for %d points\n", q->nalloc);
+			stitch_fail(STITCH_ERR_MEMORY);
+		}
+	}
+
+	q->lat[q->n] = lat;
+	q->lon[q->n] = lon;
+	q->distance[q->n] = distance;
+	q->n++;
+}
+
+void query_free(struct query *q) {
+	free(q->lat);
+	free(q->lon);
+	free(q->distance);
+	free(q->gx);
+	free(q->gy);
+	free(q->corner);
+	free(q->elevation);
+}
+
+// Great circle distance in meters
+double haversine(double lat1, double lon1, double lat2, double lon2) {
+	double dlat = (lat2 - lat1) * M_PI / 180;
+	double dlon = (lon2 - lon1) * M_PI / 180;
+	double a = sin(dlat / 2) * sin(dlat / 2) +
+		cos(lat1 * M_PI / 180) * cos(lat2 * M_PI / 180) * sin(dlon / 2) * sin(dlon / 2);
+	return 2 * 6378137.0 * atan2(sqrt(a), sqrt(1 - a));
+}
+
+// Reads "lat lon" or "lat,lon" lines; blank lines and # comments are skipped.
+// With a positive step the points are polyline vertices, and the line is
+// resampled every step meters along its length.
+void read_query_points(const char *fname, double step, struct query *q) {
+	FILE *fp = strcmp(fname, "-") == 0 ? stdin : fopen(fname, "r");
+	char line[1024];
+	double plat = 0, plon = 0, distance = 0, next = 0;
+	int lineno = 0, vertices = 0;
+
+	if (fp == NULL) {
+		stitch_log(LOG_ERROR, "%s: %s\n", fname, strerror(errno));
+		stitch_fail(STITCH_ERR_IO);
+	}
+
+	while (fgets(line, sizeof line, fp) != NULL) {
+		double lat, lon;
+		char *cp;
+
+		lineno++;
+		for (cp = line; *cp == ' ' || *cp == '\t'; cp++) {
+		}
+		if (*cp == '#' || *cp == '\n' || *cp == '\r' || *cp == '\0') {
+			continue;
+		}
+		for (char *sep = cp; *sep; sep++) {
+			if (*sep == ',') {
+				*sep = ' ';
+			}
+		}
+		if (sscanf(cp, "%lf %lf", &lat, &lon) != 2) {
+			stitch_log(LOG_ERROR, "%s:%d: expected lat lon\n", fname, lineno);
+			stitch_fail(STITCH_ERR_ARGS);
+		}
+		if (!(lat >= -90 && lat <= 90)) {
+			stitch_log(LOG_ERROR, "%s:%d: latitude %g out of range\n", fname, lineno, lat);
+			stitch_fail(STITCH_ERR_ARGS);
+		}
+		if (!isfinite(lon)) {
+			stitch_log(LOG_ERROR, "%s:%d: longitude %g out of range\n", fname, lineno, lon);
+			stitch_fail(STITCH_ERR_ARGS);
+		}
+
+		if (step <= 0) {
+			query_add(q, lat, lon, 0);
+		} else if (vertices == 0) {
+			query_add(q, lat, lon, 0);
+			next = step;
+		} else {
+			double len = haversine(plat, plon, lat, lon);
+
+			while (len > 0 && next <= distance + len) {
+				double t = (next - distance) / len;
+				query_add(q, plat + (lat - plat) * t, plon + (lon - plon) * t, next);
+				next += step;
+			}
+			distance += len;
+		}
+
+		plat = lat;
+		plon = lon;
+		vertices++;
+	}
+
+	// Always end the profile on the last vertex
+	if (step > 0 && vertices > 1 && q->distance[q->n - 1] < distance) {
+		query_add(q, plat, plon, distance);
+	}
+
+	if (fp != stdin) {
+		fclose(fp);
+	}
+}
+
+// Batch version of latlon2tile that gives fractional global pixel
+// coordinates, written as a flat loop over arrays so that it vectorizes
+void latlon2pixels(const double *lat, const double *lon, int n, int zoom, int tilesize, double *gx, double *gy) {
+	double scale = (double) tilesize * (1ULL << zoom);
+	int k;
+
+	for (k = 0; k < n; k++) {
+		double lat_rad = lat[k] * M_PI / 180;
+		gx[k] = scale * ((lon[k] + 180) / 360);
+		gy[k] = scale * (1 - (log(tan(lat_rad) + 1 / cos(lat_rad)) / M_PI)) / 2;
+	}
+}
+
+struct query_sample {
+	unsigned long long tile;  // ty << 32 | tx
+	int corner;               // index into query.corner
+	unsigned short x, y;      // pixel within the tile
+};
+
+int compare_query_samples(const void *a, const void *b) {
+	const struct query_sample *sa = a, *sb = b;
+
+	if (sa->tile != sb->tile) {
+		return sa->tile < sb->tile ? -1 : 1;
+	}
+	return sa->corner - sb->corner;
+}
+
+// Samples the elevation at every query point by bilinear interpolation
+// between the four pixel centers around it. The pixels are grouped by tile
+// so that each tile is fetched and decoded exactly once, and the tiles are
+// prefetched up front with parallel transfers at a time.
+void sample_query(struct query *q, int zoom, const char **layers, int nlayers, const struct elevation_decoder *decoder, int tilesize, int parallel) {
+	long long world = (long long) tilesize << zoom;
+	struct query_sample *samples = malloc(4 * (size_t) q->n * sizeof(struct query_sample));
+	float *tile = malloc((size_t) tilesize * tilesize * sizeof(float));
+	int k, c, l;
+
+	q->gx = malloc(q->n * sizeof(double));
+	q->gy = malloc(q->n * sizeof(double));
+	q->corner = malloc(4 * (size_t) q->n * sizeof(float));
+	q->elevation = malloc(q->n * sizeof(float));
+	if (samples == NULL || tile == NULL || q->gx == NULL || q->gy == NULL || q->corner == NULL || q->elevation == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for %d points\n", q->n);
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+
+	latlon2pixels(q->lat, q->lon, q->n, zoom, tilesize, q->gx, q->gy);
+
+	for (k = 0; k < q->n; k++) {
+		long long x0 = floor(q->gx[k] - 0.5);
+		long long y0 = floor(q->gy[k] - 0.5);
+
+		for (c = 0; c < 4; c++) {
+			long long px = x0 + (c & 1);
+			long long py = y0 + (c >> 1);
+
+			// Wrap around the antimeridian, clamp at the poles
+			px = ((px % world) + world) % world;
+			py = py < 0 ? 0 : py >= world ? world - 1 : py;
+
+			struct query_sample *sm = &samples[k * 4 + c];
+			sm->tile = (unsigned long long) (py / tilesize) << 32 | (px / tilesize);
+			sm->corner = k * 4 + c;
+			sm->x = px % tilesize;
+			sm->y = py % tilesize;
+			q->corner[k * 4 + c] = ELEVATION_NODATA;
+		}
+	}
+
+	qsort(samples, 4 * (size_t) q->n, sizeof(struct query_sample), compare_query_samples);
+
+	struct url_template *templates[nlayers];
+	for (l = 0; l < nlayers; l++) {
+		templates[l] = url_compile(layer_url(layers[l]));
+	}
+
+	size_t first, last, total = 4 * (size_t) q->n;
+	struct tile_cache *cache = tile_cache_new(65537);
+	frame_hold(cache, release_tile_cache);
+	for (first = 0; first < total; first = last) {
+		for (last = first; last < total && samples[last].tile == samples[first].tile; last++) {
+		}
+		for (l = 0; l < nlayers; l++) {
+			tile_cache_plan(cache, templates[l]->url, zoom, samples[first].tile & 0xFFFFFFFF, samples[first].tile >> 32);
+		}
+	}
+	tile_cache_prefetch(cache, parallel * 4);
+
+	int ntiles = 0;
+	for (first = 0; first < total; first = last) {
+		unsigned int tx = samples[first].tile & 0xFFFFFFFF;
+		unsigned int ty = samples[first].tile >> 32;
+
+		for (last = first; last < total && samples[last].tile == samples[first].tile; last++) {
+		}
+		ntiles++;
+
+		for (l = 0; l < nlayers; l++) {
+			struct image *i = fetch_tile(cache, templates[l], zoom, tx, ty);
+			int y;
+
+			if (i == NULL) {
+				continue;
+			}
+			if (i->height != tilesize || i->width != tilesize) {
+				stitch_log(LOG_ERROR, "Got %dx%d tile, not %d\n", i->width, i->height, tilesize);
+				stitch_fail(STITCH_ERR_DECODE);
+			}
+
+			for (k = 0; k < tilesize * tilesize; k++) {
+				tile[k] = ELEVATION_NODATA;
+			}
+			for (y = 0; y < tilesize; y++) {
+				decode_elevation_row(decoder, i->buf + (size_t) y * tilesize * i->depth, i->depth, tile + (size_t) y * tilesize, tilesize);
+			}
+			free_image(i);
+
+			// Later layers override earlier ones where they have data
+			for (const struct query_sample *sm = samples + first; sm < samples + last; sm++) {
+				float e = tile[sm->y * tilesize + sm->x];
+				if (e != ELEVATION_NODATA) {
+					q->corner[sm->corner] = e;
+				}
+			}
+		}
+	}
+
+	tile_cache_free(cache);
+	stitch_log(LOG_INFO, "==Sampled %d points from %d tiles\n", q->n, ntiles);
+	for (l = 0; l < nlayers; l++) {
+		url_template_free(templates[l]);
+	}
+
+	for (k = 0; k < q->n; k++) {
+		double fx = q->gx[k] - 0.5 - floor(q->gx[k] - 0.5);
+		double fy = q->gy[k] - 0.5 - floor(q->gy[k] - 0.5);
+		double w[4] = { (1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy };
+		double sum = 0, wsum = 0;
+
+		// Corners without data drop out and the others are reweighted
+		for (c = 0; c < 4; c++) {
+			if (q->corner[k * 4 + c] != ELEVATION_NODATA) {
+				sum += w[c] * q->corner[k * 4 + c];
+				wsum += w[c];
+			}
+		}
+		q->elevation[k] = wsum > 0 ? sum / wsum : ELEVATION_NODATA;
+	}
+
+	free(samples);
+	free(tile);
+}
+
+void write_query(const struct query *q, int outfmt, const char *outfile, int polyline) {
+	FILE *outfp = stdout;
+	int k;
+
+	if (outfmt == OUTFMT_BINARY && outfile == NULL && isatty(1)) {
+		stitch_log(LOG_ERROR, "Didn't specify -o and standard output is a terminal\n");
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+	if (outfile != NULL) {
+		outfp = fopen(outfile, outfmt == OUTFMT_BINARY ? "wb" : "w");
+		if (outfp == NULL) {
+			stitch_log(LOG_ERROR, "%s: %s\n", outfile, strerror(errno));
+			stitch_fail(STITCH_ERR_IO);
+		}
+	}
+
+	if (outfmt == OUTFMT_BINARY) {
+		for (k = 0; k < q->n; k++) {
+			double rec[4] = { q->lat[k], q->lon[k], q->distance[k], q->elevation[k] };
+			fwrite(rec, sizeof(rec), 1, outfp);
+		}
+	} else {
+		fprintf(outfp, polyline ? "distance,lat,lon,elevation\n" : "lat,lon,elevation\n");
+		for (k = 0; k < q->n; k++) {
+			if (polyline) {
+				fprintf(outfp, "%.1f,", q->distance[k]);
+			}
+			fprintf(outfp, "%.7f,%.7f,", q->lat[k], q->lon[k]);
+			if (q->elevation[k] != ELEVATION_NODATA) {
+				fprintf(outfp, "%.2f", q->elevation[k]);
+			}
+			fprintf(outfp, "\n");
+		}
+	}
+
+	if (ferror(outfp)) {
+		stitch_log(LOG_ERROR, "Failed to write query results\n");
+		stitch_fail(STITCH_ERR_IO);
+	}
+	if (outfile != NULL) {
+		fclose(outfp);
+	}
+}
+
+// Point and polyline elevation query mode
+void run_query(const char *queryfile, double step, int zoom, const char **layers, int nlayers, const struct elevation_decoder *decoder, int tilesize, int outfmt, const char *outfile, int parallel) {
+	struct query q = { 0 };
+	int l;
+
+	for (l = 0; l < nlayers; l++) {
+		if (layer_getmap(layer_url(layers[l])) || layer_raster(layer_url(layers[l]))) {
+			stitch_log(LOG_ERROR, "Can't query points of a WMS or raster layer\n");
+			stitch_fail(STITCH_ERR_ARGS);
+		}
+	}
+	if (zoom < 0 || zoom > 24) {
+		stitch_log(LOG_ERROR, "Zoom %d out of range\n", zoom);
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+	if (outfmt != OUTFMT_CSV && outfmt != OUTFMT_BINARY) {
+		outfmt = OUTFMT_CSV;
+	}
+
+	read_query_points(queryfile, step, &q);
+	if (q.n > 0) {
+		sample_query(&q, zoom, layers, nlayers, decoder, tilesize, parallel);
+	}
+	write_query(&q, outfmt, outfile, step > 0);
+	query_free(&q);
+}
+
+// Polygon rings in longitude and latitude, outer rings and holes alike
+struct polygon {
+	double *lon, *lat;
+	int n, nalloc;
+	int *rings;          // start of each ring, then the end of the last
+	int nrings;
+};
+
+void polygon_add(struct polygon *poly, double lon, double lat) {
+	if (poly->n >= poly->nalloc) {
+		poly->nalloc = poly->nalloc * 2 + 64;
+		poly->lon = realloc(poly->lon, poly->nalloc * sizeof(double));
+		poly->lat = realloc(poly->lat, poly->nalloc * sizeof(double));
+		if (poly->lon == NULL || poly->lat == NULL) {
+			stitch_log(LOG_ERROR, "Can't allocate memory for %d vertices\n", poly->nalloc);
+			stitch_fail(STITCH_ERR_MEMORY);
+		}
+	}
+	poly->lon[poly->n] = lon;
+	poly->lat[poly->n] = lat;
+	poly->n++;
+}
+
+// Ends the ring of the vertices added since the last one, dropping it if it
+// can't enclose anything
+void polygon_close_ring(struct polygon *poly) {
+	int start = poly->nrings > 0 ? poly->rings[poly->nrings] : 0;
+
+	if (poly->n - start < 3) {
+		poly->n = start;
+		return;
+	}
+
+	poly->rings = realloc(poly->rings, (poly->nrings + 2) * sizeof(int));
+	if (poly->rings == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for %d rings\n", poly->nrings + 1);
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	poly->rings[0] = 0;
+	poly->rings[++poly->nrings] = poly->n;
+}
+
+void polygon_bounds(const struct polygon *poly, double *minlat, double *minlon, double *maxlat, double *maxlon) {
+	int k;
+
+	*minlat = *maxlat = poly->lat[0];
+	*minlon = *maxlon = poly->lon[0];
+	for (k = 1; k < poly->n; k++) {
+		*minlat = fmin(*minlat, poly->lat[k]);
+		*maxlat = fmax(*maxlat, poly->lat[k]);
+		*minlon = fmin(*minlon, poly->lon[k]);
+		*maxlon = fmax(*maxlon, poly->lon[k]);
+	}
+}
+
+void polygon_free(struct polygon *poly) {
+	if (poly != NULL) {
+		free(poly->lon);
+		free(poly->lat);
+		free(poly->rings);
+		free(poly);
+	}
+}
+
+// Everything that describes one stitched output
+struct job {
+	double minlat, minlon, maxlat, maxlon;
+	int centered;        // minlat/minlon is the center of a width x height image
+	int width, height;
+	int zoom;
+	const char **layers;
+	int nlayers;
+	const char *outfile;
+	int outfmt;
+	int tilesize;
+	int elevation;
+	elevation_encoding_t encoding;
+	relief_t relief;
+	int writeworldfile;
+	int outwidth, outheight;  // requested output size in pixels, 0 if not set
+	double resolution;        // requested output pixel size in meters, 0 if not set
+	resample_filter_t filter;
+	stitch_projection_t projection;
+	const struct polygon *mask;  // area of interest, NULL for the whole box
+	int overzoom;                // zoom levels to look up for missing tiles
+	int shard, nshards;          // stripe of the output to render, if nshards > 0
+	const char *journal;         // checkpoint file to resume from, if any
+	const char *update;          // validators of the tiles in the output, to update it
+	int minzoom;                 // coarsest zoom to write too, reduced from zoom; -1 for none
+	int getmap;                  // largest window to ask WMS layers for, in pixels
+	const char *results;         // directory of earlier outputs to reuse, if any
+	int revalidate;              // ask for the tiles of a cached output again first
+	struct tile_cache *cache;
+};
+
+// Geometry of a job: its bounds, the tiles it covers and its raster size
+struct plan {
+	double minlat, minlon, maxlat, maxlon;
+	double minx, miny, maxx, maxy;
+	unsigned int x1, y1, x2, y2;  // corners in 32-bit tile coordinates
+	int zoom;
+	int tilesize;               // of the tiles fetched, 512 for retina tiles
+	int retina;
+	const char **urls;          // of the layers, with {r} filled in
+	struct url_template **templates;  // compiled from them, NULL for WMS and raster layers
+	unsigned int tx1, ty1, tx2, ty2;
+	unsigned int xa, ya;
+	int src_width, src_height;  // size of the area in tile pixels at zoom
+	int width, height;          // size of the output, which differs when resampling
+	int resample;
+	stitch_projection_t projection;
+	double left, top;           // upper left corner in the output projection
+	double px, py;              // and the pixel size
+	int row0, full_height;      // where a shard's rows are in the whole output
+};
+
+// Pixel coordinate at zoom of a 32-bit tile coordinate
+static unsigned long long tile_pixel(unsigned int x, int zoom, int tilesize) {
+	return ((unsigned long long) x * tilesize) >> (32 - zoom);
+}
+
+// Sets the tiles covering the plan's corners at zoom, and where the area
+// starts within the first one
+void plan_window(struct plan *pl, int zoom, int tilesize) {
+	pl->zoom = zoom;
+	pl->tilesize = tilesize;
+	pl->tx1 = (unsigned long long) pl->x1 >> (32 - zoom);
+	pl->ty1 = (unsigned long long) pl->y1 >> (32 - zoom);
+	pl->tx2 = (unsigned long long) pl->x2 >> (32 - zoom);
+	pl->ty2 = (unsigned long long) pl->y2 >> (32 - zoom);
+	pl->xa = tile_pixel(pl->x1, zoom, tilesize) - (unsigned long long) pl->tx1 * tilesize;
+	pl->ya = tile_pixel(pl->y1, zoom, tilesize) - (unsigned long long) pl->ty1 * tilesize;
+	pl->src_width = tile_pixel(pl->x2, zoom, tilesize) - tile_pixel(pl->x1, zoom, tilesize);
+	pl->src_height = tile_pixel(pl->y2, zoom, tilesize) - tile_pixel(pl->y1, zoom, tilesize);
+}
+
+// A layer declares that it has 512 pixel retina tiles with an {r} token,
+// which is "@2x" for them and empty otherwise
+int layers_retina(const char **layers, int nlayers) {
+	int l;
+
+	for (l = 0; l < nlayers; l++) {
+		if (strstr(layer_url(layers[l]), "{r}") == NULL) {
+			return 0;
+		}
+	}
+	return nlayers > 0;
+}
+
+static char *retina_url(const char *url, int retina) {
+	const char *r = strstr(url, "{r}");
+	char *out = malloc(strlen(url) + 4);
+
+	if (out == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for %s\n", url);
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	if (r == NULL) {
+		strcpy(out, url);
+	} else {
+		sprintf(out, "%.*s%s%s", (int) (r - url), url, retina ? "@2x" : "", r + 3);
+	}
+	return out;
+}
+
+void plan_free(struct plan *pl) {
+	int l;
+
+	frame_drop(pl);
+	for (l = 0; pl->urls != NULL && pl->urls[l] != NULL; l++) {
+		free((char *) pl->urls[l]);
+		url_template_free(pl->templates[l]);
+	}
+	free(pl->urls);
+	free(pl->templates);
+	pl->urls = NULL;
+	pl->templates = NULL;
+}
+
+static void release_plan(void *p) {
+	plan_free(p);
+}
+
+// Sizes the output from the requested width, height or resolution, in the
+// units of the output projection, and picks the smallest zoom, no deeper than
+// the job's, whose tiles have at least as many pixels as the output in both
+// directions. The tile window is then recomputed at that zoom. Geographic
+// output without a requested size keeps the width of the mosaic at the
+// job's zoom, with square pixels in degrees.
+void plan_output_size(const struct job *job, struct plan *pl) {
+	static const double world = 2 * 20037508.342789244;
+	int geographic = pl->projection == PROJECTION_GEOGRAPHIC;
+	double spanx = geographic ? pl->maxlon - pl->minlon : pl->maxx - pl->minx;
+	double spany = geographic ? pl->maxlat - pl->minlat : fabs(pl->maxy - pl->miny);
+	int width = job->outwidth, height = job->outheight;
+	int zoom;
+
+	if (width <= 0 && height <= 0 && job->resolution <= 0) {
+		width = pl->src_width;
+	}
+
+	if (job->resolution > 0) {
+		width = ceil(spanx / job->resolution);
+		height = ceil(spany / job->resolution);
+	} else if (width <= 0) {
+		width = round(height * spanx / spany);
+	} else if (height <= 0) {
+		height = round(width * spany / spanx);
+	}
+
+	if (width <= 0 || height <= 0) {
+		stitch_log(LOG_ERROR, "Output size %dx%d is empty\n", width, height);
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+
+	// Finest output pixel, in Mercator meters
+	double finest = fmin(spanx / width, spany / height);
+	if (geographic) {
+		double nearest = pl->minlat > 0 ? pl->minlat : pl->maxlat < 0 ? pl->maxlat : 0;
+		finest = fmin(spanx / width, spany / height / cos(nearest * M_PI / 180)) * world / 360;
+	}
+
+	for (zoom = 0; zoom < job->zoom; zoom++) {
+		if (world / ((double) job->tilesize * (1LL << zoom)) <= finest) {
+			break;
+		}
+	}
+
+	plan_window(pl, zoom, job->tilesize);
+
+	if (pl->src_width <= 0 || pl->src_height <= 0) {
+		stitch_log(LOG_ERROR, "Area is empty at zoom %d\n", zoom);
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+
+	pl->width = width;
+	pl->height = height;
+	pl->resample = 1;
+}
+
+// Output row where shard k of n starts: shards are runs of whole tile rows,
+// with the boundaries moved up to a TIFF strip so that the shard files can
+// be spliced together strip by strip
+static int shard_row(const struct plan *pl, int k, int n) {
+	int ntiles = pl->ty2 - pl->ty1 + 1;
+	long long row;
+
+	if (k == 0) {
+		return 0;
+	}
+	if (k == n) {
+		return pl->height;
+	}
+	row = (long long) (ntiles * (long long) k / n) * pl->tilesize - pl->ya;
+	row -= row % TIFF_ROWS_PER_STRIP;
+	return row < 0 ? 0 : row > pl->height ? pl->height : row;
+}
+
+// Narrows the plan to the job's shard of the output, which keeps its place
+// in the georeference of the whole
+void plan_shard(const struct job *job, struct plan *pl) {
+	int row0 = shard_row(pl, job->shard, job->nshards);
+	int row1 = shard_row(pl, job->shard + 1, job->nshards);
+
+	if (pl->resample || job->relief != RELIEF_NONE || job->elevation) {
+		stitch_log(LOG_ERROR, "Sharding needs output at the native resolution, without relief or -e\n");
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+	if (row1 <= row0) {
+		stitch_log(LOG_ERROR, "Shard %d/%d is empty\n", job->shard, job->nshards);
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+
+	pl->row0 = row0;
+	pl->ty2 = pl->ty1 + (row1 - 1 + pl->ya) / pl->tilesize;
+	pl->ty1 = pl->ty1 + (row0 + pl->ya) / pl->tilesize;
+	pl->ya = (row0 + pl->ya) % pl->tilesize;
+	pl->height = pl->src_height = row1 - row0;
+
+	pl->top -= row0 * pl->py;
+	pl->maxy = pl->top;
+	pl->miny = pl->top - pl->height * pl->py;
+	pl->maxlat = atan(sinh(pl->maxy / 6378137.0)) * 180 / M_PI;
+	pl->minlat = atan(sinh(pl->miny / 6378137.0)) * 180 / M_PI;
+}
+
+void plan_job(const struct job *job, struct plan *pl) {
+	int zoom = job->zoom;
+	double dummy;
+	int l;
+
+	if (zoom < 0) {
+		stitch_log(LOG_ERROR, "Zoom %u less than 0\n", zoom);
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+
+	pl->minlat = job->minlat;
+	pl->minlon = job->minlon;
+	pl->maxlat = job->maxlat;
+	pl->maxlon = job->maxlon;
+
+	if (pl->minlat > pl->maxlat) {
+		dummy = pl->minlat;
+		pl->minlat = pl->maxlat;
+		pl->maxlat = dummy;
+	}
+
+	if (pl->minlon > pl->maxlon) {
+		dummy = pl->minlon;
+		pl->minlon = pl->maxlon;
+		pl->maxlon = dummy;
+	}
+
+	unsigned int x1, y1, x2, y2;
+
+	if (job->centered) {
+		latlon2tile(job->minlat, job->minlon, 32, &x1, &y1);
+		latlon2tile(job->minlat, job->minlon, 32, &x2, &y2);
+
+		int width = job->width;
+		int height = job->height;
+
+		if (width <= 0 || height <= 0) {
+			stitch_log(LOG_ERROR, "Width/height less than 0: %u %u\n", width, height);
+			stitch_fail(STITCH_ERR_ARGS);
+		}
+
+		x1 = x1 - (width << (32 - (zoom + 8))) / 2;
+		y1 = y1 - (height << (32 - (zoom + 8))) / 2;
+		x2 = x2 + (width << (32 - (zoom + 8))) / 2;
+		y2 = y2 + (height << (32 - (zoom + 8))) / 2;
+
+		tile2latlon(x1, y1, 32, &pl->maxlat, &pl->minlon);
+		tile2latlon(x2, y2, 32, &pl->minlat, &pl->maxlon);
+	} else {
+		latlon2tile(pl->maxlat, pl->minlon, 32, &x1, &y1);
+		latlon2tile(pl->minlat, pl->maxlon, 32, &x2, &y2);
+	}
+
+	pl->x1 = x1;
+	pl->y1 = y1;
+	pl->x2 = x2;
+	pl->y2 = y2;
+
+	projectlatlon(pl->minlat, pl->minlon, &pl->minx, &pl->miny);
+	projectlatlon(pl->maxlat, pl->maxlon, &pl->maxx, &pl->maxy);
+
+	plan_window(pl, zoom, job->tilesize);
+	pl->width = pl->src_width;
+	pl->height = pl->src_height;
+	pl->resample = 0;
+
+	pl->projection = job->projection;
+
+	if (job->outwidth > 0 || job->outheight > 0 || job->resolution > 0 || job->projection != PROJECTION_SPHERICAL_MERCATOR) {
+		plan_output_size(job, pl);
+	}
+
+	// Retina tiles one zoom up cover the same ground at the same resolution
+	// with a quarter of the requests
+	pl->retina = job->tilesize == 256 && pl->zoom > 0 && layers_retina(job->layers, job->nlayers);
+	if (pl->retina) {
+		plan_window(pl, pl->zoom - 1, 512);
+	}
+
+	pl->urls = malloc((job->nlayers + 1) * sizeof(char *));
+	pl->templates = malloc(job->nlayers * sizeof(struct url_template *));
+	if (pl->urls == NULL || pl->templates == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for %d layers\n", job->nlayers);
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	for (l = 0; l < job->nlayers; l++) {
+		pl->urls[l] = retina_url(layer_url(job->layers[l]), pl->retina);
+		pl->templates[l] = layer_getmap(pl->urls[l]) || layer_raster(pl->urls[l]) ? NULL : url_compile(pl->urls[l]);
+	}
+	pl->urls[job->nlayers] = NULL;
+
+	if (pl->projection == PROJECTION_GEOGRAPHIC) {
+		pl->left = pl->minlon;
+		pl->top = pl->maxlat;
+		pl->px = (pl->maxlon - pl->minlon) / pl->width;
+		pl->py = (pl->maxlat - pl->minlat) / pl->height;
+	} else {
+		pl->left = pl->minx;
+		pl->top = pl->maxy;
+		pl->px = (pl->maxx - pl->minx) / pl->width;
+		pl->py = (fabs(pl->maxy - pl->miny)) / pl->height;
+	}
+
+	pl->row0 = 0;
+	pl->full_height = pl->height;
+	if (job->nshards > 0) {
+		plan_shard(job, pl);
+	}
+}
+
+// Whether the job decodes straight into a float32 grid of elevations and
+// never allocates the RGBA canvas: for elevation output, and for -e when
+// resampling, since filtering the encoded bytes of elevation tiles channel
+// by channel would mix their high and low bytes
+int job_grid(const struct job *job, const struct plan *pl) {
+	return job->outfmt == OUTFMT_GEOTIFF_FLOAT32 || job->relief != RELIEF_NONE || (job->elevation && pl->resample);
+}
+
+// Checkpoint journal of a job. The canvas lives in a file mapped into memory,
+// and the journal lists the tiles composited into it. A tile is only listed
+// once the canvas has been synced to disk after it, so that a rerun of the
+// same job after a crash can skip the listed tiles and keep their pixels.
+#define JOURNAL_CHECKPOINT_TILES 64
+
+struct journal {
+	char *path, *canvas_path;
+	FILE *fp;
+	void *canvas;
+	size_t size;
+	unsigned char *done;        // by tile, row by row from ty1 and tx1
+	int ntx, ntiles, ndone;
+	unsigned int *pending;      // composited since the last checkpoint
+	int npending;
+};
+
+// Identifies the output of a job: its tile window, raster and layers
+static void plan_signature(const char *kind, const struct plan *pl, int grid, char *out, size_t len) {
+	unsigned long h = 5381;
+	const char *cp;
+	int l;
+
+	for (l = 0; pl->urls[l] != NULL; l++) {
+		for (cp = pl->urls[l]; *cp; cp++) {
+			h = h * 33 + (unsigned char) *cp;
+		}
+		h = h * 33 + '\n';
+	}
+	snprintf(out, len, "%s 1 %d %u %u %u %u %u %u %d %d %d %s %lx\n", kind, pl->zoom, pl->tx1, pl->ty1, pl->tx2, pl->ty2,
+		pl->xa, pl->ya, pl->width, pl->height, pl->tilesize, grid ? "float32" : "rgba", h & 0xFFFFFFFFUL);
+}
+
+// Marks the tiles a journal lists in done, by tile row by row from ty1 and
+// tx1. Returns how many there are, or -1 if it is the journal of another job.
+static int journal_read(FILE *fp, const char *header, const struct plan *pl, unsigned char *done) {
+	int ntx = pl->tx2 - pl->tx1 + 1, ndone = 0;
+	unsigned int tx, ty;
+	char line[512];
+
+	if (fgets(line, sizeof line, fp) == NULL || strcmp(line, header) != 0) {
+		return -1;
+	}
+	while (fgets(line, sizeof line, fp) != NULL) {
+		// A line cut short by a crash has no newline and is ignored
+		if (strchr(line, '\n') != NULL && sscanf(line, "%u %u", &tx, &ty) == 2 &&
+		    tx >= pl->tx1 && tx <= pl->tx2 && ty >= pl->ty1 && ty <= pl->ty2) {
+			int k = (ty - pl->ty1) * ntx + (tx - pl->tx1);
+			ndone += !done[k];
+			done[k] = 1;
+		}
+	}
+	return ndone;
+}
+
+// The tiles the journal of a job already has, for a batch to plan only the
+// others, or NULL if there is no journal of this job yet
+unsigned char *journal_peek(const struct job *job, const struct plan *pl, int grid) {
+	FILE *fp = fopen(job->journal, "r");
+	char header[512];
+
+	if (fp == NULL) {
+		return NULL;
+	}
+	unsigned char *done = calloc((size_t) (pl->tx2 - pl->tx1 + 1) * (pl->ty2 - pl->ty1 + 1), 1);
+	if (done == NULL) {
+		fclose(fp);
+		stitch_log(LOG_ERROR, "Can't allocate memory for the journal\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	plan_signature("stitch-journal", pl, grid, header, sizeof header);
+	if (journal_read(fp, header, pl, done) < 0) {
+		free(done);
+		done = NULL;
+	}
+	fclose(fp);
+	return done;
+}
+
+static void journal_abandon(struct journal *jr) {
+	free(jr->path);
+	free(jr->canvas_path);
+	free(jr->done);
+	free(jr->pending);
+	free(jr);
+}
+
+// Opens the journal of the job, resuming from it if it is there, and maps
+// its canvas of size bytes. Returns with ndone set to the tiles it already
+// has; the canvas is zeroed if it is new.
+struct journal *journal_open(const struct job *job, const struct plan *pl, int grid, size_t size) {
+	struct journal *jr = calloc(1, sizeof(struct journal));
+	char header[512];
+	struct stat st;
+	int fd, created = 0;
+
+	if (jr == NULL || (jr->path = strdup(job->journal)) == NULL || (jr->canvas_path = malloc(strlen(job->journal) + 8)) == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for the journal\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	sprintf(jr->canvas_path, "%s.canvas", job->journal);
+
+	jr->ntx = pl->tx2 - pl->tx1 + 1;
+	jr->ntiles = jr->ntx * (pl->ty2 - pl->ty1 + 1);
+	jr->size = size;
+	jr->done = calloc(jr->ntiles, 1);
+	jr->pending = malloc(JOURNAL_CHECKPOINT_TILES * 2 * sizeof(unsigned int));
+	if (jr->done == NULL || jr->pending == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for the journal\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+
+	plan_signature("stitch-journal", pl, grid, header, sizeof header);
+
+	jr->fp = fopen(jr->path, "r");
+	if (jr->fp != NULL) {
+		jr->ndone = journal_read(jr->fp, header, pl, jr->done);
+		fclose(jr->fp);
+		jr->fp = NULL;
+
+		if (jr->ndone < 0) {
+			stitch_log(LOG_ERROR, "%s: journal of a different job; remove it to start over\n", jr->path);
+			journal_abandon(jr);
+			stitch_fail(STITCH_ERR_ARGS);
+		}
+		if (stat(jr->canvas_path, &st) != 0 || (size_t) st.st_size != size) {
+			stitch_log(LOG_ERROR, "%s: canvas is missing or the wrong size; remove the journal to start over\n", jr->canvas_path);
+			journal_abandon(jr);
+			stitch_fail(STITCH_ERR_IO);
+		}
+		jr->fp = fopen(jr->path, "a");
+	} else {
+		jr->fp = fopen(jr->path, "w");
+		if (jr->fp != NULL) {
+			fputs(header, jr->fp);
+			fflush(jr->fp);
+			created = 1;
+		}
+		unlink(jr->canvas_path);
+	}
+	if (jr->fp == NULL) {
+		stitch_log(LOG_ERROR, "%s: %s\n", jr->path, strerror(errno));
+		journal_abandon(jr);
+		stitch_fail(STITCH_ERR_IO);
+	}
+
+	// A journal this run started is removed again if its canvas can't be
+	// made, so that a rerun doesn't find a journal without one
+	fd = open(jr->canvas_path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0 || ftruncate(fd, size) != 0 ||
+	    (jr->canvas = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		stitch_log(LOG_ERROR, "%s: %s\n", jr->canvas_path, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		fclose(jr->fp);
+		if (created) {
+			unlink(jr->path);
+			unlink(jr->canvas_path);
+		}
+		journal_abandon(jr);
+		stitch_fail(STITCH_ERR_IO);
+	}
+	close(fd);
+
+	return jr;
+}
+
+int journal_done(const struct journal *jr, const struct plan *pl, unsigned int tx, unsigned int ty) {
+	return jr->done[(ty - pl->ty1) * jr->ntx + (tx - pl->tx1)];
+}
+
+// Syncs the canvas, then lists the tiles composited since the last time
+void journal_checkpoint(struct journal *jr) {
+	int k;
+
+	if (jr->npending == 0) {
+		return;
+	}
+	if (msync(jr->canvas, jr->size, MS_SYNC) != 0) {
+		stitch_log(LOG_ERROR, "%s: %s\n", jr->canvas_path, strerror(errno));
+		stitch_fail(STITCH_ERR_IO);
+	}
+	for (k = 0; k < jr->npending; k++) {
+		fprintf(jr->fp, "%u %u\n", jr->pending[2 * k], jr->pending[2 * k + 1]);
+	}
+	if (fflush(jr->fp) != 0 || fsync(fileno(jr->fp)) != 0) {
+		stitch_log(LOG_ERROR, "%s: %s\n", jr->path, strerror(errno));
+		stitch_fail(STITCH_ERR_IO);
+	}
+	jr->npending = 0;
+}
+
+void journal_add(struct journal *jr, unsigned int tx, unsigned int ty) {
+	jr->pending[2 * jr->npending] = tx;
+	jr->pending[2 * jr->npending + 1] = ty;
+	if (++jr->npending == JOURNAL_CHECKPOINT_TILES) {
+		journal_checkpoint(jr);
+	}
+}
+
+// Clears the rectangle of a tile on a resumed canvas, which may still hold
+// what was composited into it after the last checkpoint
+void journal_clear(struct journal *jr, int grid, int width, int height, int tilesize, int xoff, int yoff) {
+	int x0 = xoff < 0 ? 0 : xoff;
+	int y0 = yoff < 0 ? 0 : yoff;
+	int x1 = xoff + tilesize < width ? xoff + tilesize : width;
+	int y1 = yoff + tilesize < height ? yoff + tilesize : height;
+	int x, y;
+
+	if (jr->ndone == 0 || x1 <= x0) {
+		return;
+	}
+	for (y = y0; y < y1; y++) {
+		if (grid) {
+			float *row = (float *) jr->canvas + (size_t) y * width;
+			for (x = x0; x < x1; x++) {
+				row[x] = ELEVATION_NODATA;
+			}
+		} else {
+			memset((unsigned char *) jr->canvas + ((size_t) y * width + x0) * 4, '\0', (size_t) (x1 - x0) * 4);
+		}
+	}
+}
+
+// Lets go of the journal, leaving it and its canvas for a rerun
+static void journal_close(struct journal *jr) {
+	frame_drop(jr);
+	munmap(jr->canvas, jr->size);
+	fclose(jr->fp);
+	journal_abandon(jr);
+}
+
+static void release_journal(void *p) {
+	journal_close(p);
+}
+
+// Removes the journal and its canvas once the output is written
+void journal_finish(struct journal *jr) {
+	unlink(jr->canvas_path);
+	unlink(jr->path);
+	journal_close(jr);
+}
+
+// Composites a tile over the RGBA canvas at the given offset
+void blit_rgba(unsigned char *buf, int width, int height, struct image *i, int xoff, int yoff) {
+	unsigned long long int offset, ioffset;
+	int x, y;
+	double start = timer_start();
+
+	for (y = 0; y < i->height; y++) {
+		for (x = 0; x < i->width; x++) {
+			int xd = x + xoff;
+			int yd = y + yoff;
+
+			if (xd < 0 || yd < 0 || xd >= width || yd >= height) {
+				continue;
+			}
+
+			offset = ((unsigned long long) (y + yoff) * width + x + xoff) * 4;
+			ioffset = ((unsigned long long) y * i->width + x) * i->depth;
+
+			if (i->depth == 4) {
+				/* RGBA image */
+				double as = buf[offset + 3] / 255.0;
+				double rs = buf[offset + 0] / 255.0 * as;
+				double gs = buf[offset + 1] / 255.0 * as;
+				double bs = buf[offset + 2] / 255.0 * as;
+
+				double ad = i->buf[ioffset + 3] / 255.0;
+				double rd = i->buf[ioffset + 0] / 255.0 * ad;
+				double gd = i->buf[ioffset + 1] / 255.0 * ad;
+				double bd = i->buf[ioffset + 2] / 255.0 * ad;
+
+				// https://code.google.com/p/pulpcore/wiki/TutorialBlendModes
+				double ar = as * (1 - ad) + ad;
+				double rr = rs * (1 - ad) + rd;
+				double gr = gs * (1 - ad) + gd;
+				double br = bs * (1 - ad) + bd;
+
+				buf[offset + 3] = ar * 255.0;
+				buf[offset + 0] = rr / ar * 255.0;
+				buf[offset + 1] = gr / ar * 255.0;
+				buf[offset + 2] = br / ar * 255.0;
+			} else if (i->depth == 3) {
+				buf[offset + 0] = i->buf[ioffset + 0];
+				buf[offset + 1] = i->buf[ioffset + 1];
+				buf[offset + 2] = i->buf[ioffset + 2];
+				buf[offset + 3] = 255;
+			} else {
+				buf[offset + 0] = i->buf[ioffset + 0];
+				buf[offset + 1] = i->buf[ioffset + 0];
+				buf[offset + 2] = i->buf[ioffset + 0];
+				buf[offset + 3] = 255;
+			}
+		}
+	}
+	if (stats != NULL) {
+		stats_time(&stats->blend[0], start);
+	}
+	trace_event(TRACE_BLIT, start, xoff, yoff, 0);
+}
+
+#if PNG_FOUND
+static void put_be32(unsigned char *p, unsigned long v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void write_png_chunk(FILE *fp, const char *type, const unsigned char *data, size_t len) {
+	unsigned char b[4];
+	unsigned long crc = crc32(0, (const unsigned char *) type, 4);
+
+	if (len > 0) {
+		crc = crc32(crc, data, len);
+	}
+
+	put_be32(b, len);
+	if (fwrite(b, 1, 4, fp) != 4 || fwrite(type, 1, 4, fp) != 4 || fwrite(data, 1, len, fp) != len) {
+		stitch_log(LOG_ERROR, "PNG failure (write): %s\n", strerror(errno));
+		stitch_fail(STITCH_ERR_IO);
+	}
+	put_be32(b, crc);
+	if (fwrite(b, 1, 4, fp) != 4) {
+		stitch_log(LOG_ERROR, "PNG failure (write): %s\n", strerror(errno));
+		stitch_fail(STITCH_ERR_IO);
+	}
+}
+
+static void write_png_header(FILE *fp, int width, int height) {
+	unsigned char ihdr[13] = { 0, 0, 0, 0, 0, 0, 0, 0, 8, PNG_COLOR_TYPE_RGB_ALPHA, 0, 0, 0 };
+
+	put_be32(ihdr, width);
+	put_be32(ihdr + 4, height);
+	if (fwrite("\x89PNG\r\n\x1a\n", 1, 8, fp) != 8) {
+		stitch_log(LOG_ERROR, "PNG failure (write): %s\n", strerror(errno));
+		stitch_fail(STITCH_ERR_IO);
+	}
+	write_png_chunk(fp, "IHDR", ihdr, sizeof ihdr);
+}
+
+// The zlib stream of a shard ends with a sync flush, an empty final block and
+// the checksum, so that the merge can cut the streams apart at the flush and
+// join them; every row uses the Sub filter, which doesn't look at the row
+// above, so that the first row of a shard decodes the same after a merge.
+static const unsigned char png_shard_tail[6] = { 0x00, 0x00, 0xFF, 0xFF, 0x03, 0x00 };
+
+// Shards and merges are written out in IDAT chunks of up to this many bytes,
+// which keeps them under PNG's chunk size limit and out of memory
+#define PNG_IDAT_MAX (1 << 20)
+
+struct png_idat {
+	FILE *fp;
+	unsigned char *buf;
+	size_t len;
+};
+
+static void png_idat_open(struct png_idat *w, FILE *fp) {
+	w->fp = fp;
+	w->len = 0;
+	if ((w->buf = malloc(PNG_IDAT_MAX)) == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for PNG output\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	frame_hold(w->buf, free);
+}
+
+static void png_idat_put(struct png_idat *w, const unsigned char *p, size_t n) {
+	while (n > 0) {
+		size_t k = PNG_IDAT_MAX - w->len < n ? PNG_IDAT_MAX - w->len : n;
+
+		memcpy(w->buf + w->len, p, k);
+		w->len += k;
+		p += k;
+		n -= k;
+		if (w->len == PNG_IDAT_MAX) {
+			write_png_chunk(w->fp, "IDAT", w->buf, w->len);
+			w->len = 0;
+		}
+	}
+}
+
+static void png_idat_close(struct png_idat *w) {
+	if (w->len > 0) {
+		write_png_chunk(w->fp, "IDAT", w->buf, w->len);
+	}
+	frame_free(w->buf);
+}
+
+static void release_deflate(void *p) {
+	deflateEnd(p);
+}
+
+void write_png_shard(FILE *fp, unsigned char **rows, int width, int height) {
+	size_t rowlen = (size_t) width * 4 + 1;
+	unsigned char *filtered = malloc(rowlen);
+	unsigned char out[65536];
+	unsigned long adler = adler32(0, NULL, 0);
+	struct png_idat idat;
+	double band = timer_start();
+	z_stream zs;
+	int x, y;
+
+	memset(&zs, 0, sizeof zs);
+	frame_hold(filtered, free);
+	if (filtered == NULL || deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		stitch_log(LOG_ERROR, "PNG failure (deflate)\n");
+		stitch_fail(STITCH_ERR_IO);
+	}
+	frame_hold(&zs, release_deflate);
+	write_png_header(fp, width, height);
+	png_idat_open(&idat, fp);
+	png_idat_put(&idat, (const unsigned char *) "\x78\x9C", 2);
+
+	for (y = 0; y <= height; y++) {
+		if (y < height) {
+			filtered[0] = 1;
+			for (x = 0; x < width * 4; x++) {
+				filtered[x + 1] = rows[y][x] - (x >= 4 ? rows[y][x - 4] : 0);
+			}
+			adler = adler32(adler, filtered, rowlen);
+			zs.next_in = filtered;
+			zs.avail_in = rowlen;
+		}
+
+		do {
+			zs.next_out = out;
+			zs.avail_out = sizeof out;
+			deflate(&zs, y < height ? Z_NO_FLUSH : Z_SYNC_FLUSH);
+			png_idat_put(&idat, out, sizeof out - zs.avail_out);
+		} while (zs.avail_out == 0);
+		if (y < height) {
+			trace_rows(&band, y, height);
+		}
+	}
+	frame_drop(&zs);
+	deflateEnd(&zs);
+
+	unsigned char trailer[6];
+	memcpy(trailer, png_shard_tail + 4, 2);
+	put_be32(trailer + 2, adler);
+	png_idat_put(&idat, trailer, 6);
+	png_idat_close(&idat);
+	write_png_chunk(fp, "IEND", NULL, 0);
+	frame_free(filtered);
+}
+#endif
+
+#if PNG_FOUND
+// Hands what libpng encodes to the write callback of the render
+static void png_frame_write(png_structp png, png_bytep data, png_size_t len) {
+	struct stitch_frame *fr = png_get_io_ptr(png);
+
+	if (fr->write(fr->user, data, len) != 0) {
+		stitch_log(LOG_ERROR, "Can't write the output\n");
+		stitch_fail(STITCH_ERR_IO);
+	}
+	if (fr->tee != NULL) {
+		fwrite(data, 1, len, fr->tee);
+	}
+}
+
+static void png_frame_flush(png_structp png) {
+}
+#endif
+
+void write_png(const char *outfile, unsigned char **rows, int width, int height, int shard) {
+#if PNG_FOUND
+	FILE *outfp = stdout;
+	if (outfile != NULL) {
+		stitch_log(LOG_INFO, "Output PNG: %s\n", outfile);
+		outfp = fopen(outfile, "wb");
+		if (outfp == NULL) {
+			stitch_log(LOG_ERROR, "%s: %s\n", outfile, strerror(errno));
+			stitch_fail(STITCH_ERR_IO);
+		}
+		frame_hold(outfp, release_file);
+	} else {
+		stitch_log(LOG_INFO, "Output PNG: stdout\n");
+	}
+	if (shard) {
+		write_png_shard(outfp, rows, width, height);
+		if (outfile != NULL) {
+			frame_drop(outfp);
+			if (fclose(outfp) != 0) {
+				stitch_log(LOG_ERROR, "%s: %s\n", outfile, strerror(errno));
+				stitch_fail(STITCH_ERR_IO);
+			}
+		}
+		return;
+	}
+
+	png_structp png_ptr;
+	png_infop info_ptr;
+	struct png_pair pp = { NULL, NULL, 1 };
+
+	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, fail, fail, fail);
+	if (png_ptr == NULL) {
+		stitch_log(LOG_ERROR, "PNG failure (write struct)\n");
+		stitch_fail(STITCH_ERR_IO);
+	}
+	pp.png = png_ptr;
+	frame_hold(&pp, release_png);
+	info_ptr = png_create_info_struct(png_ptr);
+	if (info_ptr == NULL) {
+		stitch_log(LOG_ERROR, "PNG failure (info struct)\n");
+		stitch_fail(STITCH_ERR_IO);
+	}
+	pp.info = info_ptr;
+
+	png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	if (outfile == NULL && frame != NULL && frame->write != NULL) {
+		png_set_write_fn(png_ptr, frame, png_frame_write, png_frame_flush);
+	} else {
+		png_init_io(png_ptr, outfp);
+	}
+	png_write_info(png_ptr, info_ptr);
+
+	// Row by row rather than png_write_png(), for the trace of the bands
+	double band = timer_start();
+	int y;
+	for (y = 0; y < height; y++) {
+		png_write_row(png_ptr, rows[y]);
+		trace_rows(&band, y, height);
+	}
+	png_write_end(png_ptr, info_ptr);
+	frame_drop(&pp);
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+
+	if (outfile != NULL) {
+		frame_drop(outfp);
+		fclose(outfp);
+	}
+#else
+	stitch_log(LOG_ERROR, "stitch was compiled without PNG support, sorry\n");
+	stitch_fail(STITCH_ERR_UNSUPPORTED);
+#endif
+}
+
+void write_geotiff(const char *outfile, unsigned char **rows, int width, int height, int tiled, stitch_projection_t projection, double px, double py, double minx, double maxy) {
+#if GEOTIFF_FOUND
+
+	//TODO : Handle writing to stdout if required
+
+	if (outfile != NULL) {
+		stitch_log(LOG_INFO, "Output TIFF: %s\n", outfile);
+		TIFF *tif = (TIFF *) 0;  /* TIFF-level descriptor */
+		GTIF *gtif = (GTIF *) 0; /* GeoKey-level descriptor */
+		int i;
+
+		tif = XTIFFOpen(outfile, "w");
+		if (!tif) {
+			stitch_log(LOG_ERROR, "TIF failure (open)\n");
+			stitch_fail(STITCH_ERR_IO);
+		}
+		frame_hold(tif, release_tiff);
+
+		gtif = GTIFNew(tif);
+		if (!gtif) {
+			stitch_log(LOG_ERROR, "GTIFF failure (geotiff struct)\n");
+			stitch_fail(STITCH_ERR_ARGS);
+		}
+		frame_hold(gtif, release_gtif);
+
+		TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, width);
+		TIFFSetField(tif, TIFFTAG_IMAGELENGTH, height);
+		TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+		TIFFSetField(tif, TIFFTAG_PREDICTOR, 2);  //(horizontal differencing)
+		TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 8);
+		if (tiled) {
+			TIFFSetField(tif, TIFFTAG_TILEWIDTH, TIFF_BLOCK_SIZE);
+			TIFFSetField(tif, TIFFTAG_TILELENGTH, TIFF_BLOCK_SIZE);
+		} else {
+			TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, TIFF_ROWS_PER_STRIP);
+		}
+		TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 4);  //RGB+ALPHA
+		TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+		TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+
+		set_georeference(tif, gtif, projection, px, py, minx, maxy);
+
+		//write raster image
+		if (tiled) {
+			static const unsigned char pad[4] = { 0, 0, 0, 0 };
+			write_tiff_blocks(tif, rows, width, height, pad);
+		} else {
+			double band = timer_start();
+
+			for (i = 0; i < height; i++) {
+				if (!TIFFWriteScanline(tif, rows[i], i, 0)) {
+					TIFFError("WriteImage", "failure in WriteScanline\n");
+					stitch_fail(STITCH_ERR_IO);
+				}
+				trace_rows(&band, i, height);
+			}
+		}
+
+		GTIFWriteKeys(gtif);
+		frame_drop(gtif);
+		GTIFFree(gtif);
+		frame_drop(tif);
+		XTIFFClose(tif);
+	} else {
+		stitch_log(LOG_ERROR, "Can't write TIFF to stdout, sorry\n");
+		stitch_fail(STITCH_ERR_UNSUPPORTED);
+	}
+#else
+	stitch_log(LOG_ERROR, "stitch was compiled without GeoTIFF support, sorry\n");
+	stitch_fail(STITCH_ERR_UNSUPPORTED);
+#endif
+}
+
+void write_worldfile(const char *outfile, int outfmt, double px, double py, double minx, double maxy) {
+	if (outfile != NULL) {
+		char worldfile_filename[1024];
+		char worldfilext[5];
+		double wfvals[6];
+		FILE *fp;
+		int i;
+
+		//todo, make sure the output image file has the right extension
+		if (outfmt == OUTFMT_PNG) {
+			snprintf(worldfilext, sizeof worldfilext, ".pnw");
+		} else if (outfmt == OUTFMT_GEOTIFF || outfmt == OUTFMT_GEOTIFF_FLOAT32) {
+			snprintf(worldfilext, sizeof worldfilext, ".tfw");
+		}
+
+		strncpy(worldfile_filename, outfile, sizeof(worldfile_filename) - 4);
+		worldfile_filename[sizeof(worldfile_filename) - 5] = '\0';
+		for (i = strlen(worldfile_filename) - 1; i > 0; i--) {
+			if (worldfile_filename[i] == '.') {
+				strcpy(worldfile_filename + i, worldfilext);
+				break;
+			}
+		}
+		if (i <= 0) {
+			strcat(worldfile_filename, worldfilext);
+		}
+
+		wfvals[0] = px;    // x pixel resolution
+		wfvals[1] = 0;     // rotation
+		wfvals[2] = 0;     // rotation
+		wfvals[3] = -py;   // y pix resolution - negative as y direction is inverse of raster
+		wfvals[4] = minx;  // top left x
+		wfvals[5] = maxy;  // top left y
+
+		fp = fopen(worldfile_filename, "wt");
+		if (fp == NULL) {
+			stitch_log(LOG_ERROR, "Failed to open World File `%s'\n", worldfile_filename);
+			stitch_fail(STITCH_ERR_IO);
+		}
+
+		for (i = 0; i < 6; i++) {
+			fprintf(fp, "%24.10f\n", wfvals[i]);
+		}
+
+		fclose(fp);
+		stitch_log(LOG_INFO, "World file written to '%s'.\n", worldfile_filename);
+	} else {
+		stitch_log(LOG_ERROR, "Can't write a worldfile when writing to stdout\n");
+	}
+}
+
+#if PNG_FOUND
+static unsigned long get_be32(const unsigned char *p) {
+	return (unsigned long) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// Where the zlib stream of a shard is in its file: the offsets and lengths
+// of its IDAT chunks
+struct png_shard {
+	off_t *offsets;
+	unsigned long *lens;
+	int nchunks;
+	long long total;
+	int height;
+	unsigned long adler;
+};
+
+// Copies bytes from..to of a shard's zlib stream into dst, or else out as IDAT
+static void png_shard_stream(FILE *in, const char *file, const struct png_shard *sh, long long from, long long to, unsigned char *dst, struct png_idat *out) {
+	unsigned char buf[65536];
+	long long at = 0;
+	int c;
+
+	for (c = 0; c < sh->nchunks && from < to; at += sh->lens[c], c++) {
+		if (from >= at + (long long) sh->lens[c]) {
+			continue;
+		}
+		if (fseeko(in, sh->offsets[c] + (from - at), SEEK_SET) != 0) {
+			stitch_log(LOG_ERROR, "%s: %s\n", file, strerror(errno));
+			stitch_fail(STITCH_ERR_IO);
+		}
+		while (from < to && from < at + (long long) sh->lens[c]) {
+			long long n = at + (long long) sh->lens[c] - from;
+
+			n = n < to - from ? n : to - from;
+			n = n < (long long) sizeof buf ? n : (long long) sizeof buf;
+			if (fread(buf, 1, n, in) != (size_t) n) {
+				stitch_log(LOG_ERROR, "%s: truncated\n", file);
+				stitch_fail(STITCH_ERR_IO);
+			}
+			if (dst != NULL) {
+				memcpy(dst, buf, n);
+				dst += n;
+			} else {
+				png_idat_put(out, buf, n);
+			}
+			from += n;
+		}
+	}
+}
+
+// Finds the IDAT chunks of a shard and checks that it ends as -S ends them
+static void png_shard_index(const char *file, struct png_shard *sh, int *width) {
+	unsigned char head[8 + 25], tail[10];
+	FILE *in = fopen(file, "rb");
+	const unsigned char *p = head + 8;
+	off_t at = 8;
+
+	if (in == NULL) {
+		stitch_log(LOG_ERROR, "%s: %s\n", file, strerror(errno));
+		stitch_fail(STITCH_ERR_IO);
+	}
+	if (fread(head, 1, sizeof head, in) != sizeof head || memcmp(head, "\x89PNG\r\n\x1a\n", 8) != 0 || memcmp(p + 4, "IHDR", 4) != 0) {
+		stitch_log(LOG_ERROR, "%s: not a PNG\n", file);
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+	if (p[16] != 8 || p[17] != PNG_COLOR_TYPE_RGB_ALPHA || p[20] != 0) {
+		stitch_log(LOG_ERROR, "%s: not an RGBA shard\n", file);
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+	if (*width > 0 && (int) get_be32(p + 8) != *width) {
+		stitch_log(LOG_ERROR, "%s: %lu pixels wide, not %d\n", file, get_be32(p + 8), *width);
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+	*width = get_be32(p + 8);
+	sh->height = get_be32(p + 12);
+
+	for (;;) {
+		unsigned char ch[8];
+		unsigned long len;
+
+		if (fseeko(in, at, SEEK_SET) != 0 || fread(ch, 1, 8, in) != 8) {
+			break;
+		}
+		len = get_be32(ch);
+		if (memcmp(ch + 4, "IDAT", 4) == 0) {
+			sh->offsets = realloc(sh->offsets, (sh->nchunks + 1) * sizeof(off_t));
+			sh->lens = realloc(sh->lens, (sh->nchunks + 1) * sizeof(unsigned long));
+			if (sh->offsets == NULL || sh->lens == NULL) {
+				stitch_log(LOG_ERROR, "Can't allocate memory for the chunks of %s\n", file);
+				stitch_fail(STITCH_ERR_MEMORY);
+			}
+			sh->offsets[sh->nchunks] = at + 8;
+			sh->lens[sh->nchunks++] = len;
+			sh->total += len;
+		} else if (memcmp(ch + 4, "IEND", 4) == 0) {
+			break;
+		}
+		at += 12 + (off_t) len;
+	}
+
+	if (sh->total < 2 + 10) {
+		stitch_log(LOG_ERROR, "%s: not written as a shard (-S)\n", file);
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+	png_shard_stream(in, file, sh, sh->total - 10, sh->total, tail, NULL);
+	if (memcmp(tail, png_shard_tail, 6) != 0) {
+		stitch_log(LOG_ERROR, "%s: not written as a shard (-S)\n", file);
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+	sh->adler = get_be32(tail + 6);
+	fclose(in);
+}
+
+// Joins PNG shards by splicing their zlib streams; see write_png_shard()
+void merge_png_shards(const char *outfile, char **files, int nfiles) {
+	struct png_shard *shards = calloc(nfiles, sizeof(struct png_shard));
+	int width = 0, height = 0, k;
+
+	if (shards == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for %d shards\n", nfiles);
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+
+	// All shards are checked before any output is written
+	for (k = 0; k < nfiles; k++) {
+		png_shard_index(files[k], &shards[k], &width);
+		height += shards[k].height;
+	}
+
+	FILE *outfp = stdout;
+	if (outfile != NULL) {
+		outfp = fopen(outfile, "wb");
+		if (outfp == NULL) {
+			stitch_log(LOG_ERROR, "%s: %s\n", outfile, strerror(errno));
+			stitch_fail(STITCH_ERR_IO);
+		}
+	}
+	stitch_log(LOG_INFO, "Output PNG: %s, %dx%d from %d shards\n", outfile != NULL ? outfile : "stdout", width, height, nfiles);
+
+	// Everything but the zlib header of the later shards, and the final block
+	// and checksum of all of them, which are replaced by one for the whole.
+	// Shards are copied one at a time, in pieces.
+	struct png_idat idat;
+	unsigned long adler = 0;
+	write_png_header(outfp, width, height);
+	png_idat_open(&idat, outfp);
+	for (k = 0; k < nfiles; k++) {
+		FILE *in = fopen(files[k], "rb");
+
+		if (in == NULL) {
+			stitch_log(LOG_ERROR, "%s: %s\n", files[k], strerror(errno));
+			stitch_fail(STITCH_ERR_IO);
+		}
+		adler = k == 0 ? shards[k].adler : adler32_combine(adler, shards[k].adler, (z_off_t) shards[k].height * ((size_t) width * 4 + 1));
+		png_shard_stream(in, files[k], &shards[k], k == 0 ? 0 : 2, shards[k].total - 6, NULL, &idat);
+		fclose(in);
+		free(shards[k].offsets);
+		free(shards[k].lens);
+	}
+
+	unsigned char trailer[6];
+	memcpy(trailer, png_shard_tail + 4, 2);
+	put_be32(trailer + 2, adler);
+	png_idat_put(&idat, trailer, 6);
+	png_idat_close(&idat);
+	write_png_chunk(outfp, "IEND", NULL, 0);
+
+	if (outfile != NULL ? fclose(outfp) != 0 : fflush(outfp) != 0) {
+		stitch_log(LOG_ERROR, "%s: %s\n", outfile != NULL ? outfile : "stdout", strerror(errno));
+		stitch_fail(STITCH_ERR_IO);
+	}
+	free(shards);
+}
+#endif
+
+#if GEOTIFF_FOUND
+// Joins TIFF shards by copying their compressed strips as they are. All but
+// the last shard must end on a strip boundary, as -S shards do.
+void merge_tiff_shards(const char *outfile, char **files, int nfiles) {
+	uint32_t width = 0, height = 0, rps = 0, h, w, r;
+	uint16_t bps = 0, spp = 0, compression = 0, predictor = 1, format = SAMPLEFORMAT_UINT, photometric;
+	tmsize_t bufsize = 0;
+	void *buf = NULL;
+	uint32_t strip = 0;
+	int k;
+
+	register_gdal_tags();
+
+	for (k = 0; k < nfiles; k++) {
+		TIFF *in = XTIFFOpen(files[k], "r");
+		uint16_t b, sp, c, p = 1, f = SAMPLEFORMAT_UINT;
+
+		if (in == NULL) {
+			stitch_log(LOG_ERROR, "%s: can't open TIFF\n", files[k]);
+			stitch_fail(STITCH_ERR_IO);
+		}
+		TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &w);
+		TIFFGetField(in, TIFFTAG_IMAGELENGTH, &h);
+		TIFFGetFieldDefaulted(in, TIFFTAG_ROWSPERSTRIP, &r);
+		TIFFGetFieldDefaulted(in, TIFFTAG_BITSPERSAMPLE, &b);
+		TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLESPERPIXEL, &sp);
+		TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION, &c);
+		if (c != COMPRESSION_NONE) {
+			TIFFGetFieldDefaulted(in, TIFFTAG_PREDICTOR, &p);
+		}
+		TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLEFORMAT, &f);
+
+		if (TIFFIsTiled(in) || (k > 0 && (w != width || r != rps))) {
+			stitch_log(LOG_ERROR, "%s: strips don't match the first shard\n", files[k]);
+			stitch_fail(STITCH_ERR_ARGS);
+		}
+
+		// The strips are copied as they are, so they must be encoded alike
+		if (k > 0 && (b != bps || sp != spp || c != compression || p != predictor || f != format)) {
+			stitch_log(LOG_ERROR, "%s: samples or compression don't match the first shard\n", files[k]);
+			stitch_fail(STITCH_ERR_ARGS);
+		}
+		if (k < nfiles - 1 && h % r != 0) {
+			stitch_log(LOG_ERROR, "%s: doesn't end on a strip boundary\n", files[k]);
+			stitch_fail(STITCH_ERR_ARGS);
+		}
+		width = w;
+		rps = r;
+		bps = b;
+		spp = sp;
+		compression = c;
+		predictor = p;
+		format = f;
+		height += h;
+		XTIFFClose(in);
+	}
+
+	TIFF *out = XTIFFOpen(outfile, "w");
+	if (out == NULL) {
+		stitch_log(LOG_ERROR, "TIF failure (open)\n");
+		stitch_fail(STITCH_ERR_IO);
+	}
+	stitch_log(LOG_INFO, "Output TIFF: %s, %ux%u from %d shards\n", outfile, width, height, nfiles);
+
+	for (k = 0; k < nfiles; k++) {
+		TIFF *in = XTIFFOpen(files[k], "r");
+		uint32_t s, nstrips;
+
+		if (in == NULL) {
+			stitch_log(LOG_ERROR, "%s: can't open TIFF\n", files[k]);
+			stitch_fail(STITCH_ERR_IO);
+		}
+		nstrips = TIFFNumberOfStrips(in);
+
+		if (k == 0) {
+			uint16_t count;
+			void *values;
+			char *text;
+
+			TIFFGetFieldDefaulted(in, TIFFTAG_PHOTOMETRIC, &photometric);
+
+			TIFFSetField(out, TIFFTAG_IMAGEWIDTH, width);
+			TIFFSetField(out, TIFFTAG_IMAGELENGTH, height);
+			TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, bps);
+			TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, spp);
+			TIFFSetField(out, TIFFTAG_COMPRESSION, compression);
+			if (compression != COMPRESSION_NONE) {
+				TIFFSetField(out, TIFFTAG_PREDICTOR, predictor);
+			}
+			TIFFSetField(out, TIFFTAG_SAMPLEFORMAT, format);
+			TIFFSetField(out, TIFFTAG_PHOTOMETRIC, photometric);
+			TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+			TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, rps);
+
+			// The first shard has the upper left corner of the whole
+			if (TIFFGetField(in, TIFFTAG_GEOPIXELSCALE, &count, &values)) {
+				TIFFSetField(out, TIFFTAG_GEOPIXELSCALE, count, values);
+			}
+			if (TIFFGetField(in, TIFFTAG_GEOTIEPOINTS, &count, &values)) {
+				TIFFSetField(out, TIFFTAG_GEOTIEPOINTS, count, values);
+			}
+			if (TIFFGetField(in, TIFFTAG_GEOKEYDIRECTORY, &count, &values)) {
+				TIFFSetField(out, TIFFTAG_GEOKEYDIRECTORY, count, values);
+			}
+			if (TIFFGetField(in, TIFFTAG_GEODOUBLEPARAMS, &count, &values)) {
+				TIFFSetField(out, TIFFTAG_GEODOUBLEPARAMS, count, values);
+			}
+			if (TIFFGetField(in, TIFFTAG_GEOASCIIPARAMS, &text)) {
+				TIFFSetField(out, TIFFTAG_GEOASCIIPARAMS, text);
+			}
+			if (TIFFGetField(in, TIFFTAG_GDAL_NODATA, &text)) {
+				TIFFSetField(out, TIFFTAG_GDAL_NODATA, text);
+			}
+		}
+
+		for (s = 0; s < nstrips; s++) {
+			tmsize_t size = TIFFRawStripSize(in, s);
+
+			if (size > bufsize) {
+				bufsize = size;
+				buf = realloc(buf, bufsize);
+				if (buf == NULL) {
+					stitch_log(LOG_ERROR, "Can't allocate memory for %lld\n", (long long) bufsize);
+					stitch_fail(STITCH_ERR_MEMORY);
+				}
+			}
+			if (TIFFReadRawStrip(in, s, buf, size) != size || TIFFWriteRawStrip(out, strip++, buf, size) != size) {
+				stitch_log(LOG_ERROR, "%s: can't copy strip %u\n", files[k], s);
+				stitch_fail(STITCH_ERR_ARGS);
+			}
+		}
+		XTIFFClose(in);
+	}
+
+	XTIFFClose(out);
+	free(buf);
+}
+#endif
+
+// Merges the outputs of the shards of a job, in order, into one image
+void merge_shards(const char *outfile, char **files, int nfiles) {
+	FILE *fp = fopen(files[0], "rb");
+	char magic[4] = { 0 };
+
+	if (fp == NULL) {
+		stitch_log(LOG_ERROR, "%s: %s\n", files[0], strerror(errno));
+		stitch_fail(STITCH_ERR_IO);
+	}
+	if (fread(magic, 1, 4, fp) != 4) {
+		stitch_log(LOG_ERROR, "%s: too short\n", files[0]);
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+	fclose(fp);
+
+	if (memcmp(magic, "\x89PNG", 4) == 0) {
+#if PNG_FOUND
+		merge_png_shards(outfile, files, nfiles);
+#else
+		stitch_log(LOG_ERROR, "stitch was compiled without PNG support, sorry\n");
+		stitch_fail(STITCH_ERR_UNSUPPORTED);
+#endif
+	} else if (memcmp(magic, "II", 2) == 0 || memcmp(magic, "MM", 2) == 0) {
+#if GEOTIFF_FOUND
+		if (outfile == NULL) {
+			stitch_log(LOG_ERROR, "Can't write TIFF to stdout, sorry\n");
+			stitch_fail(STITCH_ERR_UNSUPPORTED);
+		}
+		merge_tiff_shards(outfile, files, nfiles);
+#else
+		stitch_log(LOG_ERROR, "stitch was compiled without GeoTIFF support, sorry\n");
+		stitch_fail(STITCH_ERR_UNSUPPORTED);
+#endif
+	} else {
+		stitch_log(LOG_ERROR, "%s: neither PNG nor TIFF\n", files[0]);
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+}
+
+float resample_weight(resample_filter_t filter, double t) {
+	t = fabs(t);
+
+	switch (filter) {
+	case FILTER_BOX:
+		return t <= 0.5 ? 1 : 0;
+
+	case FILTER_BILINEAR:
+		return t < 1 ? 1 - t : 0;
+
+	case FILTER_LANCZOS:
+		if (t < 1e-8) {
+			return 1;
+		} else if (t < 3) {
+			return 3 * sin(M_PI * t) * sin(M_PI * t / 3) / (M_PI * M_PI * t * t);
+		}
+		return 0;
+	}
+	return 0;
+}
+
+double resample_support(resample_filter_t filter) {
+	return filter == FILTER_BOX ? 0.5 : filter == FILTER_BILINEAR ? 1 : 3;
+}
+
+// Filter taps mapping one axis of the source window onto the output, widened
+// by the scale factor when reducing
+struct resample_axis {
+	int *first;      // first source pixel of each output pixel
+	int *count;      // and how many contribute
+	float *weights;  // maxn per output pixel
+	int maxn;
+};
+
+// The source position of each output pixel center comes from the centers
+// lookup table, and the local source pixels per output pixel from scales; a
+// linear mapping of the whole window is used where they are NULL.
+void resample_axis_init(struct resample_axis *ax, resample_filter_t filter, int outsize, int srcsize, const double *centers, const double *scales) {
+	double maxscale = (double) srcsize / outsize;
+	int o, k;
+
+	for (o = 0; scales != NULL && o < outsize; o++) {
+		if (o == 0 || scales[o] > maxscale) {
+			maxscale = scales[o];
+		}
+	}
+
+	ax->maxn = 2 * ceil(resample_support(filter) * (maxscale > 1 ? maxscale : 1)) + 2;
+	ax->first = malloc(outsize * sizeof(int));
+	ax->count = malloc(outsize * sizeof(int));
+	ax->weights = malloc((size_t) outsize * ax->maxn * sizeof(float));
+	if (ax->first == NULL || ax->count == NULL || ax->weights == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for resampling\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+
+	for (o = 0; o < outsize; o++) {
+		double scale = scales != NULL ? scales[o] : (double) srcsize / outsize;
+		double center = centers != NULL ? centers[o] : (o + 0.5) * scale - 0.5;
+		double fs = scale > 1 ? scale : 1;
+		double support = resample_support(filter) * fs;
+		int first = ceil(center - support);
+		int last = floor(center + support);
+
+		if (first < 0) {
+			first = 0;
+		}
+		if (last > srcsize - 1) {
+			last = srcsize - 1;
+		}
+		if (last - first + 1 > ax->maxn) {
+			last = first + ax->maxn - 1;
+		}
+
+		ax->first[o] = first;
+		ax->count[o] = last - first + 1;
+		for (k = 0; k < ax->count[o]; k++) {
+			ax->weights[(size_t) o * ax->maxn + k] = resample_weight(filter, (first + k - center) / fs);
+		}
+	}
+}
+
+void resample_axis_free(struct resample_axis *ax) {
+	free(ax->first);
+	free(ax->count);
+	free(ax->weights);
+}
+
+// Resamples tiles into the output as they arrive, without ever holding the
+// source mosaic. Each composited tile is split through the separable filter
+// into weighted sums over a ring of output rows; a row is normalized into
+// the output once every tile row it draws from has been added. The last
+// channel of the sums is the total weight, so that missing data, the edges
+// and negative filter lobes all normalize out.
+struct resampler {
+	struct resample_axis xs, ys;
+	int width, height;
+	int channels;
+	float *ring;      // nring rows of width * channels sums
+	int nring;
+	int next_row;     // first output row not yet written
+	int top_row;      // last output row with sums in the ring
+	float *hbuf;      // one tile of horizontally filtered sums
+	unsigned char *rgba;
+	float *grid;
+};
+
+// Maps the output columns and rows of a plan onto its source window
+void resample_axes_init(const struct job *job, const struct plan *pl, struct resample_axis *xs, struct resample_axis *ys) {
+	int tilesize = pl->tilesize;
+
+	if (pl->projection == PROJECTION_GEOGRAPHIC) {
+		// Longitude maps linearly onto Mercator x, but each row of latitude
+		// needs its own source y, precomputed here once for the whole run
+		double worldpx = (double) tilesize * (1LL << pl->zoom);
+		double ox = (double) pl->tx1 * tilesize + pl->xa;
+		double oy = (double) pl->ty1 * tilesize + pl->ya;
+		double dlon = (pl->maxlon - pl->minlon) / pl->width;
+		double dlat = (pl->maxlat - pl->minlat) / pl->height;
+		double *centers = malloc((pl->width > pl->height ? pl->width : pl->height) * sizeof(double));
+		double *scales = malloc((pl->width > pl->height ? pl->width : pl->height) * sizeof(double));
+		int o;
+
+		if (centers == NULL || scales == NULL) {
+			stitch_log(LOG_ERROR, "Can't allocate memory for resampling\n");
+			stitch_fail(STITCH_ERR_MEMORY);
+		}
+
+		for (o = 0; o < pl->width; o++) {
+			double lon = pl->minlon + (o + 0.5) * dlon;
+			centers[o] = worldpx * (lon + 180) / 360 - ox - 0.5;
+			scales[o] = worldpx * dlon / 360;
+		}
+		resample_axis_init(xs, job->filter, pl->width, pl->src_width, centers, scales);
+
+		for (o = 0; o < pl->height; o++) {
+			double lat_rad = (pl->maxlat - (o + 0.5) * dlat) * M_PI / 180;
+			centers[o] = worldpx * (1 - log(tan(lat_rad) + 1 / cos(lat_rad)) / M_PI) / 2 - oy - 0.5;
+			scales[o] = worldpx * dlat / 360 / cos(lat_rad);
+		}
+		resample_axis_init(ys, job->filter, pl->height, pl->src_height, centers, scales);
+
+		free(centers);
+		free(scales);
+	} else {
+		resample_axis_init(xs, job->filter, pl->width, pl->src_width, NULL, NULL);
+		resample_axis_init(ys, job->filter, pl->height, pl->src_height, NULL, NULL);
+	}
+}
+
+// Finds the output pixels whose taps reach into source pixels s0 to s0+n-1;
+// returns 0 if there are none
+int resample_axis_range(const struct resample_axis *ax, int outsize, int s0, int n, int *o0, int *o1) {
+	int o;
+
+	*o0 = *o1 = -1;
+	for (o = 0; o < outsize; o++) {
+		if (ax->first[o] + ax->count[o] > s0 && ax->first[o] < s0 + n) {
+			if (*o0 < 0) {
+				*o0 = o;
+			}
+			*o1 = o;
+		} else if (*o0 >= 0) {
+			break;
+		}
+	}
+	return *o0 >= 0;
+}
+
+void resampler_init(struct resampler *rs, const struct job *job, const struct plan *pl, unsigned char *rgba, float *grid) {
+	int tilesize = pl->tilesize;
+
+	resample_axes_init(job, pl, &rs->xs, &rs->ys);
+	rs->width = pl->width;
+	rs->height = pl->height;
+	rs->rgba = rgba;
+	rs->grid = grid;
+
+	// Premultiplied RGBA, or elevation times validity and validity, plus weight
+	rs->channels = grid != NULL ? 3 : 5;
+
+	// While a row waits for the tile row holding its last tap, rows up to
+	// those whose first tap lies within that tile row can be touched
+	int oy, newest = 0;
+	rs->nring = 1;
+	for (oy = 0; oy < pl->height; oy++) {
+		int last = rs->ys.first[oy] + rs->ys.count[oy];
+		while (newest + 1 < pl->height && rs->ys.first[newest + 1] < last + tilesize) {
+			newest++;
+		}
+		if (newest - oy + 1 > rs->nring) {
+			rs->nring = newest - oy + 1;
+		}
+	}
+
+	rs->ring = malloc((size_t) rs->nring * rs->width * rs->channels * sizeof(float));
+	rs->hbuf = malloc((size_t) tilesize * rs->width * rs->channels * sizeof(float));
+	if (rs->ring == NULL || rs->hbuf == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for resampling\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	rs->next_row = 0;
+	rs->top_row = -1;
+}
+
+void resampler_free(struct resampler *rs) {
+	frame_drop(rs);
+	resample_axis_free(&rs->xs);
+	resample_axis_free(&rs->ys);
+	free(rs->ring);
+	free(rs->hbuf);
+}
+
+static void release_resampler(void *p) {
+	resampler_free(p);
+}
+
+static float *resampler_row(struct resampler *rs, int oy) {
+	if (oy - rs->next_row >= rs->nring) {
+		stitch_log(LOG_ERROR, "Resampling window overflow at row %d\n", oy);
+		stitch_fail(STITCH_ERR_INTERNAL);
+	}
+
+	while (rs->top_row < oy) {
+		rs->top_row++;
+		memset(rs->ring + (size_t) (rs->top_row % rs->nring) * rs->width * rs->channels, 0,
+			(size_t) rs->width * rs->channels * sizeof(float));
+	}
+	return rs->ring + (size_t) (oy % rs->nring) * rs->width * rs->channels;
+}
+
+// Adds a tile of channels-wide float pixels whose top left corner is at
+// (sx0, sy0) in the source window
+void resampler_add(struct resampler *rs, const float *tile, int tilesize, int sx0, int sy0) {
+	int C = rs->channels;
+	int ox0, ox1, ox, oy, x, y, c, k;
+
+	// Output columns whose taps reach into the tile
+	if (!resample_axis_range(&rs->xs, rs->width, sx0, tilesize, &ox0, &ox1)) {
+		return;
+	}
+
+	// Horizontal pass, tile rows by output columns
+	for (y = 0; y < tilesize; y++) {
+		const float *src = tile + (size_t) y * tilesize * C;
+		float *dst = rs->hbuf + (size_t) y * rs->width * C;
+
+		for (ox = ox0; ox <= ox1; ox++) {
+			const float *w = rs->xs.weights + (size_t) ox * rs->xs.maxn;
+			int first = rs->xs.first[ox], last = first + rs->xs.count[ox];
+			float sum[5] = { 0, 0, 0, 0, 0 };
+
+			for (k = first > sx0 ? first : sx0; k < last && k < sx0 + tilesize; k++) {
+				const float *px = src + (k - sx0) * C;
+				for (c = 0; c < C; c++) {
+					sum[c] += w[k - first] * px[c];
+				}
+			}
+			for (c = 0; c < C; c++) {
+				dst[ox * C + c] = sum[c];
+			}
+		}
+	}
+
+	// Vertical pass into the output rows whose taps reach into the tile
+	for (oy = 0; oy < rs->height; oy++) {
+		int first = rs->ys.first[oy], last = first + rs->ys.count[oy];
+
+		if (last <= sy0) {
+			continue;
+		}
+		if (first >= sy0 + tilesize) {
+			break;
+		}
+
+		const float *w = rs->ys.weights + (size_t) oy * rs->ys.maxn;
+		float *acc = resampler_row(rs, oy);
+
+		for (k = first > sy0 ? first : sy0; k < last && k < sy0 + tilesize; k++) {
+			const float *h = rs->hbuf + (size_t) (k - sy0) * rs->width * C;
+			float wy = w[k - first];
+
+			for (x = ox0 * C; x < (ox1 + 1) * C; x++) {
+				acc[x] += wy * h[x];
+			}
+		}
+	}
+}
+
+// Writes out the output rows whose taps all lie above source row done
+void resampler_finish(struct resampler *rs, int done) {
+	int C = rs->channels;
+
+	while (rs->next_row < rs->height && rs->ys.first[rs->next_row] + rs->ys.count[rs->next_row] <= done) {
+		int oy = rs->next_row;
+		float *acc = resampler_row(rs, oy);
+		int x;
+
+		for (x = 0; x < rs->width; x++) {
+			const float *a = acc + x * C;
+
+			if (rs->grid != NULL) {
+				// Keep elevations only where most of the footprint has data
+				float *g = rs->grid + (size_t) oy * rs->width + x;
+				*g = a[2] > 0 && a[1] / a[2] >= 0.5 ? a[0] / a[1] : ELEVATION_NODATA;
+			} else {
+				unsigned char *p = rs->rgba + ((size_t) oy * rs->width + x) * 4;
+				double alpha = a[4] > 0 ? a[3] / a[4] : 0;
+
+				if (alpha < 0.5 / 255) {
+					p[0] = p[1] = p[2] = p[3] = 0;
+				} else {
+					for (int c = 0; c < 3; c++) {
+						double v = a[c] / a[4] / alpha;
+						p[c] = v < 0 ? 0 : v > 255 ? 255 : round(v);
+					}
+					p[3] = alpha > 1 ? 255 : round(alpha * 255);
+				}
+			}
+		}
+
+		rs->next_row++;
+	}
+}
+
+// Expands a GetMap URL template into out, which must have room for
+// strlen(url) + 200 characters
+void expand_getmap_url(const char *url, double minx, double miny, double maxx, double maxy, int width, int height, char *url2, int end) {
+	const char *cp;
+	char *out = url2;
+
+	for (cp = url; *cp && out - url2 < end - 100; cp++) {
+		if (!strncmp(cp, "{bbox}", 6) || !strncmp(cp, "{bbox-epsg-3857}", 16)) {
+			out += sprintf(out, "%.17g,%.17g,%.17g,%.17g", minx, miny, maxx, maxy);
+			cp = strchr(cp, '}');
+		} else if (!strncmp(cp, "{width}", 7)) {
+			out += sprintf(out, "%d", width);
+			cp += 6;
+		} else if (!strncmp(cp, "{height}", 8)) {
+			out += sprintf(out, "%d", height);
+			cp += 7;
+		} else if (!strncmp(cp, "{s}", 3)) {
+			*out++ = 'a' + (unsigned long long) (fabs(minx) / (maxx - minx) + fabs(miny) / (maxy - miny)) % 3;
+			cp += 2;
+		} else {
+			*out++ = *cp;
+		}
+	}
+
+	*out = '\0';
+}
+
+struct getmap {
+	int size;                // tiles a side of a window
+	int ncx, ncy;            // windows across and down the job's tiles
+	int nwindows;
+	struct image **windows;  // by layer and window, once fetched
+	unsigned char *fetched;
+	int *uses;               // tiles of each window not cut from it yet
+	int requests;
+};
+
+void getmap_init(struct getmap *gm, const struct job *job, const struct plan *pl) {
+	int l, k, n = 0;
+
+	memset(gm, 0, sizeof(struct getmap));
+	for (l = 0; l < job->nlayers; l++) {
+		n += layer_getmap(pl->urls[l]);
+	}
+	if (n == 0) {
+		return;
+	}
+
+	gm->size = job->getmap / pl->tilesize > 0 ? job->getmap / pl->tilesize : 1;
+	gm->ncx = (pl->tx2 - pl->tx1) / gm->size + 1;
+	gm->ncy = (pl->ty2 - pl->ty1) / gm->size + 1;
+
+	n = gm->nwindows = job->nlayers * gm->ncx * gm->ncy;
+	gm->windows = calloc(n, sizeof(struct image *));
+	gm->fetched = calloc(n, 1);
+	gm->uses = malloc(n * sizeof(int));
+	if (gm->windows == NULL || gm->fetched == NULL || gm->uses == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for %d GetMap windows\n", n);
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	for (k = 0; k < n; k++) {
+		int c = k % (gm->ncx * gm->ncy);
+		int cw = (pl->tx2 - pl->tx1 + 1) - c % gm->ncx * gm->size;
+		int ch = (pl->ty2 - pl->ty1 + 1) - c / gm->ncx * gm->size;
+
+		gm->uses[k] = (cw < gm->size ? cw : gm->size) * (ch < gm->size ? ch : gm->size);
+	}
+}
+
+void getmap_free(struct getmap *gm) {
+	int k;
+
+	frame_drop(gm);
+	for (k = 0; k < gm->nwindows; k++) {
+		if (gm->windows[k] != NULL) {
+			free_image(gm->windows[k]);
+		}
+	}
+	free(gm->windows);
+	free(gm->fetched);
+	free(gm->uses);
+}
+
+static void release_getmap(void *p) {
+	getmap_free(p);
+}
+
+// Cuts a tile of a WMS layer from its window, fetching the window the first
+// time. A window is freed once all its tiles have been cut from it.
+struct image *getmap_tile(struct getmap *gm, const struct plan *pl, int l, unsigned int tx, unsigned int ty) {
+	int cx = (tx - pl->tx1) / gm->size, cy = (ty - pl->ty1) / gm->size;
+	int k = (l * gm->ncy + cy) * gm->ncx + cx;
+	unsigned int wx = pl->tx1 + cx * gm->size, wy = pl->ty1 + cy * gm->size;
+	int tilesize = pl->tilesize, y;
+	struct image *w, *i;
+
+	if (!gm->fetched[k]) {
+		static const double originshift = 20037508.342789244;
+		unsigned int wx2 = wx + gm->size - 1 < pl->tx2 ? wx + gm->size - 1 : pl->tx2;
+		unsigned int wy2 = wy + gm->size - 1 < pl->ty2 ? wy + gm->size - 1 : pl->ty2;
+		double span = 2 * originshift / (1LL << pl->zoom);
+		int width = (wx2 - wx + 1) * tilesize, height = (wy2 - wy + 1) * tilesize;
+		int end = strlen(pl->urls[l]) + 200;
+		char url2[end];
+		struct data data = { NULL, 0, 0 };
+
+		expand_getmap_url(pl->urls[l], wx * span - originshift, originshift - (wy2 + 1) * span,
+			(wx2 + 1) * span - originshift, originshift - wy * span, width, height, url2, end);
+		gm->fetched[k] = 1;
+		gm->requests++;
+		if (fetch_url(url2, &data)) {
+			gm->windows[k] = decode_image(&data);
+			free(data.buf);
+
+			w = gm->windows[k];
+			if (w != NULL && (w->width != width || w->height != height)) {
+				stitch_log(LOG_ERROR, "Got %dx%d window, not %dx%d\n", w->width, w->height, width, height);
+				stitch_fail(STITCH_ERR_DECODE);
+			}
+		}
+	}
+
+	w = gm->windows[k];
+	if (w == NULL) {
+		return NULL;
+	}
+
+	i = malloc(sizeof(struct image));
+	if (i == NULL || (i->buf = malloc((size_t) tilesize * tilesize * w->depth)) == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for a tile\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	i->width = i->height = tilesize;
+	i->depth = w->depth;
+	for (y = 0; y < tilesize; y++) {
+		memcpy(i->buf + (size_t) y * tilesize * i->depth,
+			w->buf + (((size_t) (ty - wy) * tilesize + y) * w->width + (size_t) (tx - wx) * tilesize) * w->depth,
+			(size_t) tilesize * w->depth);
+	}
+
+	if (--gm->uses[k] == 0) {
+		free_image(w);
+		gm->windows[k] = NULL;
+	}
+	return i;
+}
+
+// A local raster layer: a GeoTIFF in EPSG:3857 with 8-bit gray or RGB
+// samples, optionally with alpha. Tiles are cut from it by reading only the
+// TIFF tiles or strips under them, which libtiff maps from the file, and
+// keeping the decoded blocks in a small direct-mapped cache.
+struct raster;
+
+#if GEOTIFF_FOUND
+#define RASTER_CACHE_BYTES (64 * 1024 * 1024)
+
+struct raster_block {
+	uint32_t index;
+	unsigned char *buf;  // NULL if the slot is empty
+};
+
+struct raster {
+	const char *path;
+	TIFF *tif;
+	uint32_t width, height;
+	uint32_t bw, bh;            // block size, the whole width for strips
+	int tiled;
+	int samples;                // 1 gray, 2 gray alpha, 3 RGB, 4 RGBA
+	double left, top;           // upper left corner, in Mercator meters
+	double resx, resy;          // and the pixel size
+	tmsize_t blocksize;
+	struct raster_block *cache;
+	int ncache;
+	int reads;
+};
+
+void raster_close(struct raster *r);
+
+static void release_raster(void *p) {
+	raster_close(p);
+}
+
+struct raster *raster_open(const char *path) {
+	struct raster *r = calloc(1, sizeof(struct raster));
+	uint16_t bits = 0, samples = 0, planar = PLANARCONFIG_CONTIG, count = 0;
+	double *scale = NULL, *tie = NULL;
+	int k;
+
+	if (r == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for %s\n", path);
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	frame_hold(r, release_raster);
+	r->path = path;
+	r->tif = XTIFFOpen(path, "r");
+	if (r->tif == NULL) {
+		stitch_log(LOG_ERROR, "%s: can't open\n", path);
+		stitch_fail(STITCH_ERR_IO);
+	}
+
+	TIFFGetField(r->tif, TIFFTAG_IMAGEWIDTH, &r->width);
+	TIFFGetField(r->tif, TIFFTAG_IMAGELENGTH, &r->height);
+	TIFFGetFieldDefaulted(r->tif, TIFFTAG_BITSPERSAMPLE, &bits);
+	TIFFGetFieldDefaulted(r->tif, TIFFTAG_SAMPLESPERPIXEL, &samples);
+	TIFFGetFieldDefaulted(r->tif, TIFFTAG_PLANARCONFIG, &planar);
+	if (bits != 8 || samples < 1 || samples > 4 || planar != PLANARCONFIG_CONTIG) {
+		stitch_log(LOG_ERROR, "%s: only interleaved 8-bit gray or RGB, with or without alpha, can be a layer\n", path);
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+	r->samples = samples;
+
+	// Without the keys the pixel scale could be in degrees, or in meters of
+	// some other projection, so only a file that says EPSG:3857 is taken
+	GTIF *gtif = GTIFNew(r->tif);
+	unsigned short model = 0, crs = 0;
+	if (gtif != NULL) {
+		GTIFKeyGet(gtif, GTModelTypeGeoKey, &model, 0, 1);
+		GTIFKeyGet(gtif, ProjectedCSTypeGeoKey, &crs, 0, 1);
+		GTIFFree(gtif);
+	}
+	if (model != ModelTypeProjected || crs != 3857) {
+		if (crs != 0) {
+			stitch_log(LOG_ERROR, "%s: in EPSG:%u, not EPSG:3857\n", path, crs);
+		} else {
+			stitch_log(LOG_ERROR, "%s: not georeferenced in EPSG:3857\n", path);
+		}
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+	if (!TIFFGetField(r->tif, TIFFTAG_GEOPIXELSCALE, &count, &scale) || count < 2 ||
+	    !TIFFGetField(r->tif, TIFFTAG_GEOTIEPOINTS, &count, &tie) || count < 6) {
+		stitch_log(LOG_ERROR, "%s: no georeference\n", path);
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+	r->resx = scale[0];
+	r->resy = scale[1];
+	r->left = tie[3] - tie[0] * r->resx;
+	r->top = tie[4] + tie[1] * r->resy;
+
+	r->tiled = TIFFIsTiled(r->tif);
+	if (r->tiled) {
+		TIFFGetField(r->tif, TIFFTAG_TILEWIDTH, &r->bw);
+		TIFFGetField(r->tif, TIFFTAG_TILELENGTH, &r->bh);
+		r->blocksize = TIFFTileSize(r->tif);
+	} else {
+		r->bw = r->width;
+		TIFFGetFieldDefaulted(r->tif, TIFFTAG_ROWSPERSTRIP, &r->bh);
+		if (r->bh > r->height) {
+			r->bh = r->height;
+		}
+		r->blocksize = TIFFStripSize(r->tif);
+	}
+
+	r->ncache = RASTER_CACHE_BYTES / r->blocksize;
+	if (r->ncache < 16) {
+		r->ncache = 16;
+	}
+	r->cache = calloc(r->ncache, sizeof(struct raster_block));
+	if (r->cache == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for %s\n", path);
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	for (k = 0; k < r->ncache; k++) {
+		r->cache[k].index = UINT32_MAX;
+	}
+	return r;
+}
+
+void raster_close(struct raster *r) {
+	int k;
+
+	frame_drop(r);
+	stitch_log(LOG_INFO, "==Raster %s: %d blocks read\n", r->path, r->reads);
+	for (k = 0; r->cache != NULL && k < r->ncache; k++) {
+		free(r->cache[k].buf);
+	}
+	free(r->cache);
+	if (r->tif != NULL) {
+		XTIFFClose(r->tif);
+	}
+	free(r);
+}
+
+// The decoded TIFF tile or strip with the pixel at x, y
+static const unsigned char *raster_block(struct raster *r, uint32_t x, uint32_t y) {
+	uint32_t index = r->tiled ? TIFFComputeTile(r->tif, x, y, 0, 0) : TIFFComputeStrip(r->tif, y, 0);
+	struct raster_block *b = &r->cache[index % r->ncache];
+
+	if (b->index != index) {
+		if (b->buf == NULL && (b->buf = malloc(r->blocksize)) == NULL) {
+			stitch_log(LOG_ERROR, "Can't allocate memory for %s\n", r->path);
+			stitch_fail(STITCH_ERR_MEMORY);
+		}
+		if ((r->tiled ? TIFFReadEncodedTile(r->tif, index, b->buf, r->blocksize)
+			      : TIFFReadEncodedStrip(r->tif, index, b->buf, r->blocksize)) < 0) {
+			stitch_log(LOG_ERROR, "%s: can't read block %u\n", r->path, index);
+			stitch_fail(STITCH_ERR_IO);
+		}
+		b->index = index;
+		r->reads++;
+	}
+	return b->buf;
+}
+
+// Samples a tile of the plan from the raster, nearest neighbour at the tile's
+// pixel centers. Returns NULL if the tile is entirely off the raster.
+struct image *raster_tile(struct raster *r, const struct plan *pl, unsigned int tx, unsigned int ty) {
+	static const double originshift = 20037508.342789244;
+	int tilesize = pl->tilesize, x, y;
+	double res = 2 * originshift / ((double) (1LL << pl->zoom) * tilesize);
+	long long cols[tilesize];
+	struct image *i;
+
+	double x0 = ((double) tx * tilesize) * res - originshift, y0 = originshift - ((double) ty * tilesize) * res;
+	if (x0 + tilesize * res <= r->left || x0 >= r->left + r->width * r->resx ||
+	    y0 - tilesize * res >= r->top || y0 <= r->top - r->height * r->resy) {
+		return NULL;
+	}
+
+	i = malloc(sizeof(struct image));
+	if (i == NULL || (i->buf = calloc((size_t) tilesize * tilesize, 4)) == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for a tile\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	i->width = i->height = tilesize;
+	i->depth = 4;
+
+	for (x = 0; x < tilesize; x++) {
+		cols[x] = floor((x0 + (x + 0.5) * res - r->left) / r->resx);
+	}
+
+	for (y = 0; y < tilesize; y++) {
+		long long row = floor((r->top - (y0 - (y + 0.5) * res)) / r->resy);
+		unsigned char *out = i->buf + (size_t) y * tilesize * 4;
+
+		if (row < 0 || row >= r->height) {
+			continue;
+		}
+		for (x = 0; x < tilesize; x++) {
+			long long col = cols[x];
+
+			if (col < 0 || col >= r->width) {
+				continue;
+			}
+
+			const unsigned char *b = raster_block(r, col, row);
+			const unsigned char *p = b + ((size_t) (row % r->bh) * r->bw + (r->tiled ? col % r->bw : col)) * r->samples;
+			unsigned char *o = out + x * 4;
+
+			if (r->samples <= 2) {
+				o[0] = o[1] = o[2] = p[0];
+				o[3] = r->samples == 2 ? p[1] : 255;
+			} else {
+				o[0] = p[0];
+				o[1] = p[1];
+				o[2] = p[2];
+				o[3] = r->samples == 4 ? p[3] : 255;
+			}
+		}
+	}
+	return i;
+}
+#else
+void raster_close(struct raster *r) {
+}
+
+struct image *raster_tile(struct raster *r, const struct plan *pl, unsigned int tx, unsigned int ty) {
+	return NULL;
+}
+#endif /* GEOTIFF_FOUND */
+
+// Opens the rasters of the job's layers, by layer, NULL for the other
+// layers, or returns NULL if there are none
+struct raster **rasters_open(const struct job *job, const struct plan *pl) {
+	struct raster **rasters = NULL;
+	int l;
+
+	for (l = 0; l < job->nlayers; l++) {
+		if (layer_raster(pl->urls[l])) {
+#if GEOTIFF_FOUND
+			if (rasters == NULL) {
+				if ((rasters = calloc(job->nlayers, sizeof(struct raster *))) == NULL) {
+					stitch_log(LOG_ERROR, "Can't allocate memory for %d layers\n", job->nlayers);
+					stitch_fail(STITCH_ERR_MEMORY);
+				}
+				frame_hold(rasters, free);
+			}
+			rasters[l] = raster_open(pl->urls[l]);
+#else
+			stitch_log(LOG_ERROR, "stitch was compiled without GeoTIFF support, so %s can't be a layer, sorry\n", pl->urls[l]);
+			stitch_fail(STITCH_ERR_UNSUPPORTED);
+#endif
+		}
+	}
+	return rasters;
+}
+
+void rasters_close(struct raster **rasters, int nlayers) {
+	int l;
+
+	for (l = 0; rasters != NULL && l < nlayers; l++) {
+		if (rasters[l] != NULL) {
+			raster_close(rasters[l]);
+		}
+	}
+	frame_free(rasters);
+}
+
+// Fetches a tile of one of the job's layers, falling back on its ancestors
+// if it is missing and the job allows overzooming
+struct image *fetch_layer_tile(const struct job *job, const struct plan *pl, struct overzoom *oz, struct getmap *gm, struct raster **rasters, int l, unsigned int tx, unsigned int ty) {
+	struct image *i;
+
+	if (rasters != NULL && rasters[l] != NULL) {
+		return raster_tile(rasters[l], pl, tx, ty);
+	}
+	if (gm->windows != NULL && layer_getmap(pl->urls[l])) {
+		return getmap_tile(gm, pl, l, tx, ty);
+	}
+
+	i = fetch_tile(job->cache, pl->templates[l], pl->zoom, tx, ty);
+	progress_tile(tile_cached);
+
+	if (i == NULL && oz->levels > 0) {
+		i = overzoom_tile(oz, job->cache, pl->templates[l], pl->zoom, tx, ty, pl->tilesize);
+	}
+	return i;
+}
+
+// Rasterizes the polygon onto the output grid, one byte per pixel, set where
+// the pixel center is inside by the even-odd rule. Edges are kept in an
+// active list as the scanline moves down, so each row only visits the edges
+// that cross it.
+struct mask_edge {
+	double y0, y1;   // y0 < y1
+	double x0;       // x at y0
+	double slope;    // dx/dy
+};
+
+static int compare_mask_edges(const void *a, const void *b) {
+	const struct mask_edge *ea = a, *eb = b;
+	return ea->y0 < eb->y0 ? -1 : ea->y0 > eb->y0;
+}
+
+unsigned char *rasterize_polygon(const struct polygon *poly, const struct plan *pl) {
+	int width = pl->width, height = pl->height;
+	struct mask_edge *edges = malloc((poly->n + 1) * sizeof(struct mask_edge));
+	int *active = malloc((poly->n + 1) * sizeof(int));
+	double *xs = malloc((poly->n + 1) * sizeof(double));
+	double *vx = malloc((poly->n + 1) * sizeof(double));
+	double *vy = malloc((poly->n + 1) * sizeof(double));
+	unsigned char *mask = calloc((size_t) width * height, 1);
+	int nedges = 0, nactive = 0, next = 0;
+	int r, k, y;
+
+	if (edges == NULL || active == NULL || xs == NULL || vx == NULL || vy == NULL || mask == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for the mask\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+
+	for (k = 0; k < poly->n; k++) {
+		if (pl->projection == PROJECTION_GEOGRAPHIC) {
+			vx[k] = (poly->lon[k] - pl->left) / pl->px;
+			vy[k] = (pl->top - poly->lat[k]) / pl->py;
+		} else {
+			double mx, my;
+			projectlatlon(poly->lat[k], poly->lon[k], &mx, &my);
+			vx[k] = (mx - pl->left) / pl->px;
+			vy[k] = (pl->top - my) / pl->py;
+		}
+	}
+
+	for (r = 0; r < poly->nrings; r++) {
+		int start = poly->rings[r], end = poly->rings[r + 1];
+
+		for (k = start; k < end; k++) {
+			int a = k, b = k + 1 < end ? k + 1 : start;
+			struct mask_edge *e = &edges[nedges];
+
+			if (vy[a] == vy[b]) {
+				continue;
+			}
+			if (vy[a] > vy[b]) {
+				int t = a;
+				a = b;
+				b = t;
+			}
+			e->y0 = vy[a];
+			e->y1 = vy[b];
+			e->x0 = vx[a];
+			e->slope = (vx[b] - vx[a]) / (vy[b] - vy[a]);
+			nedges++;
+		}
+	}
+	qsort(edges, nedges, sizeof(struct mask_edge), compare_mask_edges);
+
+	for (y = 0; y < height; y++) {
+		double yc = y + 0.5;
+		int nx = 0, kept = 0;
+
+		while (next < nedges && edges[next].y0 <= yc) {
+			active[nactive++] = next++;
+		}
+
+		for (k = 0; k < nactive; k++) {
+			const struct mask_edge *e = &edges[active[k]];
+
+			if (e->y1 <= yc) {
+				continue;
+			}
+			active[kept++] = active[k];
+
+			// Insertion sort; few edges cross any one row
+			double x = e->x0 + (yc - e->y0) * e->slope;
+			int i = nx++;
+			while (i > 0 && xs[i - 1] > x) {
+				xs[i] = xs[i - 1];
+				i--;
+			}
+			xs[i] = x;
+		}
+		nactive = kept;
+
+		for (k = 0; k + 1 < nx; k += 2) {
+			double x0 = ceil(xs[k] - 0.5), x1 = ceil(xs[k + 1] - 0.5);
+
+			if (x0 < 0) {
+				x0 = 0;
+			}
+			if (x1 > width) {
+				x1 = width;
+			}
+			if (x1 > x0) {
+				memset(mask + (size_t) y * width + (int) x0, 1, (int) x1 - (int) x0);
+			}
+		}
+	}
+
+	free(edges);
+	free(active);
+	free(xs);
+	free(vx);
+	free(vy);
+	return mask;
+}
+
+// Flags the tiles of the plan that draw into some pixel inside the mask,
+// row by row from ty1 and tx1
+unsigned char *plan_tile_mask(const struct job *job, const struct plan *pl, const unsigned char *mask) {
+	int ntx = pl->tx2 - pl->tx1 + 1, nty = pl->ty2 - pl->ty1 + 1;
+	int tilesize = pl->tilesize;
+	unsigned char *tiles = calloc((size_t) ntx * nty, 1);
+	struct resample_axis xs, ys;
+	int i, j, x, y;
+
+	if (tiles == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for %dx%d tiles\n", ntx, nty);
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+
+	if (pl->resample) {
+		resample_axes_init(job, pl, &xs, &ys);
+	}
+
+	for (j = 0; j < nty; j++) {
+		int sy0 = j * tilesize - pl->ya;
+		int oy0 = sy0 < 0 ? 0 : sy0, oy1 = sy0 + tilesize - 1;
+
+		if (pl->resample ? !resample_axis_range(&ys, pl->height, sy0, tilesize, &oy0, &oy1) : oy0 >= pl->height) {
+			continue;
+		}
+		if (oy1 >= pl->height) {
+			oy1 = pl->height - 1;
+		}
+
+		for (i = 0; i < ntx; i++) {
+			int sx0 = i * tilesize - pl->xa;
+			int ox0 = sx0 < 0 ? 0 : sx0, ox1 = sx0 + tilesize - 1;
+
+			if (pl->resample ? !resample_axis_range(&xs, pl->width, sx0, tilesize, &ox0, &ox1) : ox0 >= pl->width) {
+				continue;
+			}
+			if (ox1 >= pl->width) {
+				ox1 = pl->width - 1;
+			}
+
+			for (y = oy0; y <= oy1 && !tiles[j * ntx + i]; y++) {
+				const unsigned char *row = mask + (size_t) y * pl->width;
+				for (x = ox0; x <= ox1; x++) {
+					if (row[x]) {
+						tiles[j * ntx + i] = 1;
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	if (pl->resample) {
+		resample_axis_free(&xs);
+		resample_axis_free(&ys);
+	}
+	return tiles;
+}
+
+// Fetches the job's tiles row by row, composites the layers of each tile at
+// its own resolution and resamples it straight into the output
+void resample_tiles(const struct job *job, const struct plan *pl, const struct elevation_decoder *decoder, const unsigned char *tiles, struct overzoom *oz, struct getmap *gm, struct raster **rasters, unsigned char *buf, float *grid) {
+	int tilesize = pl->tilesize;
+	size_t npix = (size_t) tilesize * tilesize;
+	struct resampler rs;
+	unsigned int tx, ty;
+	size_t k;
+
+	resampler_init(&rs, job, pl, buf, grid);
+	frame_hold(&rs, release_resampler);
+
+	unsigned char *rgba = malloc(npix * 4);
+	float *elev = malloc(npix * sizeof(float));
+	float *tile = malloc(npix * rs.channels * sizeof(float));
+	frame_hold(rgba, free);
+	frame_hold(elev, free);
+	frame_hold(tile, free);
+	if (rgba == NULL || elev == NULL || tile == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for resampling\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+
+	for (ty = pl->ty1; ty <= pl->ty2; ty++) {
+		int sy0 = (ty - pl->ty1) * tilesize - pl->ya;
+
+		for (tx = pl->tx1; tx <= pl->tx2; tx++) {
+			int sx0 = (tx - pl->tx1) * tilesize - pl->xa;
+			int l;
+
+			if (tiles != NULL && !tiles[(ty - pl->ty1) * (pl->tx2 - pl->tx1 + 1) + (tx - pl->tx1)]) {
+				continue;
+			}
+			frame_check();
+
+			memset(rgba, 0, npix * 4);
+			for (k = 0; k < npix; k++) {
+				elev[k] = ELEVATION_NODATA;
+			}
+
+			for (l = 0; l < job->nlayers; l++) {
+				struct image *i = fetch_layer_tile(job, pl, oz, gm, rasters, l, tx, ty);
+
+				if (i == NULL) {
+					continue;
+				}
+
+				if (i->height != tilesize || i->width != tilesize) {
+					stitch_log(LOG_ERROR, "Got %dx%d tile, not %d\n", i->width, i->height, tilesize);
+					free_image(i);
+					stitch_fail(STITCH_ERR_DECODE);
+				}
+
+				if (grid != NULL) {
+					blit_elevation(decoder, elev, tilesize, tilesize, i, 0, 0);
+				} else {
+					blit_rgba(rgba, tilesize, tilesize, i, 0, 0);
+				}
+				free_image(i);
+			}
+
+			if (grid != NULL) {
+				for (k = 0; k < npix; k++) {
+					int valid = elev[k] != ELEVATION_NODATA;
+					tile[k * 3 + 0] = valid ? elev[k] : 0;
+					tile[k * 3 + 1] = valid;
+					tile[k * 3 + 2] = 1;
+				}
+			} else {
+				for (k = 0; k < npix; k++) {
+					float alpha = rgba[k * 4 + 3] / 255.0f;
+					tile[k * 5 + 0] = rgba[k * 4 + 0] * alpha;
+					tile[k * 5 + 1] = rgba[k * 4 + 1] * alpha;
+					tile[k * 5 + 2] = rgba[k * 4 + 2] * alpha;
+					tile[k * 5 + 3] = alpha;
+					tile[k * 5 + 4] = 1;
+				}
+			}
+
+			resampler_add(&rs, tile, tilesize, sx0, sy0);
+		}
+
+		resampler_finish(&rs, ty == pl->ty2 ? INT32_MAX : sy0 + tilesize);
+	}
+
+	frame_free(rgba);
+	frame_free(elev);
+	frame_free(tile);
+	resampler_free(&rs);
+}
+
+// Validators of the tiles in an output, kept in a sidecar next to it so that
+// a later run asks the servers for only the tiles that changed and patches
+// the blocks of the tiled TIFF that they cover. A validator is the ETag of
+// the tile, or # and a hash of its body if the server sends none, or - if
+// the tile was missing.
+struct tile_state {
+	char *validator;              // from the sidecar, NULL if not known
+	char *next;                   // as fetched now
+	struct curl_slist *request;   // If-None-Match, while it is asked for
+	struct data data;             // body of a changed tile
+	struct image *image;          // decoded, while the blocks it covers are patched
+	int loaded, changed;
+};
+
+struct update {
+	char *path;
+	unsigned int tx1, ty1;
+	int ntx, nty, nlayers;
+	struct tile_state *tiles;   // by layer, then row by row from ty1 and tx1
+	int known;                  // the sidecar and the output are of this job
+	int nchanged;
+	char header[512];
+};
+
+static struct tile_state *update_tile(struct update *up, const struct plan *pl, int l, unsigned int tx, unsigned int ty) {
+	return &up->tiles[((size_t) l * up->nty + (ty - pl->ty1)) * up->ntx + (tx - pl->tx1)];
+}
+
+// Reads the validators at path, if they are there and the output they
+// describe still is too
+struct update *update_open(const char *path, const char *output, const struct plan *pl, int nlayers, int grid) {
+	struct update *up = calloc(1, sizeof(struct update));
+	char line[1024];
+	struct stat st;
+	FILE *fp;
+
+	if (up == NULL || (up->path = strdup(path)) == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for the tile validators\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	up->tx1 = pl->tx1;
+	up->ty1 = pl->ty1;
+	up->ntx = pl->tx2 - pl->tx1 + 1;
+	up->nty = pl->ty2 - pl->ty1 + 1;
+	up->nlayers = nlayers;
+	up->tiles = calloc((size_t) up->ntx * up->nty * up->nlayers, sizeof(struct tile_state));
+	if (up->tiles == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for the tile validators\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+
+	plan_signature("stitch-validators", pl, grid, up->header, sizeof up->header);
+
+	fp = fopen(up->path, "r");
+	if (fp == NULL) {
+		return up;
+	}
+	if (fgets(line, sizeof line, fp) == NULL || strcmp(line, up->header) != 0) {
+		stitch_log(LOG_ERROR, "%s: validators of a different job, rendering everything again\n", up->path);
+	} else if (stat(output, &st) != 0) {
+		stitch_log(LOG_ERROR, "%s: output is missing, rendering everything again\n", output);
+	} else {
+		unsigned int tx, ty;
+		int l, n;
+
+		while (fgets(line, sizeof line, fp) != NULL) {
+			char *cp = strchr(line, '\n');
+
+			if (cp == NULL || sscanf(line, "%d %u %u %n", &l, &tx, &ty, &n) != 3 || l < 0 || l >= up->nlayers ||
+			    tx < pl->tx1 || tx > pl->tx2 || ty < pl->ty1 || ty > pl->ty2) {
+				continue;
+			}
+			*cp = '\0';
+
+			struct tile_state *ts = update_tile(up, pl, l, tx, ty);
+			free(ts->validator);
+			if ((ts->validator = strdup(line + n)) == NULL) {
+				stitch_log(LOG_ERROR, "Can't allocate memory for the tile validators\n");
+				stitch_fail(STITCH_ERR_MEMORY);
+			}
+		}
+		up->known = 1;
+	}
+	fclose(fp);
+	return up;
+}
+
+// Keeps the ETag of the last response of a transfer, which is the one that
+// counts when there are redirects
+static size_t curl_etag(char *ptr, size_t size, size_t nmemb, void *v) {
+	struct tile_state *ts = v;
+	size_t len = size * nmemb;
+
+	if (len >= 5 && !strncmp(ptr, "HTTP/", 5)) {
+		free(ts->next);
+		ts->next = NULL;
+	} else if (len > 5 && !strncasecmp(ptr, "ETag:", 5)) {
+		size_t start = 5, end = len;
+
+		while (start < end && (ptr[start] == ' ' || ptr[start] == '\t')) {
+			start++;
+		}
+		while (end > start && (ptr[end - 1] == '\r' || ptr[end - 1] == '\n' || ptr[end - 1] == ' ')) {
+			end--;
+		}
+		if (end > start) {
+			free(ts->next);
+			if ((ts->next = strndup(ptr + start, end - start)) == NULL) {
+				stitch_log(LOG_ERROR, "Can't allocate memory for an ETag\n");
+				stitch_fail(STITCH_ERR_MEMORY);
+			}
+		}
+	}
+	return len;
+}
+
+// 64-bit FNV-1a of a tile body, for servers that send no ETag
+static char *body_validator(const struct data *data) {
+	unsigned long long h = 14695981039346656037ULL;
+	char out[20];
+	int k;
+
+	for (k = 0; k < data->len; k++) {
+		h = (h ^ (unsigned char) data->buf[k]) * 1099511628211ULL;
+	}
+	snprintf(out, sizeof out, "#%016llx", h);
+	return strdup(out);
+}
+
+// Decides from the response whether a tile changed, and keeps its body if so
+static void update_settle(struct update *up, struct tile_state *ts, long status) {
+	if (status == 304) {
+		free(ts->next);
+		ts->next = strdup(ts->validator);
+	} else if (http_missing(status)) {
+		free(ts->next);
+		ts->next = strdup("-");
+	} else if (ts->next == NULL) {
+		ts->next = body_validator(&ts->data);
+	}
+	if (ts->next == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for the tile validators\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+
+	ts->changed = ts->validator == NULL || strcmp(ts->validator, ts->next) != 0;
+	if (!ts->changed || http_missing(status)) {
+		free(ts->data.buf);
+		ts->data.buf = NULL;
+		ts->data.len = ts->data.nalloc = 0;
+	}
+	up->nchanged += ts->changed;
+}
+
+// Asks for every tile again, with the ETag it had as If-None-Match, at most
+// parallel transfers at a time. Tiles that come back the same are dropped;
+// the bodies of the ones that changed are kept to be composited.
+void update_revalidate(struct update *up, const struct plan *pl, int parallel) {
+	size_t ntiles = (size_t) up->ntx * up->nty * up->nlayers, next = 0;
+	int running = 0;
+
+	struct multi m;
+	multi_init(&m, parallel);
+	frame_hold(&m, release_multi);
+
+	progress_begin("revalidate", ntiles);
+	double queued = timer_start();
+	while (next < ntiles || running > 0) {
+		while (next < ntiles && running < parallel) {
+			struct tile_state *ts = &up->tiles[next];
+			int l = next / ((size_t) up->ntx * up->nty);
+			unsigned int tx = pl->tx1 + next % up->ntx;
+			unsigned int ty = pl->ty1 + next / up->ntx % up->nty;
+			char url2[pl->templates[l]->maxlen + 1];
+
+			next++;
+			url_expand(pl->templates[l], pl->zoom, tx, ty, url2);
+			stitch_log(LOG_DEBUG, "%s\n", url2);
+
+			CURL *curl = curl_easy_init();
+			if (curl == NULL) {
+				stitch_log(LOG_ERROR, "Curl won't start\n");
+				stitch_fail(STITCH_ERR_FETCH);
+			}
+			setup_tile_request(curl, url2, &ts->data);
+			curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curl_etag);
+			curl_easy_setopt(curl, CURLOPT_HEADERDATA, ts);
+			if (ts->validator != NULL && ts->validator[0] != '#' && ts->validator[0] != '-') {
+				char condition[strlen(ts->validator) + 20];
+
+				sprintf(condition, "If-None-Match: %s", ts->validator);
+				ts->request = curl_slist_append(NULL, condition);
+				curl_easy_setopt(curl, CURLOPT_HTTPHEADER, ts->request);
+			}
+			curl_easy_setopt(curl, CURLOPT_PRIVATE, ts);
+			multi_add(&m, curl);
+			running++;
+		}
+
+		int still_running;
+		curl_multi_perform(m.multi, &still_running);
+		curl_multi_poll(m.multi, NULL, 0, 1000, NULL);
+
+		CURLMsg *msg;
+		int left;
+		while ((msg = curl_multi_info_read(m.multi, &left)) != NULL) {
+			if (msg->msg != CURLMSG_DONE) {
+				continue;
+			}
+
+			struct tile_state *ts;
+			long status = 0;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &ts);
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &status);
+			stats_transfer(msg->easy_handle, msg->data.result == CURLE_OK);
+
+			size_t k = ts - up->tiles;
+			trace_transfer(msg->easy_handle, queued, pl->zoom, pl->tx1 + k % up->ntx, pl->ty1 + k / up->ntx % up->nty);
+			progress_bytes(ts->data.len);
+
+			if (msg->data.result != CURLE_OK) {
+				char *url = NULL;
+
+				curl_easy_getinfo(msg->easy_handle, CURLINFO_EFFECTIVE_URL, &url);
+				stitch_log(LOG_ERROR, "Can't retrieve %s: %s\n", url, curl_easy_strerror(msg->data.result));
+				stitch_fail(STITCH_ERR_FETCH);
+			}
+			if (status >= 400 && !http_missing(status)) {
+				char *url = NULL;
+
+				curl_easy_getinfo(msg->easy_handle, CURLINFO_EFFECTIVE_URL, &url);
+				stitch_log(LOG_ERROR, "Can't retrieve %s: HTTP %ld\n", url, status);
+				stitch_fail(STITCH_ERR_FETCH);
+			}
+			update_settle(up, ts, status);
+			if (http_missing(status)) {
+				progress_missing();
+			}
+			progress_tile(status == 304);
+
+			curl_slist_free_all(ts->request);
+			ts->request = NULL;
+			multi_remove(&m, msg->easy_handle);
+			running--;
+		}
+	}
+
+	frame_drop(&m);
+	multi_cleanup(&m);
+	progress_end();
+}
+
+// Hands the bodies fetched to the tile cache of a full render, which takes
+// each of them once
+struct tile_cache *update_cache(struct update *up, const struct plan *pl) {
+	struct tile_cache *cache = tile_cache_new(4096);
+	unsigned int tx, ty;
+	int l;
+
+	for (l = 0; l < up->nlayers; l++) {
+		for (ty = pl->ty1; ty <= pl->ty2; ty++) {
+			for (tx = pl->tx1; tx <= pl->tx2; tx++) {
+				struct tile_state *ts = update_tile(up, pl, l, tx, ty);
+
+				if (ts->data.buf != NULL) {
+					tile_cache_plan(cache, pl->urls[l], pl->zoom, tx, ty);
+					(*tile_cache_slot(cache, pl->urls[l], pl->zoom, tx, ty))->data = ts->data;
+					ts->data.buf = NULL;
+					ts->data.len = ts->data.nalloc = 0;
+				}
+			}
+		}
+	}
+	return cache;
+}
+
+#if GEOTIFF_FOUND
+// Decodes a tile for the blocks it covers: a changed one from the body that
+// was fetched, an unchanged one by fetching it again
+static struct image *update_tile_image(struct update *up, const struct plan *pl, int l, unsigned int tx, unsigned int ty) {
+	struct tile_state *ts = update_tile(up, pl, l, tx, ty);
+
+	if (!ts->loaded) {
+		ts->loaded = 1;
+		if (ts->data.buf != NULL) {
+			ts->image = decode_image(&ts->data);
+			free(ts->data.buf);
+			ts->data.buf = NULL;
+		} else if (strcmp(ts->next, "-") != 0) {
+			ts->image = fetch_tile(NULL, pl->templates[l], pl->zoom, tx, ty);
+		}
+		if (ts->image != NULL && (ts->image->width != pl->tilesize || ts->image->height != pl->tilesize)) {
+			stitch_log(LOG_ERROR, "Got %dx%d tile, not %d\n", ts->image->width, ts->image->height, pl->tilesize);
+			stitch_fail(STITCH_ERR_DECODE);
+		}
+	}
+	return ts->image;
+}
+
+// Composites again the blocks of the output that changed tiles draw into,
+// from all the layers of all the tiles under them, and rewrites only those
+// blocks of the TIFF
+void update_blocks(const struct job *job, const struct plan *pl, struct update *up, const struct elevation_decoder *decoder, int grid) {
+	int B = TIFF_BLOCK_SIZE, T = pl->tilesize;
+	int width = pl->width, height = pl->height;
+	int nbx = (width + B - 1) / B, nby = (height + B - 1) / B;
+	unsigned char *blocks = calloc((size_t) nbx * nby, 1);
+	unsigned char *canvas = malloc((size_t) B * B * 4), *block = malloc((size_t) B * B * 4);
+	unsigned char *brows[TIFF_BLOCK_SIZE];
+	uint32_t tw = 0, th = 0, iw = 0, ih = 0;
+	uint16_t bits = 0, samples = 0;
+	int bx, by, npatched = 0, nblocks = 0;
+	size_t k, ntiles = (size_t) up->ntx * up->nty;
+
+	frame_hold(blocks, free);
+	frame_hold(canvas, free);
+	frame_hold(block, free);
+	if (blocks == NULL || canvas == NULL || block == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for the blocks to update\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+
+	for (k = 0; k < ntiles * up->nlayers; k++) {
+		if (up->tiles[k].changed) {
+			int x0 = (k % up->ntx) * T - pl->xa, y0 = (k % ntiles / up->ntx) * T - pl->ya;
+			int x1 = x0 + T - 1, y1 = y0 + T - 1;
+
+			x0 = x0 < 0 ? 0 : x0;
+			y0 = y0 < 0 ? 0 : y0;
+			x1 = x1 >= width ? width - 1 : x1;
+			y1 = y1 >= height ? height - 1 : y1;
+			for (by = y0 / B; by <= y1 / B; by++) {
+				for (bx = x0 / B; bx <= x1 / B; bx++) {
+					nblocks += !blocks[by * nbx + bx];
+					blocks[by * nbx + bx] = 1;
+				}
+			}
+		}
+	}
+
+	register_gdal_tags();
+	TIFF *tif = XTIFFOpen(job->outfile, "r+");
+	if (!tif) {
+		stitch_log(LOG_ERROR, "TIF failure (open)\n");
+		stitch_fail(STITCH_ERR_IO);
+	}
+	frame_hold(tif, release_tiff);
+	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &iw);
+	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &ih);
+	TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bits);
+	TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &samples);
+	if (TIFFIsTiled(tif)) {
+		TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tw);
+		TIFFGetField(tif, TIFFTAG_TILELENGTH, &th);
+	}
+	if ((int) iw != width || (int) ih != height || (int) tw != B || (int) th != B ||
+	    bits != (grid ? 32 : 8) || samples != (grid ? 1 : 4)) {
+		stitch_log(LOG_ERROR, "%s: not the tiled TIFF of this job; remove %s to render it again\n", job->outfile, up->path);
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+
+	for (by = 0; by < nby; by++) {
+		int bh = height - by * B < B ? height - by * B : B;
+
+		for (bx = 0; bx < nbx; bx++) {
+			int bw = width - bx * B < B ? width - bx * B : B;
+			unsigned int tx, ty, txa, txb, tya, tyb;
+			int y, l;
+
+			if (!blocks[by * nbx + bx]) {
+				continue;
+			}
+
+			if (grid) {
+				float *g = (float *) canvas;
+				for (k = 0; k < (size_t) bw * bh; k++) {
+					g[k] = ELEVATION_NODATA;
+				}
+			} else {
+				memset(canvas, 0, (size_t) bw * bh * 4);
+			}
+
+			txa = pl->tx1 + (bx * B + pl->xa) / T;
+			txb = pl->tx1 + (bx * B + bw - 1 + pl->xa) / T;
+			tya = pl->ty1 + (by * B + pl->ya) / T;
+			tyb = pl->ty1 + (by * B + bh - 1 + pl->ya) / T;
+			for (ty = tya; ty <= tyb && ty <= pl->ty2; ty++) {
+				for (tx = txa; tx <= txb && tx <= pl->tx2; tx++) {
+					int xoff = (tx - pl->tx1) * T - pl->xa - bx * B;
+					int yoff = (ty - pl->ty1) * T - pl->ya - by * B;
+
+					for (l = 0; l < up->nlayers; l++) {
+						struct image *i = update_tile_image(up, pl, l, tx, ty);
+
+						if (i == NULL) {
+							continue;
+						}
+						if (grid) {
+							blit_elevation(decoder, (float *) canvas, bw, bh, i, xoff, yoff);
+						} else {
+							blit_rgba(canvas, bw, bh, i, xoff, yoff);
+						}
+					}
+				}
+			}
+
+			for (y = 0; y < bh; y++) {
+				brows[y] = canvas + (size_t) y * bw * 4;
+			}
+			if (grid) {
+				float pad = ELEVATION_NODATA;
+				fill_tiff_block(block, brows, bw, bh, &pad);
+			} else {
+				static const unsigned char pad[4] = { 0, 0, 0, 0 };
+				fill_tiff_block(block, brows, bw, bh, pad);
+			}
+			write_tiff_block(tif, bx * B, by * B, block);
+			npatched++;
+		}
+
+		// Tiles that end above the next row of blocks aren't needed again
+		for (k = 0; k < ntiles * up->nlayers; k++) {
+			struct tile_state *ts = &up->tiles[k];
+
+			if (ts->image != NULL && (int) ((k % ntiles / up->ntx + 1) * T - pl->ya) <= (by + 1) * B) {
+				free_image(ts->image);
+				ts->image = NULL;
+			}
+		}
+	}
+
+	frame_drop(tif);
+	XTIFFClose(tif);
+	stitch_log(LOG_INFO, "==Update: %d of %d blocks patched\n", npatched, nbx * nby);
+
+	frame_free(blocks);
+	frame_free(canvas);
+	frame_free(block);
+}
+#endif
+
+void update_free(struct update *up) {
+	size_t k;
+
+	frame_drop(up);
+	for (k = 0; k < (size_t) up->ntx * up->nty * up->nlayers; k++) {
+		struct tile_state *ts = &up->tiles[k];
+
+		free(ts->validator);
+		free(ts->next);
+		free(ts->data.buf);
+		if (ts->image != NULL) {
+			free_image(ts->image);
+		}
+	}
+	free(up->tiles);
+	free(up->path);
+	free(up);
+}
+
+static void release_update(void *p) {
+	update_free(p);
+}
+
+// Writes the new validators next to the output, replacing the old ones only
+// once they are complete
+void update_finish(struct update *up) {
+	char tmp[strlen(up->path) + 8];
+	size_t k, ntiles = (size_t) up->ntx * up->nty;
+	FILE *fp;
+
+	sprintf(tmp, "%s.tmp", up->path);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		stitch_log(LOG_ERROR, "%s: %s\n", tmp, strerror(errno));
+		stitch_fail(STITCH_ERR_IO);
+	}
+	fputs(up->header, fp);
+	for (k = 0; k < ntiles * up->nlayers; k++) {
+		struct tile_state *ts = &up->tiles[k];
+
+		if (ts->next != NULL) {
+			fprintf(fp, "%d %u %u %s\n", (int) (k / ntiles), up->tx1 + (unsigned int) (k % up->ntx),
+				up->ty1 + (unsigned int) (k % ntiles / up->ntx), ts->next);
+		}
+	}
+	if (fclose(fp) != 0 || rename(tmp, up->path) != 0) {
+		stitch_log(LOG_ERROR, "%s: %s\n", up->path, strerror(errno));
+		stitch_fail(STITCH_ERR_IO);
+	}
+	update_free(up);
+}
+
+// Stitched outputs kept in a directory under a hash of everything that goes
+// into their bytes, so that a job asking for the same thing again gets a
+// copy of the file instead of fetching, compositing and encoding it. Next
+// to each output, a .key file holds the key itself, to tell hash collisions
+// apart, and with -V a .validators file holds the ETags of its tiles, which
+// are then asked for again before the output is reused.
+struct result {
+	char *path;         // of the output in the cache
+	char *keypath;
+	char *validators;
+	char *key;
+	char *teepath;      // of the copy of output that goes to a write callback
+	FILE *tee;
+};
+
+static void hash_bytes(unsigned long long *h, const void *p, size_t n) {
+	const unsigned char *cp = p;
+	size_t k;
+
+	for (k = 0; k < n; k++) {
+		*h = (*h ^ cp[k]) * 1099511628211ULL;
+	}
+}
+
+struct result *result_open(const struct job *job, const struct plan *pl, int grid) {
+	struct result *rs = calloc(1, sizeof(struct result));
+	unsigned long long h = 14695981039346656037ULL, mask = 0;
+	size_t len = strlen(job->results) + 40, keylen;
+	char sig[512];
+	int l;
+
+	if (rs == NULL || (rs->path = malloc(len)) == NULL || (rs->keypath = malloc(len)) == NULL || (rs->validators = malloc(len)) == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for the result cache\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+
+	if (job->mask != NULL) {
+		mask = h;
+		hash_bytes(&mask, job->mask->lon, job->mask->n * sizeof(double));
+		hash_bytes(&mask, job->mask->lat, job->mask->n * sizeof(double));
+		hash_bytes(&mask, job->mask->rings, (job->mask->nrings + 1) * sizeof(int));
+	}
+
+	// TIFFs are georeferenced from the box asked for, not the pixels
+	plan_signature("stitch-result", pl, grid, sig, sizeof sig);
+	keylen = strlen(sig) + 400;
+	for (l = 0; pl->urls[l] != NULL; l++) {
+		keylen += strlen(pl->urls[l]) + 64;
+	}
+	if ((rs->key = malloc(keylen)) == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for the result cache\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	snprintf(rs->key, keylen, "%sformat %d elevation %d encoding %d relief %d filter %d projection %d overzoom %d shard %d/%d mask %016llx",
+		sig, job->outfmt, job->elevation, job->encoding, job->relief, job->filter, job->projection, job->overzoom, job->shard, job->nshards, mask);
+	if (job->outfmt != OUTFMT_PNG) {
+		snprintf(rs->key + strlen(rs->key), keylen - strlen(rs->key), " georef %.17g %.17g %.17g %.17g", pl->left, pl->top, pl->px, pl->py);
+	}
+	strcat(rs->key, "\n");
+
+	// A local raster can change under the same name, so its version is in
+	// the key too
+	for (l = 0; pl->urls[l] != NULL; l++) {
+		strcat(rs->key, pl->urls[l]);
+		if (layer_raster(pl->urls[l])) {
+			struct stat st;
+
+			if (stat(pl->urls[l], &st) != 0) {
+				stitch_log(LOG_ERROR, "%s: %s\n", pl->urls[l], strerror(errno));
+				stitch_fail(STITCH_ERR_IO);
+			}
+			snprintf(rs->key + strlen(rs->key), keylen - strlen(rs->key), " %lld.%09ld %lld",
+				(long long) st.st_mtim.tv_sec, (long) st.st_mtim.tv_nsec, (long long) st.st_size);
+		}
+		strcat(rs->key, "\n");
+	}
+
+	hash_bytes(&h, rs->key, strlen(rs->key));
+	snprintf(rs->path, len, "%s/%016llx.%s", job->results, h, job->outfmt == OUTFMT_PNG ? "png" : "tif");
+	snprintf(rs->keypath, len, "%s/%016llx.key", job->results, h);
+	snprintf(rs->validators, len, "%s/%016llx.validators", job->results, h);
+
+	if (mkdir(job->results, 0755) != 0 && errno != EEXIST) {
+		stitch_log(LOG_ERROR, "%s: %s\n", job->results, strerror(errno));
+		stitch_fail(STITCH_ERR_IO);
+	}
+	return rs;
+}
+
+void result_free(struct result *rs) {
+	frame_drop(rs);
+	if (rs->tee != NULL) {
+		if (frame != NULL && frame->tee == rs->tee) {
+			frame->tee = NULL;
+		}
+		fclose(rs->tee);
+		unlink(rs->teepath);
+	}
+	free(rs->teepath);
+	free(rs->path);
+	free(rs->keypath);
+	free(rs->validators);
+	free(rs->key);
+	free(rs);
+}
+
+static void release_result(void *p) {
+	result_free(p);
+}
+
+// Whether the cache has the output of the key, without counting the lookup
+int result_present(const struct result *rs) {
+	struct data key = { NULL, 0, 0 };
+	struct stat st;
+	int hit;
+
+	if (access(rs->keypath, R_OK) != 0 || stat(rs->path, &st) != 0) {
+		return 0;
+	}
+	read_file(rs->keypath, &key);
+	hit = key.len == (int) strlen(rs->key) && !memcmp(key.buf, rs->key, key.len);
+	free(key.buf);
+	return hit;
+}
+
+// Whether the cache has the output of the key
+int result_hit(const struct result *rs) {
+	int hit = result_present(rs);
+
+	if (stats != NULL) {
+		stats_count(&stats->result_lookups, &stats->result_hits, hit);
+	}
+	return hit;
+}
+
+// Copies a file, or to the standard output if to is NULL. Where the
+// filesystem can, the copy is a reflink that shares the blocks of the file.
+static int copy_file(const char *from, const char *to) {
+	char buf[65536];
+	ssize_t n = 0;
+	int in = open(from, O_RDONLY), out;
+
+	if (in < 0) {
+		return -1;
+	}
+	out = to == NULL ? 1 : open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		close(in);
+		return -1;
+	}
+#ifdef FICLONE
+	if (to == NULL || ioctl(out, FICLONE, in) != 0)
+#endif
+	{
+		while ((n = read(in, buf, sizeof buf)) > 0) {
+			if (write(out, buf, n) != n) {
+				n = -1;
+				break;
+			}
+		}
+	}
+	close(in);
+	if (to != NULL && close(out) != 0) {
+		return -1;
+	}
+	return n < 0 ? -1 : 0;
+}
+
+// Sends a cached output to the frame's write callback
+static void result_stream(const struct result *rs) {
+	char buf[65536];
+	size_t n;
+	FILE *fp = fopen(rs->path, "rb");
+
+	if (fp == NULL) {
+		stitch_log(LOG_ERROR, "%s: %s\n", rs->path, strerror(errno));
+		stitch_fail(STITCH_ERR_IO);
+	}
+	frame_hold(fp, release_file);
+	while ((n = fread(buf, 1, sizeof buf, fp)) > 0) {
+		if (frame->write(frame->user, buf, n) != 0) {
+			stitch_log(LOG_ERROR, "Can't write the output\n");
+			stitch_fail(STITCH_ERR_IO);
+		}
+	}
+	if (ferror(fp)) {
+		stitch_log(LOG_ERROR, "%s: %s\n", rs->path, strerror(errno));
+		stitch_fail(STITCH_ERR_IO);
+	}
+	frame_drop(fp);
+	fclose(fp);
+}
+
+// Hands out the cached output as the job's, with its worldfile
+void result_serve(const struct job *job, const struct plan *pl, const struct result *rs) {
+	stitch_log(LOG_INFO, "==Result: %s\n", rs->path);
+	if (job->outfile == NULL && frame != NULL && frame->write != NULL) {
+		result_stream(rs);
+		return;
+	}
+	if (copy_file(rs->path, job->outfile) != 0) {
+		stitch_log(LOG_ERROR, "%s: %s\n", job->outfile != NULL ? job->outfile : rs->path, strerror(errno));
+		stitch_fail(STITCH_ERR_IO);
+	}
+	if (job->writeworldfile) {
+		write_worldfile(job->outfile, job->outfmt, pl->px, pl->py, pl->left, pl->top);
+	}
+}
+
+// Has what the job writes to the frame's write callback copied to a file in
+// the cache as well, since there is no output file to copy afterwards
+void result_tee(const struct job *job, struct result *rs) {
+	if (job->outfile != NULL || frame == NULL || frame->write == NULL) {
+		return;
+	}
+	if ((rs->teepath = malloc(strlen(rs->path) + 48)) == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for the result cache\n");
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	cache_tmp(rs->teepath, strlen(rs->path) + 48, rs->path);
+	if ((rs->tee = fopen(rs->teepath, "wb")) == NULL) {
+		stitch_log(LOG_ERROR, "%s: %s\n", rs->teepath, strerror(errno));
+		stitch_fail(STITCH_ERR_IO);
+	}
+	frame->tee = rs->tee;
+}
+
+// Keeps a copy of the job's output, unless some of its tiles failed. The
+// key is written last, so that an interrupted copy is never taken for a
+// result.
+void result_store(const struct job *job, struct result *rs) {
+	char tmp[strlen(rs->path) + 48];
+
+	// The output has gone to the write callback by now, so a copy that
+	// can't be kept only costs the next render
+	if (rs->tee != NULL) {
+		FILE *tee = rs->tee;
+		int failed = ferror(tee);
+
+		frame->tee = rs->tee = NULL;
+		failed |= fclose(tee) != 0;
+		if (tile_failed == 0 && (failed || rename(rs->teepath, rs->path) != 0)) {
+			stitch_log(LOG_ERROR, "%s: %s\n", rs->path, strerror(errno));
+			unlink(rs->teepath);
+			return;
+		}
+		if (tile_failed > 0) {
+			unlink(rs->teepath);
+		}
+	} else if (job->outfile == NULL) {
+		return;
+	}
+	if (tile_failed > 0) {
+		stitch_log(LOG_INFO, "==Result: not kept, %d tiles failed\n", tile_failed);
+		return;
+	}
+	if (job->outfile != NULL) {
+		cache_tmp(tmp, sizeof tmp, rs->path);
+		if (copy_file(job->outfile, tmp) != 0 || rename(tmp, rs->path) != 0) {
+			stitch_log(LOG_ERROR, "%s: %s\n", rs->path, strerror(errno));
+			stitch_fail(STITCH_ERR_IO);
+		}
+	}
+
+	FILE *fp;
+	cache_tmp(tmp, sizeof tmp, rs->keypath);
+	if ((fp = fopen(tmp, "w")) == NULL || fputs(rs->key, fp) < 0 || fclose(fp) != 0 || rename(tmp, rs->keypath) != 0) {
+		stitch_log(LOG_ERROR, "%s: %s\n", rs->keypath, strerror(errno));
+		stitch_fail(STITCH_ERR_IO);
+	}
+}
+
+// Writes the rows of an RGBA canvas, or the elevation grid, of a plan in the
+// format of the job, and its worldfile
+void write_output(const struct job *job, const char *outfile, const struct plan *pl, unsigned char **rows, float *grid) {
+	int outfmt = job->outfmt;
+	double start = timer_start();
+
+	if (outfmt == OUTFMT_PNG) {
+		write_png(outfile, rows, pl->width, pl->height, job->nshards > 0);
+	} else if (outfmt == OUTFMT_GEOTIFF) {
+		write_geotiff(outfile, rows, pl->width, pl->height, job->update != NULL, pl->projection, pl->px, pl->py, pl->left, pl->top);
+	} else if (outfmt == OUTFMT_GEOTIFF_FLOAT32) {
+#if GEOTIFF_FOUND
+		if (outfile != NULL) {
+			stitch_log(LOG_INFO, "Output float32 TIFF: %s\n", outfile);
+			write_geotiff_float32(outfile, grid, pl->width, pl->height, job->update != NULL, pl->projection, pl->px, pl->py, pl->left, pl->top);
+		} else {
+			stitch_log(LOG_ERROR, "Can't write TIFF to stdout, sorry\n");
+			stitch_fail(STITCH_ERR_UNSUPPORTED);
+		}
+#else
+		stitch_log(LOG_ERROR, "stitch was compiled without GeoTIFF support, sorry\n");
+		stitch_fail(STITCH_ERR_UNSUPPORTED);
+#endif
+	}
+
+	if (stats != NULL) {
+		struct stat st;
+
+		fflush(stdout);
+		stats_time(&stats->encode[outfmt], start);
+		if (outfile != NULL ? stat(outfile, &st) == 0 : fstat(1, &st) == 0 && S_ISREG(st.st_mode)) {
+			pthread_mutex_lock(&stats->lock);
+			stats->bytes_out += st.st_size;
+			pthread_mutex_unlock(&stats->lock);
+		}
+	}
+
+	//write world file
+	if (job->writeworldfile) {
+		write_worldfile(outfile, outfmt, pl->px, pl->py, pl->left, pl->top);
+	}
+}
+
+// The output file name of a zoom level, with the {z} token filled in
+char *zoom_outfile(const char *outfile, int zoom) {
+	const char *z = strstr(outfile, "{z}");
+	char *out = malloc(strlen(outfile) + 12);
+
+	if (out == NULL) {
+		stitch_log(LOG_ERROR, "Can't allocate memory for %s\n", outfile);
+		stitch_fail(STITCH_ERR_MEMORY);
+	}
+	sprintf(out, "%.*s%d%s", (int) (z - outfile), outfile, zoom, z + 3);
+	return out;
+}
+
+// Halves an RGBA canvas into the one of the zoom level above. Its pixel x, y
+// covers the source pixels 2x - ox and 2y - oy and the ones after them, where
+// ox and oy are 1 if the source starts at an odd global pixel. Colors are
+// averaged weighted by alpha, over the source pixels that are inside.
+void reduce_rgba(const unsigned char *src, int sw, int sh, int ox, int oy, unsigned char *dst, int dw, int dh) {
+	int x, y, dy, dx;
+
+	for (y = 0; y < dh; y++) {
+		unsigned char *out = dst + (size_t) y * dw * 4;
+
+		for (x = 0; x < dw; x++) {
+			unsigned int sum[3] = { 0, 0, 0 }, alpha = 0, n = 0;
+			int c;
+
+			for (dy = 0; dy < 2; dy++) {
+				int sy = 2 * y - oy + dy;
+
+				if (sy < 0 || sy >= sh) {
+					continue;
+				}
+				for (dx = 0; dx < 2; dx++) {
+					int sx = 2 * x - ox + dx;
+
+					if (sx >= 0 && sx < sw) {
+						const unsigned char *p = src + ((size_t) sy * sw + sx) * 4;
+
+						for (c = 0; c < 3; c++) {
+							sum[c] += p[c] * p[3];
+						}
+						alpha += p[3];
+						n++;
+					}
+				}
+			}
+
+			for (c = 0; c < 3; c++) {
+				out[x * 4 + c] = alpha > 0 ? (sum[c] + alpha / 2) / alpha : 0;
+			}
+			out[x * 4 + 3] = n > 0 ? (alpha + n / 2) / n : 0;
+		}
+	}
+}
+
+// The same for elevations, averaging the ones that aren't nodata
+void reduce_elevation(const float *src, int sw, int sh, int ox, int oy, float *dst, int dw, int dh) {
+	int x, y, dy, dx;
+
+	for (y = 0; y < dh; y++) {
+		float *out = dst + (size_t) y * dw;
+
+		for (x = 0; x < dw; x++) {
+			double sum = 0;
+			int n = 0;
+
+			for (dy = 0; dy < 2; dy++) {
+				int sy = 2 * y - oy + dy;
+
+				if (sy < 0 || sy >= sh) {
+					continue;
+				}
+				for (dx = 0; dx < 2; dx++) {
+					int sx = 2 * x - ox + dx;
+
+					if (sx >= 0 && sx < sw && src[(size_t) sy * sw + sx] != ELEVATION_NODATA) {
+						sum += src[(size_t) sy * sw + sx];
+						n++;
+					}
+				}
+			}
+			out[x] = n > 0 ? sum / n : ELEVATION_NODATA;
+		}
+	}
+}
+
+// Writes the job's area at its zoom and each one above it up to minzoom,
+// each reduced from the canvas of the zoom below instead of fetched. The
+// next canvas is reduced before the current one is written, since the TIFF
+// predictors encode the rows they are given in place.
+void write_zoom_range(const struct job *job, const struct plan *pl, unsigned char *buf, float *grid) {
+	struct plan lp = *pl;
+	void *canvas = buf != NULL ? (void *) buf : (void *) grid;
+	void *owned = NULL;
+	unsigned long long sx = tile_pixel(pl->x1, pl->zoom, pl->tilesize);
+	unsigned long long sy = tile_pixel(pl->y1, pl->zoom, pl->tilesize);
+	int zoom, y;
+
+	for (zoom = job->zoom; zoom >= job->minzoom; zoom--) {
+		struct plan np = *pl;
+		void *next = NULL;
+		unsigned char **rows = NULL;
+
+		if (zoom > job->minzoom) {
+			// The same corners a zoom up, which start at half the pixel
+			// they did at this one
+			plan_window(&np, zoom - 1, job->tilesize);
+			np.width = np.src_width;
+			np.height = np.src_height;
+			if (np.width <= 0 || np.height <= 0) {
+				stitch_log(LOG_ERROR, "Area is empty at zoom %d\n", zoom - 1);
+				stitch_fail(STITCH_ERR_ARGS);
+			}
+			np.px = (np.maxx - np.minx) / np.width;
+			np.py = fabs(np.maxy - np.miny) / np.height;
+
+			next = malloc((size_t) np.width * np.height * 4);
+			if (next == NULL) {
+				stitch_log(LOG_ERROR, "Can't allocate memory for %lld\n", (long long) np.width * np.height * 4);
+				stitch_fail(STITCH_ERR_MEMORY);
+			}
+			frame_hold(next, free);
+			if (grid != NULL) {
+				reduce_elevation(canvas, lp.width, lp.height, sx & 1, sy & 1, next, np.width, np.height);
+			} else {
+				reduce_rgba(canvas, lp.width, lp.height, sx & 1, sy & 1, next, np.width, np.height);
+			}
+		}
+
+		if (buf != NULL) {
+			rows = malloc((lp.height + 1) * sizeof(unsigned char *));
+			if (rows == NULL) {
+				stitch_log(LOG_ERROR, "Can't allocate memory for %d rows\n", lp.height);
+				stitch_fail(STITCH_ERR_MEMORY);
+			}
+			frame_hold(rows, free);
+			for (y = 0; y < lp.height; y++) {
+				rows[y] = (unsigned char *) canvas + (size_t) y * (4 * lp.width);
+			}
+		}
+
+		char *outfile = zoom_outfile(job->outfile, zoom);
+		frame_hold(outfile, free);
+		if (zoom < job->zoom) {
+			stitch_log(LOG_INFO, "==Zoom %d: %ux%u reduced from zoom %d\n", zoom, lp.width, lp.height, zoom + 1);
+		}
+		write_output(job, outfile, &lp, rows, grid != NULL ? canvas : NULL);
+		frame_free(outfile);
+		frame_free(rows);
+
+		frame_free(owned);
+		owned = canvas = next;
+		lp = np;
+		sx >>= 1;
+		sy >>= 1;
+	}
+}
+
+void run_job(const struct job *job) {
+	struct plan pl;
+	int x, y, i;
+	unsigned long long int offset;
+	int batched = job->cache != NULL;  // whose progress the batch counts
+
+	tile_failed = 0;
+	plan_job(job, &pl);
+	frame_hold(&pl, release_plan);
+
+	int zoom = pl.zoom;
+	int tilesize = pl.tilesize;
+	int outfmt = job->outfmt;
+	relief_t relief = job->relief;
+	int width = pl.width, height = pl.height;
+	double px = pl.px, py = pl.py;
+	double maxy = pl.top;
+
+	elevation_encoding_t encoding = job->encoding;
+	if (encoding == ELEVATION_DEFAULT) {
+		encoding = layers_elevation_encoding((char **) job->layers, job->nlayers);
+	}
+	const struct elevation_decoder *decoder = get_elevation_decoder(encoding);
+
+	stitch_log(LOG_INFO, "==Geodetic Bounds  (EPSG:4236): %.17g,%.17g to %.17g,%.17g\n", pl.minlat, pl.minlon, pl.maxlat, pl.maxlon);
+	stitch_log(LOG_INFO, "==Projected Bounds (EPSG:3785): %.17g,%.17g to %.17g,%.17g\n", pl.miny, pl.minx, pl.maxy, pl.maxx);
+	stitch_log(LOG_INFO, "==Zoom Level: %u\n", zoom);
+	if (pl.retina) {
+		stitch_log(LOG_INFO, "==Retina Tiles: %dx%d\n", tilesize, tilesize);
+	}
+	stitch_log(LOG_INFO, "==Upper Left Tile: x:%u y:%u\n", pl.tx1, pl.ty2);
+	stitch_log(LOG_INFO, "==Lower Right Tile: x:%u y:%u\n", pl.tx2, pl.ty1);
+	if (pl.resample) {
+		stitch_log(LOG_INFO, "==Resampled from: %ux%u\n", pl.src_width, pl.src_height);
+	}
+	if (job->nshards > 0) {
+		stitch_log(LOG_INFO, "==Shard %d/%d: rows %d to %d of %d\n", job->shard, job->nshards, pl.row0, pl.row0 + height - 1, pl.full_height);
+	}
+	stitch_log(LOG_INFO, "==Raster Size: %ux%u\n", width, height);
+	stitch_log(LOG_INFO, "==Pixel Size: x:%.17g y:%.17g\n", px, py);
 
 	long long dim = (long long) width * height;
 	if (dim > 10000 * 10000) {
-		fprintf(stderr, "that's too big\n");
-		exit(EXIT_FAILURE);
+		stitch_log(LOG_ERROR, "that's too big\n");
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+
+	// Coarser zooms are reduced from this one's canvas, which only lines up
+	// with theirs when it is the area at its native resolution
+	if (job->minzoom >= 0) {
+		if (job->minzoom > job->zoom) {
+			stitch_log(LOG_ERROR, "Zoom range %d-%d is empty\n", job->minzoom, job->zoom);
+			stitch_fail(STITCH_ERR_ARGS);
+		}
+		if (job->outfile == NULL || strstr(job->outfile, "{z}") == NULL) {
+			stitch_log(LOG_ERROR, "A zoom range needs an output file name with a {z} token\n");
+			stitch_fail(STITCH_ERR_ARGS);
+		}
+		if (pl.resample || relief != RELIEF_NONE || job->elevation || job->nshards > 0 || job->update != NULL) {
+			stitch_log(LOG_ERROR, "Can't reduce resampled, relief, elevation, sharded or updated output to other zooms\n");
+			stitch_fail(STITCH_ERR_ARGS);
+		}
+	}
+
+	unsigned char *buf = NULL;
+	float *grid = NULL;
+	int use_grid = job_grid(job, &pl);
+	struct journal *jr = NULL;
+	struct update *up = NULL;
+	struct result *rs = NULL;
+	struct job full;
+
+	// A cached output of the same job is copied instead of rendered. With
+	// -V, only once none of its tiles have changed; otherwise it is
+	// rendered again from the tiles just fetched.
+	if (job->revalidate && job->results == NULL) {
+		stitch_log(LOG_ERROR, "Revalidating needs a result cache\n");
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+	if (job->results != NULL) {
+		if (job->minzoom >= 0 || job->update != NULL) {
+			stitch_log(LOG_ERROR, "Can't cache zoom ranges or updated output\n");
+			stitch_fail(STITCH_ERR_ARGS);
+		}
+		rs = result_open(job, &pl, use_grid);
+		frame_hold(rs, release_result);
+
+		if (job->revalidate) {
+			for (i = 0; i < job->nlayers; i++) {
+				if (layer_getmap(pl.urls[i]) || layer_raster(pl.urls[i])) {
+					stitch_log(LOG_ERROR, "Can't revalidate the tiles of a WMS or raster layer\n");
+					stitch_fail(STITCH_ERR_ARGS);
+				}
+			}
+			up = update_open(rs->validators, rs->path, &pl, job->nlayers, use_grid);
+			frame_hold(up, release_update);
+			update_revalidate(up, &pl, default_thread_count() * 4);
+			if (up->known) {
+				stitch_log(LOG_INFO, "==Result: %d of %d tiles changed\n", up->nchanged, up->ntx * up->nty * up->nlayers);
+			}
+		}
+
+		if (result_hit(rs) && (up == NULL || (up->known && up->nchanged == 0))) {
+			result_serve(job, &pl, rs);
+			if (up != NULL) {
+				update_free(up);
+			}
+			result_free(rs);
+			plan_free(&pl);
+			return;
+		}
+
+		if (up != NULL) {
+			full = *job;
+			full.cache = update_cache(up, &pl);
+			frame_hold(full.cache, release_tile_cache);
+			job = &full;
+		}
+	}
+
+	// An update asks for the tiles again and only composites the blocks
+	// under the ones that changed. Without validators that fit, it renders
+	// everything from the tiles it just fetched, into a tiled TIFF.
+	if (job->update != NULL) {
+		if (outfmt != OUTFMT_GEOTIFF && outfmt != OUTFMT_GEOTIFF_FLOAT32) {
+			stitch_log(LOG_ERROR, "Only GeoTIFF output can be updated in place\n");
+			stitch_fail(STITCH_ERR_ARGS);
+		}
+		if (pl.resample || relief != RELIEF_NONE || job->elevation || job->mask != NULL || job->overzoom > 0 ||
+		    job->nshards > 0 || job->journal != NULL) {
+			stitch_log(LOG_ERROR, "Can't update resampled, relief, elevation, masked, overzoomed, sharded or journaled output in place\n");
+			stitch_fail(STITCH_ERR_ARGS);
+		}
+		for (i = 0; i < job->nlayers; i++) {
+			if (layer_getmap(pl.urls[i]) || layer_raster(pl.urls[i])) {
+				stitch_log(LOG_ERROR, "Can't update the tiles of a WMS or raster layer in place\n");
+				stitch_fail(STITCH_ERR_ARGS);
+			}
+		}
+
+		up = update_open(job->update, job->outfile, &pl, job->nlayers, use_grid);
+		frame_hold(up, release_update);
+		update_revalidate(up, &pl, default_thread_count() * 4);
+		stitch_log(LOG_INFO, "==Update: %d of %d tiles changed\n", up->nchanged, up->ntx * up->nty * up->nlayers);
+
+		if (up->known) {
+#if GEOTIFF_FOUND
+			if (up->nchanged > 0) {
+				update_blocks(job, &pl, up, decoder, use_grid);
+			}
+			update_finish(up);
+			plan_free(&pl);
+			return;
+#else
+			stitch_log(LOG_ERROR, "stitch was compiled without GeoTIFF support, sorry\n");
+			stitch_fail(STITCH_ERR_UNSUPPORTED);
+#endif
+		}
+
+		full = *job;
+		full.cache = update_cache(up, &pl);
+		frame_hold(full.cache, release_tile_cache);
+		job = &full;
+	}
+
+	// A journaled job keeps its canvas in a file, which may already have
+	// some of the tiles
+	if (job->journal != NULL) {
+		if (pl.resample) {
+			stitch_log(LOG_ERROR, "Can't journal resampled output\n");
+			stitch_fail(STITCH_ERR_ARGS);
+		}
+		jr = journal_open(job, &pl, use_grid, dim * 4);
+		frame_hold(jr, release_journal);
+		if (jr->ndone > 0) {
+			stitch_log(LOG_INFO, "==Resuming: %d of %d tiles done\n", jr->ndone, jr->ntiles);
+		}
+	}
+
+	if (use_grid) {
+		grid = jr != NULL ? jr->canvas : malloc(dim * sizeof(float));
+		if (grid == NULL) {
+			stitch_log(LOG_ERROR, "Can't allocate memory for %lld\n", dim * (long long) sizeof(float));
+			stitch_fail(STITCH_ERR_MEMORY);
+		}
+		if (jr == NULL) {
+			frame_hold(grid, free);
+		}
+		for (offset = 0; offset < dim && (jr == NULL || jr->ndone == 0); offset++) {
+			grid[offset] = ELEVATION_NODATA;
+		}
+	} else {
+		buf = jr != NULL ? jr->canvas : malloc(dim * 4);
+		if (buf == NULL) {
+			stitch_log(LOG_ERROR, "Can't allocate memory for %lld\n", dim * 4);
+			stitch_fail(STITCH_ERR_MEMORY);
+		}
+		if (jr == NULL) {
+			frame_hold(buf, free);
+		}
+		if (jr == NULL || jr->ndone == 0) {
+			memset(buf, '\0', dim * 4);
+		}
+	}
+
+	// Only tiles that draw inside the mask are fetched
+	unsigned char *mask = NULL, *tiles = NULL;
+
+	if (job->mask != NULL) {
+		int ntiles = (pl.tx2 - pl.tx1 + 1) * (pl.ty2 - pl.ty1 + 1), used = 0;
+
+		mask = rasterize_polygon(job->mask, &pl);
+		frame_hold(mask, free);
+		tiles = plan_tile_mask(job, &pl, mask);
+		frame_hold(tiles, free);
+		for (i = 0; i < ntiles; i++) {
+			used += tiles[i];
+		}
+		stitch_log(LOG_INFO, "==Mask: %d of %d tiles\n", used, ntiles);
+	}
+
+	struct overzoom oz = { job->overzoom, NULL, 0, 0 };
+	struct getmap gm;
+	struct raster **rasters = rasters_open(job, &pl);
+
+	frame_hold(&oz, release_overzoom);
+	getmap_init(&gm, job, &pl);
+	frame_hold(&gm, release_getmap);
+
+	// The progress is in the tiles that are fetched, not read from a raster
+	// or cut from a GetMap window
+	if (!batched) {
+		unsigned int tx, ty;
+		long ntiles = 0;
+		int nfetched = 0;
+
+		for (i = 0; i < job->nlayers; i++) {
+			nfetched += (rasters == NULL || rasters[i] == NULL) && (gm.windows == NULL || !layer_getmap(pl.urls[i]));
+		}
+		for (tx = pl.tx1; tx <= pl.tx2; tx++) {
+			for (ty = pl.ty1; ty <= pl.ty2; ty++) {
+				if ((tiles == NULL || tiles[(ty - pl.ty1) * (pl.tx2 - pl.tx1 + 1) + (tx - pl.tx1)]) &&
+				    (jr == NULL || !journal_done(jr, &pl, tx, ty))) {
+					ntiles += nfetched;
+				}
+			}
+		}
+		progress_begin("tiles", ntiles);
+	}
+
+	if (pl.resample) {
+		resample_tiles(job, &pl, decoder, tiles, &oz, &gm, rasters, buf, grid);
+	} else {
+		unsigned int tx, ty;
+		for (tx = pl.tx1; tx <= pl.tx2; tx++) {
+			for (ty = pl.ty1; ty <= pl.ty2; ty++) {
+				int xoff = (tx - pl.tx1) * tilesize - pl.xa;
+				int yoff = (ty - pl.ty1) * tilesize - pl.ya;
+
+				if (tiles != NULL && !tiles[(ty - pl.ty1) * (pl.tx2 - pl.tx1 + 1) + (tx - pl.tx1)]) {
+					continue;
+				}
+				if (jr != NULL && journal_done(jr, &pl, tx, ty)) {
+					continue;
+				}
+				frame_check();
+
+				int l, got = 0;
+				if (jr != NULL) {
+					journal_clear(jr, grid != NULL, width, height, tilesize, xoff, yoff);
+				}
+				for (l = 0; l < job->nlayers; l++) {
+					struct image *i = fetch_layer_tile(job, &pl, &oz, &gm, rasters, l, tx, ty);
+
+					if (i == NULL) {
+						continue;
+					}
+					got++;
+
+					if (i->height != tilesize || i->width != tilesize) {
+						stitch_log(LOG_ERROR, "Got %dx%d tile, not %d\n", i->width, i->height, tilesize);
+						free_image(i);
+						stitch_fail(STITCH_ERR_DECODE);
+					}
+
+					if (grid != NULL) {
+						blit_elevation(decoder, grid, width, height, i, xoff, yoff);
+					} else {
+						blit_rgba(buf, width, height, i, xoff, yoff);
+					}
+
+					free_image(i);
+				}
+
+				// A tile with no layer is fetched again on a rerun
+				if (jr != NULL && got > 0) {
+					journal_add(jr, tx, ty);
+				}
+			}
+		}
+	}
+
+	if (jr != NULL) {
+		journal_checkpoint(jr);
+
+		// Relief and -e rewrite the pixels in place, which must not reach
+		// the canvas in case they are interrupted
+		if (relief != RELIEF_NONE || job->elevation) {
+			void *copy = malloc(dim * 4);
+			if (copy == NULL) {
+				stitch_log(LOG_ERROR, "Can't allocate memory for %lld\n", dim * 4);
+				stitch_fail(STITCH_ERR_MEMORY);
+			}
+			frame_hold(copy, free);
+			memcpy(copy, jr->canvas, dim * 4);
+			if (grid != NULL) {
+				grid = copy;
+			} else {
+				buf = copy;
+			}
+		}
+	}
+
+	if (!batched) {
+		progress_end();
+	}
+
+	if (oz.filled > 0 || oz.fetched > 0) {
+		stitch_log(LOG_INFO, "==Overzoom: %d missing tiles filled from %d ancestors\n", oz.filled, oz.fetched);
+	}
+	overzoom_free(&oz);
+	if (gm.requests > 0) {
+		stitch_log(LOG_INFO, "==GetMap: %d requests for %d tiles\n", gm.requests, (pl.tx2 - pl.tx1 + 1) * (pl.ty2 - pl.ty1 + 1));
+	}
+	getmap_free(&gm);
+	rasters_close(rasters, job->nlayers);
+
+	// Pixels outside the mask become transparent, or nodata
+	if (mask != NULL) {
+		for (offset = 0; offset < dim; offset++) {
+			if (!mask[offset]) {
+				if (grid != NULL) {
+					grid[offset] = ELEVATION_NODATA;
+				} else {
+					memset(buf + offset * 4, 0, 4);
+				}
+			}
+		}
+		frame_free(mask);
+		frame_free(tiles);
+	}
+
+	struct elevation_stats gst = { 0 };
+	if (grid != NULL) {
+		elevation_stats_add(&gst, grid, dim);
+		print_elevation_stats(&gst);
+	}
+
+	if (relief != RELIEF_NONE) {
+		apply_relief(relief, grid, width, height, pl.projection, px, py, maxy);
+
+		// Other than float32, relief is written as gray levels, with slope
+		// scaled from 0-90 degrees
+		if (outfmt != OUTFMT_GEOTIFF_FLOAT32) {
+			double scale = relief == RELIEF_SLOPE ? 255.0 / 90 : 1;
+
+			buf = malloc(dim * 4);
+			if (buf == NULL) {
+				stitch_log(LOG_ERROR, "Can't allocate memory for %lld\n", dim * 4);
+				stitch_fail(STITCH_ERR_MEMORY);
+			}
+			frame_hold(buf, free);
+
+			for (offset = 0; offset < dim; offset++) {
+				unsigned char *p = buf + offset * 4;
+				if (grid[offset] == ELEVATION_NODATA) {
+					p[0] = p[1] = p[2] = p[3] = 0;
+				} else {
+					p[0] = p[1] = p[2] = round(grid[offset] * scale);
+					p[3] = 255;
+				}
+			}
+
+			if (jr == NULL || grid != jr->canvas) {
+				frame_free(grid);
+			}
+			grid = NULL;
+		}
+	}
+
+	// Resampled -e output was decoded before filtering, and is scaled to
+	// gray levels from the grid
+	if (job->elevation && relief == RELIEF_NONE && grid != NULL && outfmt != OUTFMT_GEOTIFF_FLOAT32) {
+		double ratio = gst.max > gst.min ? 255.0 / (gst.max - gst.min) : 1;
+
+		stitch_log(LOG_INFO, "==Midpoint in [0; 1] range: %.4f\n", (gst.avg - gst.min) * ratio / 255);
+
+		buf = malloc(dim * 4);
+		if (buf == NULL) {
+			stitch_log(LOG_ERROR, "Can't allocate memory for %lld\n", dim * 4);
+			stitch_fail(STITCH_ERR_MEMORY);
+		}
+		frame_hold(buf, free);
+		for (offset = 0; offset < dim; offset++) {
+			unsigned char *p = buf + offset * 4;
+			if (grid[offset] == ELEVATION_NODATA) {
+				p[0] = p[1] = p[2] = p[3] = 0;
+			} else {
+				p[0] = p[1] = p[2] = round((grid[offset] - gst.min) * ratio);
+				p[3] = 255;
+			}
+		}
+
+		if (jr == NULL || grid != jr->canvas) {
+			frame_free(grid);
+		}
+		grid = NULL;
+	}
+
+	unsigned char **rows = NULL;
+	if (buf != NULL) {
+		rows = malloc((height + 1) * sizeof(unsigned char *));
+		if (rows == NULL) {
+			stitch_log(LOG_ERROR, "Can't allocate memory for %d rows\n", height);
+			stitch_fail(STITCH_ERR_MEMORY);
+		}
+		frame_hold(rows, free);
+		for (i = 0; i < height; i++) {
+			rows[i] = buf + (size_t) i * (4 * width);
+		}
+	}
+
+	if (job->elevation && relief == RELIEF_NONE && !use_grid) {
+		struct elevation_stats st = { 0 };
+		float *row = malloc((width + 1) * sizeof(float));
+		double ratio;
+
+		if (row == NULL) {
+			stitch_log(LOG_ERROR, "Can't allocate memory for %d\n", width);
+			stitch_fail(STITCH_ERR_MEMORY);
+		}
+		frame_hold(row, free);
+
+		for (y = 0; y < height; y++) {
+			for (x = 0; x < width; x++) {
+				row[x] = ELEVATION_NODATA;
+			}
+			decoder->rgba(rows[y], row, width);
+			elevation_stats_add(&st, row, width);
+		}
+
+		print_elevation_stats(&st);
+
+		if (st.max > st.min) {
+			ratio = 255.0 / (st.max - st.min);
+		} else {
+			ratio = 1;
+		}
+
+		stitch_log(LOG_INFO, "==Midpoint in [0; 1] range: %.4f\n", (st.avg - st.min) * ratio / 255);
+
+		for (y = 0; y < height; y++) {
+			for (x = 0; x < width; x++) {
+				row[x] = ELEVATION_NODATA;
+			}
+			decoder->rgba(rows[y], row, width);
+
+			for (x = 0, offset = 0; x < width; x++, offset += 4) {
+				rows[y][offset] = rows[y][offset + 1] = rows[y][offset + 2] =
+					row[x] == ELEVATION_NODATA ? 0 : round((row[x] - st.min) * ratio);
+			}
+		}
+
+		frame_free(row);
+	}
+
+	if (job->minzoom >= 0) {
+		write_zoom_range(job, &pl, buf, grid);
+	} else {
+		if (rs != NULL) {
+			result_tee(job, rs);
+		}
+		write_output(job, job->outfile, &pl, rows, grid);
+	}
+
+	if (rs != NULL) {
+		result_store(job, rs);
+		result_free(rs);
+	}
+	if (up != NULL) {
+		tile_cache_free(job->cache);
+		update_finish(up);
+	}
+
+	if (jr != NULL) {
+		if (buf == jr->canvas) {
+			buf = NULL;
+		}
+		if (grid == jr->canvas) {
+			grid = NULL;
+		}
+		journal_finish(jr);
+	}
+
+	frame_free(rows);
+	frame_free(buf);
+	frame_free(grid);
+	plan_free(&pl);
+}
+
+// Minimal JSON reader for the flat objects of a job file
+static void json_ws(const char **p) {
+	while (**p == ' ' || **p == '\t' || **p == '\r' || **p == '\n') {
+		(*p)++;
+	}
+}
+
+static char *json_string(const char **p) {
+	const char *cp = *p;
+	char *out, *o;
+
+	json_ws(&cp);
+	if (*cp != '"') {
+		return NULL;
+	}
+	cp++;
+
+	out = o = malloc(strlen(cp) + 1);
+	if (out == NULL) {
+		return NULL;
+	}
+
+	while (*cp && *cp != '"') {
+		if (*cp == '\\') {
+			cp++;
+			switch (*cp) {
+			case 'n':
+				*o++ = '\n';
+				break;
+			case 't':
+				*o++ = '\t';
+				break;
+			case 'r':
+				*o++ = '\r';
+				break;
+			case 'b':
+				*o++ = '\b';
+				break;
+			case 'f':
+				*o++ = '\f';
+				break;
+			case 'u': {
+				unsigned int c;
+				if (sscanf(cp + 1, "%4x", &c) != 1 || c > 0x7F) {
+					free(out);
+					return NULL;
+				}
+				*o++ = c;
+				cp += 4;
+				break;
+			}
+			case '\0':
+				free(out);
+				return NULL;
+			default:
+				*o++ = *cp;
+				break;
+			}
+			cp++;
+		} else {
+			*o++ = *cp++;
+		}
+	}
+
+	if (*cp != '"') {
+		free(out);
+		return NULL;
+	}
+	*o = '\0';
+	*p = cp + 1;
+	return out;
+}
+
+static int json_number(const char **p, double *out) {
+	char *end;
+
+	json_ws(p);
+	*out = strtod(*p, &end);
+	if (end == *p) {
+		return -1;
+	}
+	*p = end;
+	return 0;
+}
+
+static int json_bool(const char **p, int *out) {
+	json_ws(p);
+	if (strncmp(*p, "true", 4) == 0) {
+		*out = 1;
+		*p += 4;
+	} else if (strncmp(*p, "false", 5) == 0) {
+		*out = 0;
+		*p += 5;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+// Reads an array of exactly n numbers
+static int json_numbers(const char **p, double *out, int n) {
+	int k;
+
+	json_ws(p);
+	if (**p != '[') {
+		return -1;
+	}
+	(*p)++;
+
+	for (k = 0; k < n; k++) {
+		if (k > 0) {
+			json_ws(p);
+			if (**p != ',') {
+				return -1;
+			}
+			(*p)++;
+		}
+		if (json_number(p, &out[k]) < 0) {
+			return -1;
+		}
+	}
+
+	json_ws(p);
+	if (**p != ']') {
+		return -1;
+	}
+	(*p)++;
+	return 0;
+}
+
+// Reads a string or an array of strings; returns how many
+static int json_strings(const char **p, const char ***out) {
+	const char **list = NULL;
+	int n = 0;
+	char *str;
+
+	json_ws(p);
+	if (**p == '"') {
+		if ((str = json_string(p)) == NULL) {
+			return -1;
+		}
+		*out = malloc(sizeof(char *));
+		(*out)[0] = str;
+		return 1;
+	}
+
+	if (**p != '[') {
+		return -1;
+	}
+	(*p)++;
+
+	json_ws(p);
+	while (**p != ']') {
+		if (n > 0) {
+			if (**p != ',') {
+				return -1;
+			}
+			(*p)++;
+		}
+		if ((str = json_string(p)) == NULL) {
+			return -1;
+		}
+		list = realloc(list, (n + 1) * sizeof(char *));
+		list[n++] = str;
+		json_ws(p);
+	}
+	(*p)++;
+
+	*out = list;
+	return n;
+}
+
+// Collects the rings of nested GeoJSON coordinate arrays: an array of
+// positions is a ring, whatever the depth. Returns 1 for a position, 0 for
+// an array of arrays and -1 on a syntax error.
+static int geojson_coordinates(const char **p, struct polygon *poly) {
+	int positions = 0, n = 0;
+
+	json_ws(p);
+	if (**p != '[') {
+		return -1;
+	}
+	(*p)++;
+
+	json_ws(p);
+	if (**p == '-' || (**p >= '0' && **p <= '9')) {
+		double v[2];
+		int k;
+
+		for (k = 0; **p != ']'; k++) {
+			double d;
+
+			if (k > 0) {
+				if (**p != ',') {
+					return -1;
+				}
+				(*p)++;
+			}
+			if (json_number(p, &d) < 0) {
+				return -1;
+			}
+			if (k < 2) {
+				v[k] = d;
+			}
+			json_ws(p);
+		}
+		(*p)++;
+		if (k < 2) {
+			return -1;
+		}
+		polygon_add(poly, v[0], v[1]);
+		return 1;
+	}
+
+	while (**p != ']') {
+		int r;
+
+		if (n++ > 0) {
+			if (**p != ',') {
+				return -1;
+			}
+			(*p)++;
+		}
+		if ((r = geojson_coordinates(p, poly)) < 0) {
+			return -1;
+		}
+		positions += r;
+		json_ws(p);
+	}
+	(*p)++;
+
+	if (positions > 0) {
+		polygon_close_ring(poly);
+	}
+	return 0;
+}
+
+// Skips a string, leaving where its contents start in *s and their length
+// in *len, escapes and all
+static int geojson_raw_string(const char **p, const char **s, size_t *len) {
+	json_ws(p);
+	if (**p != '"') {
+		return -1;
+	}
+	*s = ++(*p);
+	while (**p != '"') {
+		if (**p == '\\' && (*p)[1] != '\0') {
+			(*p)++;
+		} else if (**p == '\0') {
+			return -1;
+		}
+		(*p)++;
+	}
+	*len = (*p)++ - *s;
+	return 0;
+}
+
+// Walks a GeoJSON value, adding the rings of every Polygon and MultiPolygon
+// geometry in it. Points and lines have coordinates too, which are skipped.
+static int geojson_value(const char **p, struct polygon *poly) {
+	const char *s;
+	size_t len;
+	double d;
+
+	json_ws(p);
+	if (**p == '{') {
+		const char *type = "", *coordinates = NULL;
+		size_t typelen = 0;
+
+		(*p)++;
+		json_ws(p);
+		if (**p == '}') {
+			(*p)++;
+			return 0;
+		}
+		for (;;) {
+			if (geojson_raw_string(p, &s, &len) < 0) {
+				return -1;
+			}
+			json_ws(p);
+			if (**p != ':') {
+				return -1;
+			}
+			(*p)++;
+			json_ws(p);
+
+			if (len == 4 && !strncmp(s, "type", 4) && **p == '"') {
+				if (geojson_raw_string(p, &type, &typelen) < 0) {
+					return -1;
+				}
+			} else {
+				if (len == 11 && !strncmp(s, "coordinates", 11)) {
+					coordinates = *p;
+				}
+				if (geojson_value(p, poly) < 0) {
+					return -1;
+				}
+			}
+
+			json_ws(p);
+			if (**p == '}') {
+				(*p)++;
+				break;
+			}
+			if (**p != ',') {
+				return -1;
+			}
+			(*p)++;
+		}
+
+		if (coordinates != NULL && ((typelen == 7 && !strncmp(type, "Polygon", 7)) || (typelen == 12 && !strncmp(type, "MultiPolygon", 12)))) {
+			if (geojson_coordinates(&coordinates, poly) < 0) {
+				*p = coordinates;
+				return -1;
+			}
+		}
+		return 0;
+	} else if (**p == '[') {
+		(*p)++;
+		json_ws(p);
+		if (**p == ']') {
+			(*p)++;
+			return 0;
+		}
+		for (;;) {
+			if (geojson_value(p, poly) < 0) {
+				return -1;
+			}
+			json_ws(p);
+			if (**p == ']') {
+				(*p)++;
+				return 0;
+			}
+			if (**p != ',') {
+				return -1;
+			}
+			(*p)++;
+		}
+	} else if (**p == '"') {
+		return geojson_raw_string(p, &s, &len);
+	} else if (!strncmp(*p, "true", 4) || !strncmp(*p, "null", 4)) {
+		*p += 4;
+		return 0;
+	} else if (!strncmp(*p, "false", 5)) {
+		*p += 5;
+		return 0;
+	}
+	return json_number(p, &d);
+}
+
+// Reads the polygons of a GeoJSON geometry, feature or feature collection
+struct polygon *read_geojson_polygon(const char *fname) {
+	struct data text = { NULL, 0, 0 };
+	struct polygon *poly = calloc(1, sizeof(struct polygon));
+	const char *p;
+	char nul = '\0';
+
+	read_file(fname, &text);
+	curl_receive(&nul, 1, 1, &text);
+
+	p = text.buf;
+	if (geojson_value(&p, poly) < 0) {
+		stitch_log(LOG_ERROR, "%s: can't parse GeoJSON near byte %ld\n", fname, (long) (p - text.buf));
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+	free(text.buf);
+
+	if (poly->nrings == 0) {
+		stitch_log(LOG_ERROR, "%s: no polygons found\n", fname);
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+	return poly;
+}
+
+// Parses one line of a job file, e.g.
+// {"bbox": [37.7, -122.5, 37.8, -122.4], "zoom": 12, "layers": ["osm"], "output": "sf.png"}
+// {"center": [35.68, 139.75], "size": [640, 480], "zoom": 10, "layers": "osm", "output": "tokyo.png"}
+// Settings a line doesn't mention keep the values from the command line.
+// Returns NULL on success or a description of the problem.
+const char *parse_job(const char *line, struct job *job) {
+	const char *p = line;
+	int have_area = 0, have_zoom = 0;
+
+	json_ws(&p);
+	if (*p != '{') {
+		return "expected a JSON object";
+	}
+	p++;
+
+	json_ws(&p);
+	while (*p != '}') {
+		char *key;
+		char *str = NULL;
+		double v[4];
+
+		if (*p == ',') {
+			p++;
+		}
+		if ((key = json_string(&p)) == NULL) {
+			return "expected a key";
+		}
+		json_ws(&p);
+		if (*p != ':') {
+			free(key);
+			return "expected ':'";
+		}
+		p++;
+
+#define JOB_FAIL(msg) do { free(key); free(str); return msg; } while (0)
+		if (!strcmp(key, "bbox")) {
+			if (json_numbers(&p, v, 4) < 0) {
+				JOB_FAIL("bbox must be [minlat, minlon, maxlat, maxlon]");
+			}
+			job->minlat = v[0];
+			job->minlon = v[1];
+			job->maxlat = v[2];
+			job->maxlon = v[3];
+			job->centered = 0;
+			have_area = 1;
+		} else if (!strcmp(key, "center")) {
+			if (json_numbers(&p, v, 2) < 0) {
+				JOB_FAIL("center must be [lat, lon]");
+			}
+			job->minlat = job->maxlat = v[0];
+			job->minlon = job->maxlon = v[1];
+			job->centered = 1;
+			have_area = 1;
+		} else if (!strcmp(key, "size")) {
+			if (json_numbers(&p, v, 2) < 0) {
+				JOB_FAIL("size must be [width, height]");
+			}
+			job->width = v[0];
+			job->height = v[1];
+		} else if (!strcmp(key, "zoom")) {
+			if (json_number(&p, &v[0]) < 0) {
+				JOB_FAIL("zoom must be a number");
+			}
+			job->zoom = v[0];
+			have_zoom = 1;
+		} else if (!strcmp(key, "tilesize")) {
+			if (json_number(&p, &v[0]) < 0) {
+				JOB_FAIL("tilesize must be a number");
+			}
+			job->tilesize = v[0];
+		} else if (!strcmp(key, "layers") || !strcmp(key, "layer")) {
+			if ((job->nlayers = json_strings(&p, &job->layers)) <= 0) {
+				JOB_FAIL("layers must be a string or a list of strings");
+			}
+		} else if (!strcmp(key, "output")) {
+			if ((str = json_string(&p)) == NULL) {
+				JOB_FAIL("output must be a string");
+			}
+			job->outfile = str;
+			str = NULL;
+		} else if (!strcmp(key, "format")) {
+			if ((str = json_string(&p)) == NULL || (job->outfmt = parse_outfmt(str)) < 0 ||
+			    job->outfmt == OUTFMT_CSV || job->outfmt == OUTFMT_BINARY) {
+				JOB_FAIL("unknown format");
+			}
+		} else if (!strcmp(key, "encoding")) {
+			if ((str = json_string(&p)) == NULL || (job->encoding = parse_elevation_encoding(str)) == ELEVATION_DEFAULT) {
+				JOB_FAIL("unknown elevation encoding");
+			}
+		} else if (!strcmp(key, "relief")) {
+			if ((str = json_string(&p)) == NULL || (int) (job->relief = parse_relief(str)) < 0) {
+				JOB_FAIL("unknown relief");
+			}
+		} else if (!strcmp(key, "width")) {
+			if (json_number(&p, &v[0]) < 0) {
+				JOB_FAIL("width must be a number");
+			}
+			job->outwidth = v[0];
+		} else if (!strcmp(key, "height")) {
+			if (json_number(&p, &v[0]) < 0) {
+				JOB_FAIL("height must be a number");
+			}
+			job->outheight = v[0];
+		} else if (!strcmp(key, "resolution")) {
+			if (json_number(&p, &job->resolution) < 0) {
+				JOB_FAIL("resolution must be a number");
+			}
+		} else if (!strcmp(key, "filter")) {
+			if ((str = json_string(&p)) == NULL || (int) (job->filter = parse_resample_filter(str)) < 0) {
+				JOB_FAIL("unknown filter");
+			}
+		} else if (!strcmp(key, "mask")) {
+			if ((str = json_string(&p)) == NULL) {
+				JOB_FAIL("mask must be a GeoJSON file name");
+			}
+			job->mask = read_geojson_polygon(str);
+			if (!have_area) {
+				polygon_bounds(job->mask, &job->minlat, &job->minlon, &job->maxlat, &job->maxlon);
+				job->centered = 0;
+				have_area = 1;
+			}
+		} else if (!strcmp(key, "journal")) {
+			if ((str = json_string(&p)) == NULL) {
+				JOB_FAIL("journal must be a file name");
+			}
+			job->journal = str;
+			str = NULL;
+		} else if (!strcmp(key, "results")) {
+			if ((str = json_string(&p)) == NULL) {
+				JOB_FAIL("results must be a directory name");
+			}
+			job->results = str;
+			str = NULL;
+		} else if (!strcmp(key, "revalidate")) {
+			if (json_bool(&p, &job->revalidate) < 0) {
+				JOB_FAIL("revalidate must be true or false");
+			}
+		} else if (!strcmp(key, "overzoom")) {
+			if (json_number(&p, &v[0]) < 0 || v[0] < 0) {
+				JOB_FAIL("overzoom must be a number of zoom levels");
+			}
+			job->overzoom = v[0];
+		} else if (!strcmp(key, "getmap")) {
+			if (json_number(&p, &v[0]) < 0 || v[0] < 1) {
+				JOB_FAIL("getmap must be a size in pixels");
+			}
+			job->getmap = v[0];
+		} else if (!strcmp(key, "minzoom")) {
+			if (json_number(&p, &v[0]) < 0 || v[0] < 0) {
+				JOB_FAIL("minzoom must be a zoom level");
+			}
+			job->minzoom = v[0];
+		} else if (!strcmp(key, "projection")) {
+			if ((str = json_string(&p)) == NULL || (int) (job->projection = parse_projection(str)) < 0) {
+				JOB_FAIL("unknown projection");
+			}
+		} else if (!strcmp(key, "elevation")) {
+			if (json_bool(&p, &job->elevation) < 0) {
+				JOB_FAIL("elevation must be true or false");
+			}
+		} else if (!strcmp(key, "worldfile")) {
+			if (json_bool(&p, &job->writeworldfile) < 0) {
+				JOB_FAIL("worldfile must be true or false");
+			}
+		} else {
+			JOB_FAIL("unknown key");
+		}
+#undef JOB_FAIL
+
+		free(key);
+		free(str);
+		json_ws(&p);
+		if (*p != ',' && *p != '}') {
+			return "expected ',' or '}'";
+		}
+	}
+
+	if (!have_area) {
+		return "missing bbox or center";
+	}
+	if (!have_zoom) {
+		return "missing zoom";
+	}
+	if (job->nlayers <= 0) {
+		return "missing layers";
+	}
+	if (job->outfile == NULL) {
+		return "missing output";
+	}
+	return NULL;
+}
+
+struct batch {
+	struct job *jobs;
+	int njobs;
+	int next;
+	pthread_mutex_t lock;
+};
+
+void *batch_worker(void *v) {
+	struct batch *batch = v;
+
+	for (;;) {
+		pthread_mutex_lock(&batch->lock);
+		int k = batch->next++;
+		pthread_mutex_unlock(&batch->lock);
+
+		if (k >= batch->njobs) {
+			break;
+		}
+		run_job(&batch->jobs[k]);
+	}
+	return NULL;
+}
+
+// Adds the tiles of a job to the cache, for it to take them from there.
+// Returns how many it asks for.
+long long tile_cache_plan_job(struct tile_cache *cache, struct job *job) {
+	struct plan pl;
+	unsigned int tx, ty;
+	long long requests = 0;
+	int l;
+
+	plan_job(job, &pl);
+	frame_hold(&pl, release_plan);
+	if ((long long) pl.width * pl.height > 10000 * 10000) {
+		stitch_log(LOG_ERROR, "%s: that's too big\n", job->outfile);
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+	job->cache = cache;
+
+	// A job whose output is cached takes none of the tiles, and one that
+	// revalidates its result fetches them as it does
+	if (job->results != NULL) {
+		struct result *rs = result_open(job, &pl, job_grid(job, &pl));
+		int hit;
+
+		frame_hold(rs, release_result);
+		hit = job->revalidate || result_present(rs);
+		result_free(rs);
+		if (hit) {
+			plan_free(&pl);
+			return 0;
+		}
+	}
+
+	unsigned char *tiles = NULL;
+	if (job->mask != NULL) {
+		unsigned char *mask = rasterize_polygon(job->mask, &pl);
+		frame_hold(mask, free);
+		tiles = plan_tile_mask(job, &pl, mask);
+		frame_free(mask);
+	}
+
+	// A resumed job only takes the tiles its journal doesn't have yet
+	unsigned char *done = NULL;
+	if (job->journal != NULL && !pl.resample) {
+		done = journal_peek(job, &pl, job_grid(job, &pl));
+		frame_hold(done, free);
+	}
+
+	for (tx = pl.tx1; tx <= pl.tx2; tx++) {
+		for (ty = pl.ty1; ty <= pl.ty2; ty++) {
+			int k = (ty - pl.ty1) * (pl.tx2 - pl.tx1 + 1) + (tx - pl.tx1);
+
+			if ((tiles != NULL && !tiles[k]) || (done != NULL && done[k])) {
+				continue;
+			}
+			for (l = 0; l < job->nlayers; l++) {
+				// WMS layers are fetched by window in the job, and
+				// rasters read from their files
+				if (!layer_getmap(pl.urls[l]) && !layer_raster(pl.urls[l])) {
+					tile_cache_plan(cache, pl.urls[l], pl.zoom, tx, ty);
+					requests++;
+				}
+			}
+		}
+	}
+	frame_free(done);
+	free(tiles);
+	plan_free(&pl);
+	return requests;
+}
+
+// Frees what parse_job() gave a job in place of its defaults
+static void job_free_parsed(struct job *job, const struct job *defaults) {
+	int l;
+
+	if (job->layers != defaults->layers) {
+		for (l = 0; l < job->nlayers; l++) {
+			free((char *) job->layers[l]);
+		}
+		free(job->layers);
+	}
+	if (job->outfile != defaults->outfile) {
+		free((char *) job->outfile);
+	}
+	if (job->journal != defaults->journal) {
+		free((char *) job->journal);
+	}
+	if (job->results != defaults->results) {
+		free((char *) job->results);
+	}
+	if (job->mask != defaults->mask) {
+		polygon_free((struct polygon *) job->mask);
+	}
+}
+
+// Batch mode: reads one job per line, plans all of them up front, fetches
+// the union of their tiles once, then runs the jobs in parallel from the
+// shared tile cache
+void run_batch(const char *jobfile, const struct job *defaults, int parallel) {
+	FILE *fp = strcmp(jobfile, "-") == 0 ? stdin : fopen(jobfile, "r");
+	struct batch batch = { NULL, 0, 0 };
+	char *line = NULL;
+	size_t linelen = 0;
+	int lineno = 0, k;
+	long long requests = 0;
+
+	if (fp == NULL) {
+		stitch_log(LOG_ERROR, "%s: %s\n", jobfile, strerror(errno));
+		stitch_fail(STITCH_ERR_IO);
+	}
+
+	while (getline(&line, &linelen, fp) != -1) {
+		const char *cp = line;
+		const char *err;
+
+		lineno++;
+		json_ws(&cp);
+		if (*cp == '\0' || *cp == '#') {
+			continue;
+		}
+
+		batch.jobs = realloc(batch.jobs, (batch.njobs + 1) * sizeof(struct job));
+		if (batch.jobs == NULL) {
+			stitch_log(LOG_ERROR, "Can't allocate memory for %d jobs\n", batch.njobs + 1);
+			stitch_fail(STITCH_ERR_MEMORY);
+		}
+		batch.jobs[batch.njobs] = *defaults;
+		batch.jobs[batch.njobs].layers = NULL;
+		batch.jobs[batch.njobs].nlayers = 0;
+		batch.jobs[batch.njobs].outfile = NULL;
+		batch.jobs[batch.njobs].journal = NULL;
+		batch.jobs[batch.njobs].update = NULL;
+
+		if ((err = parse_job(cp, &batch.jobs[batch.njobs])) != NULL) {
+			stitch_log(LOG_ERROR, "%s:%d: %s\n", jobfile, lineno, err);
+			stitch_fail(STITCH_ERR_ARGS);
+		}
+		batch.njobs++;
+	}
+	free(line);
+	if (fp != stdin) {
+		fclose(fp);
+	}
+
+	struct tile_cache *cache = tile_cache_new(65537);
+
+	for (k = 0; k < batch.njobs; k++) {
+		requests += tile_cache_plan_job(cache, &batch.jobs[k]);
+	}
+
+	stitch_log(LOG_INFO, "==Batch: %d jobs, %d unique tiles for %lld tile requests\n", batch.njobs, cache->count, requests);
+	if (requests > 0) {
+		tile_cache_prefetch(cache, parallel * 4);
+	}
+	progress_begin("compose", requests);
+
+	if (parallel > batch.njobs) {
+		parallel = batch.njobs;
+	}
+
+	pthread_t threads[parallel > 0 ? parallel : 1];
+	pthread_mutex_init(&batch.lock, NULL);
+	for (k = 0; k < parallel; k++) {
+		if (pthread_create(&threads[k], NULL, batch_worker, &batch) != 0) {
+			stitch_log(LOG_ERROR, "Can't start batch thread\n");
+			stitch_fail(STITCH_ERR_INTERNAL);
+		}
+	}
+	for (k = 0; k < parallel; k++) {
+		pthread_join(threads[k], NULL);
+	}
+	pthread_mutex_destroy(&batch.lock);
+	progress_end();
+
+	tile_cache_free(cache);
+	for (k = 0; k < batch.njobs; k++) {
+		job_free_parsed(&batch.jobs[k], defaults);
+	}
+	free(batch.jobs);
+}
+
+// Server mode (-l [host:]port) answers
+//   GET /stitch?bbox=minlat,minlon,maxlat,maxlon&zoom=12&layers=osm,...
+// with the PNG, sent with chunked encoding as it is encoded. A fixed pool of
+// threads renders the requests as libstitch renders, through one context,
+// so they share its connections and decoded tiles. The server's own daemon
+// thread fetches the tiles, sharing recent tiles between requests and making
+// concurrent requests for the same tile one transfer. A request is cancelled
+// when its deadline passes or the client hangs up.
+#define SERVER_QUEUE 64
+
+struct server_request {
+	int client;
+	int headers;            // whether the response has begun
+	double deadline;        // on the monotonic clock
+	volatile int timedout;
+};
+
+static void server_respond(int client, const char *status, const char *message) {
+	char head[256];
+
+	snprintf(head, sizeof head, "HTTP/1.1 %s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+		status, strlen(message) + 1);
+	if (write_all(client, head, strlen(head)) == 0 && write_all(client, message, strlen(message)) == 0) {
+		write_all(client, "\n", 1);
+	}
+}
+
+// Sends a piece of the PNG as a chunk, starting the response with the
+// first of them
+static int server_chunk(void *user, const void *buf, size_t len) {
+	static const char head[] = "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n";
+	struct server_request *sr = user;
+	char size[24];
+
+	if (len == 0) {
+		return 0;
+	}
+	if (!sr->headers) {
+		if (write_all(sr->client, head, sizeof head - 1) != 0) {
+			return -1;
+		}
+		sr->headers = 1;
+	}
+	snprintf(size, sizeof size, "%zx\r\n", len);
+	if (write_all(sr->client, size, strlen(size)) != 0 || write_all(sr->client, buf, len) != 0 ||
+	    write_all(sr->client, "\r\n", 2) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+// Whether the request's deadline has passed or its client has gone away.
+// A client has nothing more to send, so a readable socket is one that was
+// closed, unless it sends another request after this one.
+static int server_cancel(void *user) {
+	struct server_request *sr = user;
+	struct pollfd pfd = { sr->client, POLLIN, 0 };
+	char c;
+
+	if (stats_clock() >= sr->deadline) {
+		sr->timedout = 1;
+		return 1;
+	}
+	return poll(&pfd, 1, 0) > 0 && recv(sr->client, &c, 1, MSG_PEEK | MSG_DONTWAIT) <= 0;
+}
+
+static int hexdigit(int c) {
+	return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+}
+
+// Percent-decodes len characters of a query value into out
+static void url_decode(const char *in, size_t len, char *out) {
+	size_t k;
+
+	for (k = 0; k < len; k++) {
+		if (in[k] == '+') {
+			*out++ = ' ';
+		} else if (in[k] == '%' && k + 2 < len && hexdigit(in[k + 1]) >= 0 && hexdigit(in[k + 2]) >= 0) {
+			*out++ = hexdigit(in[k + 1]) * 16 + hexdigit(in[k + 2]);
+			k += 2;
+		} else {
+			*out++ = in[k];
+		}
+	}
+	*out = '\0';
+}
+
+static void json_append(char **out, size_t *len, size_t *alloc, const char *s, int quote) {
+	size_t need = *len + strlen(s) * 6 + 4;
+
+	if (need > *alloc) {
+		*alloc = need * 2;
+		if ((*out = realloc(*out, *alloc)) == NULL) {
+			stitch_log(LOG_ERROR, "Can't allocate memory for a request\n");
+			stitch_fail(STITCH_ERR_MEMORY);
+		}
+	}
+	if (quote) {
+		(*out)[(*len)++] = '"';
+		for (; *s; s++) {
+			if (*s == '"' || *s == '\\') {
+				(*out)[(*len)++] = '\\';
+				(*out)[(*len)++] = *s;
+			} else if ((unsigned char) *s < ' ') {
+				*len += sprintf(*out + *len, "\\u%04x", (unsigned char) *s);
+			} else {
+				(*out)[(*len)++] = *s;
+			}
+		}
+		(*out)[(*len)++] = '"';
+	} else {
+		*len += sprintf(*out + *len, "%s", s);
+	}
+	(*out)[*len] = '\0';
+}
+
+// Turns the query of a request into a job line for parse_job(). Returns
+// NULL on success or a description of the problem.
+static const char *server_query(const char *query, char **json) {
+	static const char *numbers[] = { "zoom", "width", "height", "resolution", "overzoom", "tilesize", "getmap", NULL };
+	static const char *arrays[] = { "bbox", "center", "size", NULL };
+	static const char *strings[] = { "filter", "projection", "encoding", "relief", NULL };
+	size_t len = 0, alloc = 0;
+	const char *cp = query;
+	int k;
+
+	json_append(json, &len, &alloc, "{\"output\": \"-\"", 0);
+	while (*cp != '\0') {
+		const char *end = cp + strcspn(cp, "&"), *eq = memchr(cp, '=', end - cp);
+		char key[32], value[end - cp + 1];
+
+		if (eq == NULL || (size_t) (eq - cp) >= sizeof key) {
+			return "expected key=value";
+		}
+		memcpy(key, cp, eq - cp);
+		key[eq - cp] = '\0';
+		url_decode(eq + 1, end - eq - 1, value);
+		json_append(json, &len, &alloc, ", ", 0);
+		json_append(json, &len, &alloc, key, 1);
+		json_append(json, &len, &alloc, ": ", 0);
+
+		for (k = 0; numbers[k] != NULL && strcmp(numbers[k], key) != 0; k++) {
+			;
+		}
+		if (numbers[k] != NULL) {
+			char *num_end;
+			strtod(value, &num_end);
+			if (value[0] == '\0' || *num_end != '\0') {
+				return "expected a number";
+			}
+			json_append(json, &len, &alloc, value, 0);
+			goto next;
+		}
+
+		for (k = 0; arrays[k] != NULL && strcmp(arrays[k], key) != 0; k++) {
+			;
+		}
+		if (arrays[k] != NULL) {
+			if (value[0] == '\0' || strspn(value, "0123456789.,-+eE") != strlen(value)) {
+				return "expected comma-separated numbers";
+			}
+			json_append(json, &len, &alloc, "[", 0);
+			json_append(json, &len, &alloc, value, 0);
+			json_append(json, &len, &alloc, "]", 0);
+			goto next;
+		}
+
+		for (k = 0; strings[k] != NULL && strcmp(strings[k], key) != 0; k++) {
+			;
+		}
+		if (strings[k] != NULL) {
+			json_append(json, &len, &alloc, value, 1);
+			goto next;
+		}
+
+		if (!strcmp(key, "elevation")) {
+			if (strcmp(value, "true") != 0 && strcmp(value, "false") != 0) {
+				return "elevation must be true or false";
+			}
+			json_append(json, &len, &alloc, value, 0);
+		} else if (!strcmp(key, "layers")) {
+			// Layers are split before decoding, so %2C keeps a comma
+			const char *lp = eq + 1;
+
+			json_append(json, &len, &alloc, "[", 0);
+			while (lp < end) {
+				const char *lend = memchr(lp, ',', end - lp);
+				char layer[end - lp + 1];
+
+				if (lend == NULL) {
+					lend = end;
+				}
+				url_decode(lp, lend - lp, layer);
+
+				// Only remote tiles, not files of the server
+				if (strncmp(layer_url(layer), "http://", 7) != 0 && strncmp(layer_url(layer), "https://", 8) != 0) {
+					return "layers must be presets or http(s) URLs";
+				}
+				if (lp != eq + 1) {
+					json_append(json, &len, &alloc, ", ", 0);
+				}
+				json_append(json, &len, &alloc, layer, 1);
+				lp = lend + 1;
+			}
+			json_append(json, &len, &alloc, "]", 0);
+		} else {
+			return "unknown parameter";
+		}
+
+	next:
+		cp = *end == '&' ? end + 1 : end;
+	}
+	json_append(json, &len, &alloc, "}", 0);
+	return NULL;
+}
+
+static stitch_status render_frame(stitch_ctx *ctx, const struct stitch_request *req, const struct job *given);
+
+// Renders one request, on a thread of the pool
+static void server_request(int client, stitch_ctx *ctx, const struct job *defaults, int deadline) {
+	char head[16384], *cp, *json = NULL;
+	struct job job = *defaults;
+	struct server_request sr = { .client = client, .deadline = stats_clock() + deadline };
+	struct stitch_request r = { .write = server_chunk, .cancel = server_cancel, .user = &sr };
+	struct timeval tv = { .tv_sec = deadline };
+	const char *error;
+	stitch_status status;
+	size_t len = 0;
+
+	// Neither a client that sends nothing nor one that reads nothing can
+	// hold a thread past the deadline
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+
+	head[0] = '\0';
+	while ((cp = strstr(head, "\r\n\r\n")) == NULL) {
+		ssize_t n = len < sizeof head - 1 ? read(client, head + len, sizeof head - 1 - len) : 0;
+		if (n <= 0) {
+			server_respond(client, "400 Bad Request", "incomplete request");
+			return;
+		}
+		len += n;
+		head[len] = '\0';
+	}
+	*cp = '\0';
+
+	if (strncmp(head, "GET /stitch?", 12) != 0 || (cp = strchr(head + 12, ' ')) == NULL) {
+		server_respond(client, "404 Not Found", "only GET /stitch?bbox=...&zoom=...&layers=... is served");
+		return;
+	}
+	*cp = '\0';
+	if ((error = server_query(head + 12, &json)) != NULL || (error = parse_job(json, &job)) != NULL) {
+		server_respond(client, "400 Bad Request", error);
+		free(json);
+		job_free_parsed(&job, defaults);
+		return;
+	}
+	free(json);
+	free((char *) job.outfile);
+	job.outfile = NULL;
+	job.outfmt = OUTFMT_PNG;
+	job.nshards = 0;
+	stitch_log(LOG_INFO, "==Request: %s\n", head + 12);
+
+	status = render_frame(ctx, &r, &job);
+	if (status == STITCH_OK) {
+		write_all(client, "0\r\n\r\n", 5);
+	} else if (status == STITCH_ERR_CANCELLED) {
+		stitch_log(LOG_INFO, sr.timedout ? "==Request timed out\n" : "==Client hung up, cancelled\n");
+		if (sr.timedout && !sr.headers) {
+			server_respond(client, "504 Gateway Timeout", "the request took longer than the server allows");
+		}
+	} else if (!sr.headers) {
+		// After the response has begun, it just ends without its last chunk
+		server_respond(client, status == STITCH_ERR_ARGS ? "400 Bad Request" : "502 Bad Gateway", stitch_strerror(status));
+	}
+	job_free_parsed(&job, defaults);
+}
+
+// Clients accepted but not yet taken by a thread of the pool
+static struct server_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	int clients[SERVER_QUEUE];
+	int first, count;
+	stitch_ctx *ctx;
+	const struct job *defaults;
+	int deadline;
+} sq = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void *server_worker(void *v) {
+	for (;;) {
+		pthread_mutex_lock(&sq.lock);
+		while (sq.count == 0) {
+			pthread_cond_wait(&sq.ready, &sq.lock);
+		}
+		int client = sq.clients[sq.first];
+		sq.first = (sq.first + 1) % SERVER_QUEUE;
+		sq.count--;
+		pthread_mutex_unlock(&sq.lock);
+
+		server_request(client, sq.ctx, sq.defaults, sq.deadline);
+		close(client);
 	}
+	return NULL;
+}
+
+// The directory of the server's daemon socket, removed with it on the way out
+static char server_dir[64];
+static char server_socket[80];
+
+static void server_cleanup(void) {
+	unlink(server_socket);
+	rmdir(server_dir);
+}
+
+// Waits for the signal that stops the server, then reports on the run, if
+// -P or -X asked for it, and removes the daemon socket. The requests still
+// being served are cut off.
+static void *server_signals(void *v) {
+	sigset_t *stop = v;
+	int sig;
+
+	sigwait(stop, &sig);
+	stitch_log(LOG_INFO, "==Stopping on signal %d\n", sig);
+	stats_report(pixels != NULL ? pixels->lookups : 0, pixels != NULL ? pixels->hits : 0);
+	trace_report();
+	server_cleanup();
+	fflush(stderr);
+	_exit(EXIT_FAILURE);
+}
 
-	unsigned char *buf = malloc(dim * 4);
-	memset(buf, '\0', dim * 4);
-	if (buf == NULL) {
-		fprintf(stderr, "Can't allocate memory for %lld\n", dim * 4);
+// Accepts requests until killed, rendering parallel of them at a time and
+// keeping up to SERVER_QUEUE more waiting
+void run_server(const char *listen_on, const struct job *defaults, int deadline, int parallel) {
+	struct sockaddr_in sa = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	const char *colon = strrchr(listen_on, ':');
+	static sigset_t stop;
+	pthread_t thread;
+	int fd, k, one = 1;
+
+	if (colon != NULL) {
+		char host[colon - listen_on + 1];
+
+		memcpy(host, listen_on, colon - listen_on);
+		host[colon - listen_on] = '\0';
+		if (inet_pton(AF_INET, host, &sa.sin_addr) != 1) {
+			stitch_log(LOG_ERROR, "Can't listen on %s: not an IPv4 address\n", host);
+			exit(EXIT_FAILURE);
+		}
+		listen_on = colon + 1;
 	}
+	sa.sin_port = htons(atoi(listen_on));
 
-	unsigned int tx, ty;
-	for (tx = tx1; tx <= tx2; tx++) {
-		for (ty = ty1; ty <= ty2; ty++) {
-			int xoff = (tx - tx1) * tilesize - xa;
-			int yoff = (ty - ty1) * tilesize - ya;
-
-			int opt;
-			for (opt = optind + 5; opt < argc; opt++) {
-				const tileset_t *preset = find_preset_by_name(argv[opt]);
-				const char *url = preset ? preset->url : argv[opt];
-				int end = strlen(url) + 50;
-				char url2[end];
-				const char *cp;
-				char *out = url2;
-
-				for (cp = url; *cp && out - url2 < end - 10; cp++) {
-					if (*cp == '{' && cp[2] == '}') {
-						if (cp[1] == 'z') {
-							sprintf(out, "%d", zoom);
-							out = out + strlen(out);
-						} else if (cp[1] == 'x') {
-							sprintf(out, "%u", tx);
-							out = out + strlen(out);
-						} else if (cp[1] == 'y') {
-							sprintf(out, "%u", ty);
-							out = out + strlen(out);
-						} else if (cp[1] == 's') {
-							*out++ = 'a' + rand() % 3;
-						} else {
-							fprintf(stderr, "Unknown format token %c\n", cp[1]);
-							exit(EXIT_FAILURE);
-						}
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+	if (fd < 0 || bind(fd, (struct sockaddr *) &sa, sizeof sa) != 0 || listen(fd, 128) != 0) {
+		stitch_log(LOG_ERROR, "%s: %s\n", listen_on, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
 
-						cp += 2;
-					} else {
-						*out++ = *cp;
-					}
-				}
+	// The requests fetch through a daemon of the server's own, on a socket
+	// in a private directory of its own
+	snprintf(server_dir, sizeof server_dir, "/tmp/stitch-server-XXXXXX");
+	if (mkdtemp(server_dir) == NULL) {
+		stitch_log(LOG_ERROR, "%s: %s\n", server_dir, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	snprintf(server_socket, sizeof server_socket, "%s/stitch.sock", server_dir);
+	atexit(server_cleanup);
+	signal(SIGPIPE, SIG_IGN);
+
+	// The stopping signals are blocked in every thread started from here
+	// on, and taken by one of their own
+	sigemptyset(&stop);
+	sigaddset(&stop, SIGINT);
+	sigaddset(&stop, SIGTERM);
+	sigaddset(&stop, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &stop, NULL);
+	if (pthread_create(&thread, NULL, server_signals, &stop) != 0) {
+		stitch_log(LOG_ERROR, "Can't start the signal thread\n");
+		exit(EXIT_FAILURE);
+	}
+	setenv("STITCH_SOCKET", server_socket, 1);
+	if (pthread_create(&thread, NULL, daemon_loop, (void *) (intptr_t) daemon_listen()) != 0) {
+		stitch_log(LOG_ERROR, "Can't start the daemon thread\n");
+		exit(EXIT_FAILURE);
+	}
 
-				*out = '\0';
-				fprintf(stderr, "%s\n", url2);
+	// The decoded tiles of -D and -K are the context's, for all requests
+	if ((sq.ctx = stitch_ctx_new(0)) == NULL) {
+		stitch_log(LOG_ERROR, "Can't start the server's context\n");
+		exit(EXIT_FAILURE);
+	}
+	sq.ctx->pixels = pixels;
+	sq.defaults = defaults;
+	sq.deadline = deadline;
+	for (k = 0; k < parallel; k++) {
+		if (pthread_create(&thread, NULL, server_worker, NULL) != 0) {
+			stitch_log(LOG_ERROR, "Can't start server thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
 
-				CURL *curl = curl_easy_init();
-				if (curl == NULL) {
-					fprintf(stderr, "Curl won't start\n");
-					exit(EXIT_FAILURE);
-				}
+	stitch_log(LOG_INFO, "==Serving on port %d, %d requests at a time\n", ntohs(sa.sin_port), parallel);
+	for (;;) {
+		int client = accept(fd, NULL, NULL);
 
-				struct data data;
-				data.buf = NULL;
-				data.len = 0;
-				data.nalloc = 0;
+		if (client < 0) {
+			continue;
+		}
+		pthread_mutex_lock(&sq.lock);
+		if (sq.count == SERVER_QUEUE) {
+			pthread_mutex_unlock(&sq.lock);
+			server_respond(client, "503 Service Unavailable", "too many requests waiting");
+			close(client);
+			continue;
+		}
+		sq.clients[(sq.first + sq.count) % SERVER_QUEUE] = client;
+		sq.count++;
+		pthread_cond_signal(&sq.ready);
+		pthread_mutex_unlock(&sq.lock);
+	}
+}
 
-				curl_easy_setopt(curl, CURLOPT_URL, url2);
-				curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-				curl_easy_setopt(curl, CURLOPT_USERAGENT, "tile-stitch/1.0.0");
-				curl_easy_setopt(curl, CURLOPT_WRITEDATA, &data);
-				curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_receive);
+// libstitch: see stitch.h
+static pthread_once_t curl_once = PTHREAD_ONCE_INIT;
 
-				CURLcode res = curl_easy_perform(curl);
-				if (res != CURLE_OK) {
-					fprintf(stderr, "Can't retrieve %s: %s\n", url2,
-						curl_easy_strerror(res));
-					exit(EXIT_FAILURE);
-				}
+static void curl_start(void) {
+	curl_global_init(CURL_GLOBAL_ALL);
+}
 
-				struct image *i;
+static void ctx_share_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *v) {
+	pthread_mutex_lock(&((stitch_ctx *) v)->share_locks[data]);
+}
 
-				if (data.len >= 4 && memcmp(data.buf, "\x89PNG", 4) == 0) {
-					i = read_png(data.buf, data.len);
-				} else if (data.len >= 2 && memcmp(data.buf, "\xFF\xD8", 2) == 0) {
-					i = read_jpeg(data.buf, data.len);
-				} else {
-					fprintf(stderr, "Don't recognize file format\n");
+static void ctx_share_unlock(CURL *curl, curl_lock_data data, void *v) {
+	pthread_mutex_unlock(&((stitch_ctx *) v)->share_locks[data]);
+}
 
-					free(data.buf);
-					curl_easy_cleanup(curl);
-					continue;
-				}
+stitch_ctx *stitch_ctx_new(size_t decoded_bytes) {
+	struct stitch_frame fr = { .ctx = NULL };
+	stitch_ctx *ctx;
+	int k;
 
-				if (i == 0) {
-					// error message was printed by read_png or read_jpeg already
-					free(data.buf);
-					curl_easy_cleanup(curl);
-					exit(EXIT_FAILURE);
-				}
+	pthread_once(&curl_once, curl_start);
+	if ((ctx = calloc(1, sizeof(stitch_ctx))) == NULL) {
+		return NULL;
+	}
+	if ((ctx->share = curl_share_init()) == NULL) {
+		free(ctx);
+		return NULL;
+	}
+	if (decoded_bytes > 0) {
+		frame = &fr;
+		if (setjmp(fr.env) != 0) {
+			frame = NULL;
+			curl_share_cleanup(ctx->share);
+			free(ctx);
+			return NULL;
+		}
+		ctx->pixels = pixel_cache_new(decoded_bytes, NULL, 0);
+		frame = NULL;
+	}
 
-				free(data.buf);
-				curl_easy_cleanup(curl);
+	for (k = 0; k < CURL_LOCK_DATA_LAST; k++) {
+		pthread_mutex_init(&ctx->share_locks[k], NULL);
+	}
+	curl_share_setopt(ctx->share, CURLSHOPT_LOCKFUNC, ctx_share_lock);
+	curl_share_setopt(ctx->share, CURLSHOPT_UNLOCKFUNC, ctx_share_unlock);
+	curl_share_setopt(ctx->share, CURLSHOPT_USERDATA, ctx);
+	curl_share_setopt(ctx->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(ctx->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	curl_share_setopt(ctx->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+	ctx->parallel = default_thread_count() * 4;
+	return ctx;
+}
 
-				if (i->height != tilesize || i->width != tilesize) {
-					fprintf(stderr, "Got %dx%d tile, not %d\n", i->width, i->height, tilesize);
-					exit(EXIT_FAILURE);
-				}
+void stitch_ctx_free(stitch_ctx *ctx) {
+	int k;
 
-				for (y = 0; y < i->height; y++) {
-					for (x = 0; x < i->width; x++) {
-						int xd = x + xoff;
-						int yd = y + yoff;
+	if (ctx == NULL) {
+		return;
+	}
+	curl_share_cleanup(ctx->share);
+	for (k = 0; k < CURL_LOCK_DATA_LAST; k++) {
+		pthread_mutex_destroy(&ctx->share_locks[k]);
+	}
+	pixel_cache_free(ctx->pixels);
+	free(ctx);
+}
 
-						if (xd < 0 || yd < 0 || xd >= width || yd >= height) {
-							continue;
-						}
+// The job of a request, with the defaults of the command line
+static void request_job(const struct stitch_request *req, struct job *job) {
+	job->minlat = req->minlat;
+	job->minlon = req->minlon;
+	job->maxlat = req->maxlat;
+	job->maxlon = req->maxlon;
+	job->centered = req->centered;
+	job->width = req->width;
+	job->height = req->height;
+	job->zoom = req->zoom;
+	job->layers = req->layers;
+	job->nlayers = req->nlayers;
+	job->outfile = req->outfile;
+	job->tilesize = req->tilesize > 0 ? req->tilesize : 256;
+	job->elevation = req->elevation;
+	job->writeworldfile = req->worldfile;
+	job->outwidth = req->outwidth;
+	job->outheight = req->outheight;
+	job->resolution = req->resolution;
+	job->overzoom = req->overzoom;
+	job->getmap = req->getmap > 0 ? req->getmap : 2048;
+	job->minzoom = -1;
+
+	job->outfmt = req->format != NULL ? parse_outfmt(req->format) : OUTFMT_PNG;
+	if (job->outfmt != OUTFMT_PNG && job->outfmt != OUTFMT_GEOTIFF && job->outfmt != OUTFMT_GEOTIFF_FLOAT32) {
+		stitch_log(LOG_ERROR, "Unknown output format %s\n", req->format);
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+	job->encoding = req->encoding != NULL ? parse_elevation_encoding(req->encoding) : ELEVATION_DEFAULT;
+	if (req->encoding != NULL && job->encoding == ELEVATION_DEFAULT) {
+		stitch_log(LOG_ERROR, "Unknown elevation encoding %s\n", req->encoding);
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+	job->relief = req->relief != NULL ? parse_relief(req->relief) : RELIEF_NONE;
+	if ((int) job->relief < 0) {
+		stitch_log(LOG_ERROR, "Unknown relief %s\n", req->relief);
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+	job->filter = req->filter != NULL ? parse_resample_filter(req->filter) : FILTER_BILINEAR;
+	if ((int) job->filter < 0) {
+		stitch_log(LOG_ERROR, "Unknown resampling filter %s\n", req->filter);
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+	job->projection = req->projection != NULL ? parse_projection(req->projection) : PROJECTION_SPHERICAL_MERCATOR;
+	if ((int) job->projection < 0) {
+		stitch_log(LOG_ERROR, "Unknown projection %s\n", req->projection);
+		stitch_fail(STITCH_ERR_ARGS);
+	}
 
-						offset = ((y + yoff) * width + x + xoff) * 4;
-						ioffset = (y * i->width + x) * i->depth;
-
-						if (i->depth == 4) {
-							/* RGBA image */
-							double as = buf[offset + 3] / 255.0;
-							double rs = buf[offset + 0] / 255.0 * as;
-							double gs = buf[offset + 1] / 255.0 * as;
-							double bs = buf[offset + 2] / 255.0 * as;
-
-							double ad = i->buf[ioffset + 3] / 255.0;
-							double rd = i->buf[ioffset + 0] / 255.0 * ad;
-							double gd = i->buf[ioffset + 1] / 255.0 * ad;
-							double bd = i->buf[ioffset + 2] / 255.0 * ad;
-
-							// https://code.google.com/p/pulpcore/wiki/TutorialBlendModes
-							double ar = as * (1 - ad) + ad;
-							double rr = rs * (1 - ad) + rd;
-							double gr = gs * (1 - ad) + gd;
-							double br = bs * (1 - ad) + bd;
-
-							buf[offset + 3] = ar * 255.0;
-							buf[offset + 0] = rr / ar * 255.0;
-							buf[offset + 1] = gr / ar * 255.0;
-							buf[offset + 2] = br / ar * 255.0;
-						} else if (i->depth == 3) {
-							buf[offset + 0] = i->buf[ioffset + 0];
-							buf[offset + 1] = i->buf[ioffset + 1];
-							buf[offset + 2] = i->buf[ioffset + 2];
-							buf[offset + 3] = 255;
-						} else {
-							buf[offset + 0] = i->buf[ioffset + 0];
-							buf[offset + 1] = i->buf[ioffset + 0];
-							buf[offset + 2] = i->buf[ioffset + 0];
-							buf[offset + 3] = 255;
-						}
-					}
-				}
+	if (job->layers == NULL || job->nlayers <= 0) {
+		stitch_log(LOG_ERROR, "No layers to stitch\n");
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+}
 
-				free(i->buf);
-				free(i);
-			}
-		}
+// Renders the job of the request, or the one given instead, into the
+// frame's resources, so that render_frame() can release them however this
+// ends
+static void render_request(stitch_ctx *ctx, const struct stitch_request *req, const struct job *given, struct stitch_frame *fr) {
+	struct job job = { 0 };
+
+	if (given != NULL) {
+		job = *given;
+	} else {
+		request_job(req, &job);
+	}
+	if (job.outfile == NULL && req->write == NULL) {
+		stitch_log(LOG_ERROR, "Neither an output file nor a write callback\n");
+		stitch_fail(STITCH_ERR_ARGS);
+	}
+	if (job.outfile == NULL && (job.outfmt != OUTFMT_PNG || job.writeworldfile || job.nshards > 0)) {
+		stitch_log(LOG_ERROR, "Only PNG, without a world file or shards, can go to a write callback\n");
+		stitch_fail(STITCH_ERR_UNSUPPORTED);
 	}
 
-	unsigned char *rows[height];
-	for (i = 0; i < height; i++) {
-		rows[i] = buf + i * (4 * width);
+	// The tiles are asked for at once, over the context's connections
+	fr->cache = tile_cache_new(4099);
+	if (tile_cache_plan_job(fr->cache, &job) > 0) {
+		tile_cache_prefetch(fr->cache, ctx->parallel);
 	}
+	run_job(&job);
+}
 
-	if (elevation) {
-		double ratio;
-		double avg_elevation;
-		uint32_t min_elevation, max_elevation, pixel_elevation;
-		uint32_t counter;
+static stitch_status render_frame(stitch_ctx *ctx, const struct stitch_request *req, const struct job *given) {
+	struct stitch_frame *outer = frame;
+	struct stitch_frame *fr = calloc(1, sizeof(struct stitch_frame));
+	int status;
 
-		min_elevation = 0xFFFFFFUL;
-		max_elevation = 0;
-		avg_elevation = 0;
-		counter = 0;
+	if (fr == NULL) {
+		return STITCH_ERR_MEMORY;
+	}
+	fr->ctx = ctx;
+	fr->write = req->write;
+	fr->cancel = req->cancel;
+	fr->user = req->user;
+	frame = fr;
+	if ((status = setjmp(fr->env)) == 0) {
+		render_request(ctx, req, given, fr);
+	}
+	frame = outer;
 
-		for (y = 0, offset = 0, counter = 0; y < height; y++) {
-			for (x = 0; x < width; x++, offset += 4) {
-				pixel_elevation = (buf[offset] << 16) + (buf[offset+1] << 8) + buf[offset+2];
-				if (min_elevation > pixel_elevation) {
-					min_elevation = pixel_elevation;
-				}
-				if (max_elevation < pixel_elevation) {
-					max_elevation = pixel_elevation;
-				}
+	frame_release(fr);
+	free(fr->held);
+	if (fr->cache != NULL) {
+		tile_cache_free(fr->cache);
+	}
+	free(fr);
+	return status;
+}
 
-				counter++;
-				avg_elevation += (pixel_elevation - avg_elevation) / counter;
-			}
-		}
+stitch_status stitch_render(stitch_ctx *ctx, const struct stitch_request *req) {
+	return render_frame(ctx, req, NULL);
+}
 
-		fprintf(stderr, "==Elevation range: [%.4f; %.4f] --> %.4f\n",
-			min_elevation / 256.0 - 32768, max_elevation / 256.0 - 32768,
-			(max_elevation - min_elevation) / 256.0
-		);
-		fprintf(stderr, "==Average elevation: %.4f\n",
-			avg_elevation / 256.0 - 32768);
+const char *stitch_strerror(stitch_status status) {
+	switch (status) {
+	case STITCH_OK:
+		return "success";
+	case STITCH_ERR_ARGS:
+		return "invalid request";
+	case STITCH_ERR_MEMORY:
+		return "out of memory";
+	case STITCH_ERR_FETCH:
+		return "can't fetch tiles";
+	case STITCH_ERR_DECODE:
+		return "corrupt data";
+	case STITCH_ERR_IO:
+		return "can't read or write a file";
+	case STITCH_ERR_UNSUPPORTED:
+		return "not supported by this build";
+	case STITCH_ERR_INTERNAL:
+		return "internal error";
+	case STITCH_ERR_CANCELLED:
+		return "cancelled";
+	}
+	return "unknown error";
+}
 
-		if (max_elevation > min_elevation) {
-			ratio = 255.0 / (max_elevation - min_elevation);
-		} else {
-			ratio = 1;
-		}
+#ifndef STITCH_LIBRARY
+// Reports on the run, if -P or -X asked for it, and lets go of the decoded
+// tiles
+static void run_finish(void) {
+	stats_finish(pixels != NULL ? pixels->lookups : 0, pixels != NULL ? pixels->hits : 0);
+	trace_finish();
+	pixel_cache_free(pixels);
+}
+
+int main(int argc, char **argv) {
+	extern int optind;
+	extern char *optarg;
+	int i;
 
-		fprintf(stderr, "==Midpoint in [0; 1] range: %.4f\n", (avg_elevation - min_elevation) * ratio / 255);
+	struct job job = { 0 };
+	char *queryfile = NULL;
+	char *jobfile = NULL;
+	int merge = 0;
+	double step = 0;
+	int parallel = default_thread_count();
+	long pixel_mb = -1, pixel_disk_mb = 1024;
+	const char *pixel_dir = NULL;
+	const char *listen_on = NULL;
+	const char *stats_path = NULL;
+	const char *trace_file = NULL;
+	int deadline = 60;
+
+	// The URLs of -v are many short writes, which a slow pipe makes costly
+	setvbuf(stderr, NULL, _IOFBF, 1 << 16);
+
+	job.tilesize = 256;
+	job.outfmt = OUTFMT_PNG;
+	job.encoding = ELEVATION_DEFAULT;
+	job.relief = RELIEF_NONE;
+	job.filter = FILTER_BILINEAR;
+	job.projection = PROJECTION_SPHERICAL_MERCATOR;
+	job.minzoom = -1;
+	job.getmap = 2048;
+
+	while ((i = getopt(argc, argv, "eE:ho:t:cf:R:q:L:b:j:W:H:r:F:p:m:O:S:J:U:Z:g:C:VD:K:k:dl:T:P:X:vQMw")) != -1) {
+		switch (i) {
+		case 'e':
+			job.elevation = 1;
+			break;
 
-		for (y = 0, offset = 0; y < height; y++) {
-			for (x = 0; x < width; x++, offset += 4) {
-				pixel_elevation = (buf[offset] << 16) + (buf[offset+1] << 8) + buf[offset+2];
-				buf[offset] = buf[offset + 1] = buf[offset + 2] =
-					round((pixel_elevation - min_elevation) * ratio);
+		case 'E':
+			job.encoding = parse_elevation_encoding(optarg);
+			if (job.encoding == ELEVATION_DEFAULT) {
+				fprintf(stderr, "Unknown elevation encoding %s\n", optarg);
+				exit(EXIT_FAILURE);
 			}
-		}
-	}
+			break;
 
-	if (outfmt == OUTFMT_PNG) {
-#if PNG_FOUND
-		FILE *outfp = stdout;
-		if (outfile != NULL) {
-			fprintf(stderr, "Output PNG: %s\n", outfile);
-			outfp = fopen(outfile, "wb");
-			if (outfp == NULL) {
-				perror(outfile);
+		case 'R':
+			job.relief = parse_relief(optarg);
+			if ((int) job.relief < 0) {
+				fprintf(stderr, "Unknown relief %s\n", optarg);
 				exit(EXIT_FAILURE);
 			}
-		} else {
-			fprintf(stderr, "Output PNG: stdout\n");
-		}
-		png_structp png_ptr;
-		png_infop info_ptr;
+			break;
 
-		png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, fail, fail, fail);
-		if (png_ptr == NULL) {
-			fprintf(stderr, "PNG failure (write struct)\n");
-			exit(EXIT_FAILURE);
-		}
-		info_ptr = png_create_info_struct(png_ptr);
-		if (info_ptr == NULL) {
-			png_destroy_write_struct(&png_ptr, NULL);
-			fprintf(stderr, "PNG failure (info struct)\n");
-			exit(EXIT_FAILURE);
-		}
+		case 'q':
+			queryfile = optarg;
+			break;
 
-		png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-		png_set_rows(png_ptr, info_ptr, rows);
-		png_init_io(png_ptr, outfp);
-		png_write_png(png_ptr, info_ptr, 0, NULL);
-		png_destroy_write_struct(&png_ptr, &info_ptr);
+		case 'L':
+			step = atof(optarg);
+			if (step <= 0) {
+				fprintf(stderr, "Polyline step must be positive: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
 
-		if (outfile != NULL) {
-			fclose(outfp);
-		}
-#else
-		fprintf(stderr, "stitch was compiled without PNG support, sorry\n");
-		exit(EXIT_FAILURE);
-#endif
-	}
+		case 'b':
+			jobfile = optarg;
+			break;
 
-	else if (outfmt == OUTFMT_GEOTIFF) {
-#if GEOTIFF_FOUND
+		case 'j':
+			parallel = atoi(optarg);
+			if (parallel <= 0) {
+				fprintf(stderr, "Number of parallel jobs must be positive: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
 
-		//TODO : Handle writing to stdout if required
+		case 'W':
+			job.outwidth = atoi(optarg);
+			break;
 
-		if (outfile != NULL) {
-			fprintf(stderr, "Output TIFF: %s\n", outfile);
-			TIFF *tif = (TIFF *) 0;  /* TIFF-level descriptor */
-			GTIF *gtif = (GTIF *) 0; /* GeoKey-level descriptor */
+		case 'H':
+			job.outheight = atoi(optarg);
+			break;
+
+		case 'r':
+			job.resolution = atof(optarg);
+			break;
 
-			tif = XTIFFOpen(outfile, "w");
-			if (!tif) {
-				fprintf(stderr, "TIF failure (open)\n");
+		case 'F':
+			job.filter = parse_resample_filter(optarg);
+			if ((int) job.filter < 0) {
+				fprintf(stderr, "Unknown resampling filter %s\n", optarg);
 				exit(EXIT_FAILURE);
 			}
+			break;
 
-			gtif = GTIFNew(tif);
-			if (!gtif) {
-				printf("GTIFF failure (geotiff struct)\n");
+		case 'p':
+			job.projection = parse_projection(optarg);
+			if ((int) job.projection < 0) {
+				fprintf(stderr, "Unknown projection %s\n", optarg);
 				exit(EXIT_FAILURE);
 			}
+			break;
 
-			//georeference the image using the upper left projected bound
-			//as a tie point, and the pixel scale
-			double pixscale[3] = {px, py, 0};
-			double tiepoints[6] = {0, 0, 0, minx, maxy, 0.0};
-			TIFFSetField(tif, TIFFTAG_GEOPIXELSCALE, 3, pixscale);
-			TIFFSetField(tif, TIFFTAG_GEOTIEPOINTS, 6, tiepoints);
-
-			TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, width);
-			TIFFSetField(tif, TIFFTAG_IMAGELENGTH, height);
-			TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
-			TIFFSetField(tif, TIFFTAG_PREDICTOR, 2);  //(horizontal differencing)
-			TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 8);
-			TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, 20L);
-			TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 4);  //RGB+ALPHA
-			TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-			TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
-
-			GTIFKeySet(gtif, GTModelTypeGeoKey, TYPE_SHORT, 1, ModelTypeProjected);
-			GTIFKeySet(gtif, GTRasterTypeGeoKey, TYPE_SHORT, 1, RasterPixelIsArea);
-			GTIFKeySet(gtif, GTCitationGeoKey, TYPE_ASCII, 0, "WGS 84 / Pseudo-Mercator");
-			GTIFKeySet(gtif, GeogCitationGeoKey, TYPE_ASCII, 0, "WGS 84");
-			GTIFKeySet(gtif, GeogAngularUnitsGeoKey, TYPE_SHORT, 1, Angular_Degree);
-			GTIFKeySet(gtif, GeogLinearUnitsGeoKey, TYPE_SHORT, 1, Linear_Meter);
-			GTIFKeySet(gtif, ProjectedCSTypeGeoKey, TYPE_SHORT, 1, 3857);
-
-			//write raster image
-			for (i = 0; i < height; i++) {
-				if (!TIFFWriteScanline(tif, rows[i], i, 0)) {
-					TIFFError("WriteImage", "failure in WriteScanline\n");
-					exit(EXIT_FAILURE);
-				}
+		case 'm':
+			job.mask = read_geojson_polygon(optarg);
+			break;
+
+		case 'S':
+			if (sscanf(optarg, "%d/%d", &job.shard, &job.nshards) != 2 || job.nshards <= 0 || job.shard < 0 || job.shard >= job.nshards) {
+				fprintf(stderr, "Shard must be i/N with 0 <= i < N: %s\n", optarg);
+				exit(EXIT_FAILURE);
 			}
+			break;
 
-			GTIFWriteKeys(gtif);
-			GTIFFree(gtif);
-			XTIFFClose(tif);
-		} else {
-			fprintf(stderr, "Can't write TIFF to stdout, sorry\n");
-			exit(EXIT_FAILURE);
-		}
-#else
-		fprintf(stderr, "stitch was compiled without GeoTIFF support, sorry\n");
-		exit(EXIT_FAILURE);
-#endif
+		case 'M':
+			merge = 1;
+			break;
 
-	}
+		case 'J':
+			job.journal = optarg;
+			break;
 
-	//write world file
-	if (writeworldfile) {
-		if (outfile != NULL) {
-			char worldfile_filename[1024];
-			char worldfilext[5];
-			double wfvals[6];
-			FILE *fp;
+		case 'U':
+			job.update = optarg;
+			break;
+
+		case 'C':
+			job.results = optarg;
+			break;
+
+		case 'V':
+			job.revalidate = 1;
+			break;
 
-			//todo, make sure the output image file has the right extension
-			if (outfmt == OUTFMT_PNG) {
-				snprintf(worldfilext, sizeof worldfilext, ".pnw");
-			} else if (outfmt == OUTFMT_GEOTIFF) {
-				snprintf(worldfilext, sizeof worldfilext, ".tfw");
+		case 'D':
+			pixel_mb = atol(optarg);
+			if (pixel_mb < 0) {
+				fprintf(stderr, "Decoded tile cache size must not be negative: %s\n", optarg);
+				exit(EXIT_FAILURE);
 			}
+			break;
 
-			strncpy(worldfile_filename, outfile, sizeof(worldfile_filename) - 4);
-			for (i = strlen(worldfile_filename) - 1; i > 0; i--) {
-				if (worldfile_filename[i] == '.') {
-					strcpy(worldfile_filename + i, worldfilext);
-					break;
-				}
+		case 'K':
+			pixel_dir = optarg;
+			break;
+
+		case 'k':
+			pixel_disk_mb = atol(optarg);
+			if (pixel_disk_mb <= 0) {
+				fprintf(stderr, "Decoded tile directory size must be positive: %s\n", optarg);
+				exit(EXIT_FAILURE);
 			}
-			if (i <= 0) {
-				strcat(worldfile_filename, worldfilext);
+			break;
+
+		case 'd':
+			daemon_loop((void *) (intptr_t) daemon_listen());
+			break;
+
+		case 'l':
+			listen_on = optarg;
+			break;
+
+		case 'P':
+			stats_path = optarg;
+			break;
+
+		case 'X':
+			trace_file = optarg;
+			break;
+
+		case 'v':
+			log_level = LOG_DEBUG;
+			break;
+
+		case 'Q':
+			log_level = LOG_ERROR;
+			break;
+
+		case 'T':
+			deadline = atoi(optarg);
+			if (deadline <= 0) {
+				fprintf(stderr, "Deadline must be a positive number of seconds: %s\n", optarg);
+				exit(EXIT_FAILURE);
 			}
+			break;
 
-			wfvals[0] = px;    // x pixel resolution
-			wfvals[1] = 0;     // rotation
-			wfvals[2] = 0;     // rotation
-			wfvals[3] = -py;   // y pix resolution - negative as y direction is inverse of raster
-			wfvals[4] = minx;  // top left x
-			wfvals[5] = maxy;  // top left y
+		case 'g':
+			job.getmap = atoi(optarg);
+			if (job.getmap <= 0) {
+				fprintf(stderr, "GetMap size must be positive: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
 
-			fp = fopen(worldfile_filename, "wt");
-			if (fp == NULL) {
-				fprintf(stderr, "Failed to open World File `%s'\n", worldfile_filename);
+		case 'Z':
+			job.minzoom = atoi(optarg);
+			if (job.minzoom < 0) {
+				fprintf(stderr, "Zoom must not be negative: %s\n", optarg);
 				exit(EXIT_FAILURE);
 			}
+			break;
 
-			for (i = 0; i < 6; i++) {
-				fprintf(fp, "%24.10f\n", wfvals[i]);
+		case 'O':
+			job.overzoom = atoi(optarg);
+			if (job.overzoom < 0) {
+				fprintf(stderr, "Overzoom levels must not be negative: %s\n", optarg);
+				exit(EXIT_FAILURE);
 			}
+			break;
 
-			fclose(fp);
-			fprintf(stderr, "World file written to '%s'.\n", worldfile_filename);
-		} else {
-			fprintf(stderr, "Can't write a worldfile when writing to stdout\n");
+		case 'o':
+			job.outfile = optarg;
+			break;
+
+		case 't':
+			job.tilesize = atoi(optarg);
+			break;
+
+		case 'c':
+			job.centered = 1;
+			break;
+
+		case 'w':
+			job.writeworldfile = TRUE;
+			break;
+
+		case 'f':
+			job.outfmt = parse_outfmt(optarg);
+			if (job.outfmt < 0) {
+				fprintf(stderr, "Unknown output format %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'h':
+			usage(argv);
+			exit(EXIT_SUCCESS);
+			break;
+		}
+	}
+
+	if (pixel_mb >= 0 || pixel_dir != NULL || listen_on != NULL) {
+		pixels = pixel_cache_new((size_t) (pixel_mb >= 0 ? pixel_mb : 256) << 20, pixel_dir, (size_t) pixel_disk_mb << 20);
+	}
+
+	// Every mode reports on its run, the server when it is stopped
+	if (stats_path != NULL) {
+		stats_init(stats_path);
+	}
+	if (trace_file != NULL) {
+		trace_init(trace_file);
+	}
+
+	if (listen_on != NULL) {
+		run_server(listen_on, &job, deadline, parallel);
+	}
+	if (log_level >= LOG_INFO) {
+		progress_init();
+	}
+
+	if (merge) {
+		if (argc - optind < 1) {
+			usage(argv);
+			exit(EXIT_FAILURE);
+		}
+		merge_shards(job.outfile, argv + optind, argc - optind);
+		run_finish();
+		return 0;
+	}
+
+	if (jobfile != NULL) {
+		if (job.outfmt == OUTFMT_CSV || job.outfmt == OUTFMT_BINARY) {
+			fprintf(stderr, "Batch jobs write images, not %s\n", job.outfmt == OUTFMT_CSV ? "CSV" : "binary");
+			exit(EXIT_FAILURE);
+		}
+		run_batch(jobfile, &job, parallel);
+		run_finish();
+		return 0;
+	}
+
+	if (queryfile != NULL) {
+		if (argc - optind < 2) {
+			usage(argv);
+			exit(EXIT_FAILURE);
+		}
+
+		if (job.encoding == ELEVATION_DEFAULT) {
+			job.encoding = layers_elevation_encoding(argv + optind + 1, argc - optind - 1);
 		}
+
+		run_query(queryfile, step, atoi(argv[optind]), (const char **) argv + optind + 1, argc - optind - 1,
+			get_elevation_decoder(job.encoding), job.tilesize, job.outfmt, job.outfile, parallel);
+		run_finish();
+		return 0;
+	}
+
+	if (job.outfmt == OUTFMT_CSV || job.outfmt == OUTFMT_BINARY) {
+		fprintf(stderr, "CSV and binary output are only for -q queries\n");
+		exit(EXIT_FAILURE);
 	}
+
+	// With a mask, the area is its bounding box and only the zoom and
+	// layers are given
+	int area = job.mask != NULL && !job.centered ? 0 : 4;
+
+	if (argc - optind < area + 2) {
+		usage(argv);
+		exit(EXIT_FAILURE);
+	}
+
+	if (area == 0) {
+		polygon_bounds(job.mask, &job.minlat, &job.minlon, &job.maxlat, &job.maxlon);
+	} else {
+		job.minlat = atof(argv[optind]);
+		job.minlon = atof(argv[optind + 1]);
+		job.maxlat = atof(argv[optind + 2]);
+		job.maxlon = atof(argv[optind + 3]);
+	}
+	job.zoom = atoi(argv[optind + area]);
+	job.layers = (const char **) argv + optind + area + 1;
+	job.nlayers = argc - optind - area - 1;
+
+	if (job.centered) {
+		job.width = atoi(argv[optind + 2]);
+		job.height = atoi(argv[optind + 3]);
+	}
+
+	if (job.outfile == NULL && isatty(1)) {
+		fprintf(stderr, "Didn't specify -o and standard output is a terminal\n");
+		exit(EXIT_FAILURE);
+	}
+
+	run_job(&job);
+	run_finish();
 	return 0;
 }
+#endif
@@ -0,0 +1,82 @@
+#ifndef STITCH_H
+#define STITCH_H
+
+// libstitch renders the same stitches as the stitch command, in the calling
+// process. A context keeps what renders can share: the connection pool, DNS
+// cache and TLS sessions of the tile servers, and the decoded tile cache.
+// Renders on different threads can share one context.
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	STITCH_OK = 0,
+	STITCH_ERR_ARGS,         // the request can't be rendered as asked
+	STITCH_ERR_MEMORY,       // out of memory
+	STITCH_ERR_FETCH,        // a tile server couldn't be reached
+	STITCH_ERR_DECODE,       // a tile, cache entry or input file is corrupt
+	STITCH_ERR_IO,           // a file can't be read or written
+	STITCH_ERR_UNSUPPORTED,  // needs a library stitch was built without
+	STITCH_ERR_INTERNAL,     // a thread can't be started, or a bug
+	STITCH_ERR_CANCELLED     // the request's cancel callback gave up on it
+} stitch_status;
+
+typedef struct stitch_ctx stitch_ctx;
+
+// Receives the encoded output, a piece at a time as it is encoded. Returns
+// nonzero to fail the render with STITCH_ERR_IO.
+typedef int (*stitch_write_fn)(void *user, const void *buf, size_t len);
+
+// What to stitch. Zeroed fields take the defaults of the command line, and
+// names are the ones its options take.
+struct stitch_request {
+	double minlat, minlon, maxlat, maxlon;
+	int centered;             // minlat/minlon is the center of a width x height image
+	int width, height;
+	int zoom;
+	const char **layers;      // URL templates or preset names
+	int nlayers;
+
+	const char *format;       // png, geotiff or float32
+	const char *encoding;     // of elevation tiles: terrarium, mapbox or normal
+	const char *relief;       // hillshade or slope
+	const char *filter;       // for resampling: box, bilinear or lanczos
+	const char *projection;   // of the output: mercator or geographic
+	int tilesize;
+	int elevation;
+	int outwidth, outheight;  // output size in pixels
+	double resolution;        // or output pixel size in meters
+	int overzoom;
+	int getmap;               // largest window to ask WMS layers for, in pixels
+	int worldfile;            // next to outfile
+
+	// The output goes to outfile, or else to write, which gets PNG only
+	const char *outfile;
+	stitch_write_fn write;
+	void *user;               // of write and cancel
+
+	// If set, asked between tiles and during transfers, possibly from other
+	// threads; returning nonzero stops the render with STITCH_ERR_CANCELLED
+	int (*cancel)(void *user);
+};
+
+// A context with a decoded tile cache of up to decoded_bytes, or none if 0.
+// Returns NULL if it can't be made.
+stitch_ctx *stitch_ctx_new(size_t decoded_bytes);
+void stitch_ctx_free(stitch_ctx *ctx);
+
+// Renders a request. Progress and errors are reported on stderr as the
+// command does. A render that fails frees what it allocated and closes what
+// it opened before it returns.
+stitch_status stitch_render(stitch_ctx *ctx, const struct stitch_request *req);
+
+const char *stitch_strerror(stitch_status status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
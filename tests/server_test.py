@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+# Runs stitch -l against a mock tile server on localhost and checks what the
+# server mode promises: concurrent requests get the same chunked PNG, each
+# tile is fetched from upstream once, bad requests are refused, a request
+# past -T gets a 504, and the daemon socket is gone after the server exits.
+# It also stitches a small world map, which comes from the single zoom 0 tile.
+#
+#   python3 tests/server_test.py path/to/stitch
+
+import http.client
+import http.server
+import os
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import zlib
+
+BBOX = '37.7,-122.5,37.8,-122.4'
+SIZE = (292, 368)  # of BBOX at zoom 12
+
+
+def png(size, rgba):
+    def chunk(kind, data):
+        return struct.pack('>I', len(data)) + kind + data + struct.pack('>I', zlib.crc32(kind + data))
+    raw = b''.join(b'\0' + bytes(rgba) * size for _ in range(size))
+    return (b'\x89PNG\r\n\x1a\n' + chunk(b'IHDR', struct.pack('>IIBBBBB', size, size, 8, 6, 0, 0, 0)) +
+            chunk(b'IDAT', zlib.compress(raw)) + chunk(b'IEND', b''))
+
+
+class Tiles(http.server.BaseHTTPRequestHandler):
+    # /tiles/z/x/y.png answers after a moment, so that concurrent requests
+    # overlap; /slow/ answers after longer than the server's deadline
+    protocol_version = 'HTTP/1.1'
+    fetches = {}
+    lock = threading.Lock()
+
+    def log_message(self, *args):
+        pass
+
+    def do_GET(self):
+        with Tiles.lock:
+            Tiles.fetches[self.path] = Tiles.fetches.get(self.path, 0) + 1
+        parts = self.path.split('/')
+        time.sleep(10 if parts[1] == 'slow' else 0.2)
+        body = png(256, (int(parts[3]) % 256, int(parts[4].split('.')[0]) % 256, 128, 255))
+        self.send_response(200)
+        self.send_header('Content-Type', 'image/png')
+        self.send_header('Cache-Control', 'public, max-age=60')
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(('127.0.0.1', 0))
+        return s.getsockname()[1]
+
+
+def get(port, query, results=None, timeout=30):
+    conn = http.client.HTTPConnection('127.0.0.1', port, timeout=timeout)
+    conn.request('GET', query)
+    resp = conn.getresponse()
+    result = (resp.status, resp.getheader('Transfer-Encoding'), resp.read())
+    conn.close()
+    if results is not None:
+        results.append(result)
+    return result
+
+
+def check(what, ok):
+    print(('ok    ' if ok else 'FAIL  ') + what)
+    if not ok:
+        check.failed = True
+
+
+check.failed = False
+
+
+def main():
+    stitch = sys.argv[1]
+    tiles = http.server.ThreadingHTTPServer(('127.0.0.1', 0), Tiles)
+    threading.Thread(target=tiles.serve_forever, daemon=True).start()
+    upstream = 'http://127.0.0.1:%d' % tiles.server_address[1]
+    layer = upstream + '/tiles/%7Bz%7D/%7Bx%7D/%7By%7D.png'
+
+    port = free_port()
+    env = dict(os.environ)
+    env.pop('STITCH_SOCKET', None)
+    server = subprocess.Popen([stitch, '-j', '4', '-T', '2', '-l', '127.0.0.1:%d' % port],
+                              stderr=subprocess.PIPE, env=env, text=True)
+    for _ in range(50):
+        try:
+            socket.create_connection(('127.0.0.1', port), timeout=1).close()
+            break
+        except OSError:
+            time.sleep(0.1)
+
+    try:
+        query = '/stitch?bbox=%s&zoom=12&layers=%s' % (BBOX, layer)
+        results = []
+        clients = [threading.Thread(target=get, args=(port, query, results)) for _ in range(6)]
+        for c in clients:
+            c.start()
+        for c in clients:
+            c.join()
+
+        check('concurrent requests all succeed', [r[0] for r in results] == [200] * 6)
+        check('responses are chunked', all(r[1] == 'chunked' for r in results))
+        body = results[0][2]
+        check('response is a complete PNG', body[:8] == b'\x89PNG\r\n\x1a\n' and body.endswith(b'IEND\xaeB`\x82'))
+        check('PNG is the size of the bbox', struct.unpack('>II', body[16:24]) == SIZE)
+        check('concurrent requests get the same image', all(r[2] == body for r in results))
+        check('each tile is fetched once', len(Tiles.fetches) == 6 and set(Tiles.fetches.values()) == {1})
+
+        check('a bad query is refused', get(port, '/stitch?bbox=1,2&zoom=x')[0] == 400)
+        check('a file layer is refused', get(port, '/stitch?bbox=%s&zoom=12&layers=/etc/passwd' % BBOX)[0] == 400)
+        check('other paths are not found', get(port, '/')[0] == 404)
+
+        slow = upstream + '/slow/%7Bz%7D/%7Bx%7D/%7By%7D.png'
+        start = time.time()
+        status = get(port, '/stitch?bbox=%s&zoom=12&layers=%s' % (BBOX, slow))[0]
+        check('a request past its deadline gets a 504', status == 504 and time.time() - start < 5)
+
+        check('the server still serves after that', get(port, query)[0] == 200)
+    finally:
+        server.send_signal(signal.SIGTERM)
+        server.wait(timeout=10)
+        log = server.stderr.read()
+        tiles.shutdown()
+
+    sockets = [line.split(' on ')[1] for line in log.splitlines() if line.startswith('==Daemon listening on ')]
+    check('the daemon socket is removed on exit', len(sockets) == 1 and not os.path.exists(os.path.dirname(sockets[0])))
+
+    tiles = http.server.ThreadingHTTPServer(('127.0.0.1', 0), Tiles)
+    threading.Thread(target=tiles.serve_forever, daemon=True).start()
+    layer = 'http://127.0.0.1:%d/tiles/{z}/{x}/{y}.png' % tiles.server_address[1]
+    Tiles.fetches = {}
+    with tempfile.TemporaryDirectory() as tmp:
+        out = os.path.join(tmp, 'world.png')
+        try:
+            world = subprocess.run([stitch, '-W', '64', '-o', out, '--', '-80', '-170', '80', '170', '3', layer],
+                                   stderr=subprocess.PIPE, env=env, text=True, timeout=30)
+            log += world.stderr
+            ok = world.returncode == 0
+        except subprocess.TimeoutExpired:
+            ok = False
+        finally:
+            tiles.shutdown()
+        check('a world map is stitched from the zoom 0 tile',
+              ok and list(Tiles.fetches) == ['/tiles/0/0/0.png'] and open(out, 'rb').read(20)[16:20] == struct.pack('>I', 64))
+
+    if check.failed:
+        sys.stderr.write(log)
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()